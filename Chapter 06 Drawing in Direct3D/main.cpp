@@ -241,7 +241,10 @@ bool TestApp::Init()
 
 			mWavesGenerator.Init(200, 200, 0.8f, 0.3f, 3.25f, 0.4f);
 
-			mMesh.mVertices.insert(mMesh.mVertices.end(), mWavesGenerator.mCurrVertices.begin(), mWavesGenerator.mCurrVertices.end());
+			std::vector<GeometryGenerator::Vertex> WavesVertices;
+			mWavesGenerator.GetVertices(WavesVertices);
+
+			mMesh.mVertices.insert(mMesh.mVertices.end(), WavesVertices.begin(), WavesVertices.end());
 			mMesh.mIndices.insert(mMesh.mIndices.end(), waves.mIndices.begin(), waves.mIndices.end());
 
 			mWaves.mVertexStart = mGrid.mVertexStart + grid.mVertices.size();
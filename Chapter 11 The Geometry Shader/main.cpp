@@ -59,6 +59,7 @@ public:
 	GameObject mTree;
 
 	GeometryGenerator::Waves mWavesGenerator;
+	std::vector<std::pair<UINT, UINT>> mWavesDirtyRows;
 
 	std::vector<GameObject*> mObjects;
 
@@ -633,9 +634,9 @@ bool TestApp::Init()
 		{
 			D3D11_BUFFER_DESC desc;
 			desc.ByteWidth = sizeof(GeometryGenerator::Vertex) * mWaves.mMesh.mVertices.size();
-			desc.Usage = D3D11_USAGE_DYNAMIC;
+			desc.Usage = D3D11_USAGE_DEFAULT; // only the dirty rows are updated every frame
 			desc.BindFlags = D3D11_BIND_VERTEX_BUFFER;
-			desc.CPUAccessFlags = D3D11_CPU_ACCESS_WRITE;
+			desc.CPUAccessFlags = 0;
 			desc.MiscFlags = 0;
 			desc.StructureByteStride = 0;
 
@@ -870,18 +871,32 @@ void TestApp::UpdateScene(float dt)
 
 	mWavesGenerator.Update(dt);
 
-	D3D11_MAPPED_SUBRESOURCE MappedData;
+	// upload only the rows of the sleeping-tile grid that changed, calm water costs nothing
+	{
+		mWavesGenerator.GetDirtyRows(mWavesDirtyRows);
 
-	HR(mContext->Map(mWaves.mVertexBuffer.Get(), 0, D3D11_MAP_WRITE_DISCARD, 0, &MappedData));
+		for (const std::pair<UINT, UINT>& rows : mWavesDirtyRows)
+		{
+			UINT first = rows.first * mWavesGenerator.mCols;
+			UINT count = (rows.second - rows.first) * mWavesGenerator.mCols;
 
-	GeometryGenerator::Vertex* vertex = reinterpret_cast<GeometryGenerator::Vertex*>(MappedData.pData);
+			GeometryGenerator::Vertex* vertex = mWaves.mMesh.mVertices.data() + first;
 
-	for (std::size_t i = 0; i < mWaves.mMesh.mVertices.size(); i++)
-	{
-		vertex[i] = mWavesGenerator[i];
-	}
+			mWavesGenerator.GetVertices(vertex, first, count);
 
-	mContext->Unmap(mWaves.mVertexBuffer.Get(), 0);
+			D3D11_BOX box;
+			box.left = sizeof(GeometryGenerator::Vertex) * first;
+			box.right = sizeof(GeometryGenerator::Vertex) * (first + count);
+			box.top = 0;
+			box.bottom = 1;
+			box.front = 0;
+			box.back = 1;
+
+			mContext->UpdateSubresource(mWaves.mVertexBuffer.Get(), 0, &box, vertex, 0, 0);
+		}
+
+		mWavesGenerator.ClearDirtyRows();
+	}
 
 	auto GetHillHeight = [](float x, float z) -> float
 	{
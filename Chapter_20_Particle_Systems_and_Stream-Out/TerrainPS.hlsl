@@ -63,6 +63,7 @@ Texture2DArray gLayerMapTextureArray : register(t1);
 Texture2D gBlendMapTexture : register(t2);
 Texture2D gShadowMapTexture : register(t3);
 Texture2D gAmbientMapTexture : register(t4);
+Texture2D gNormalMapTexture : register(t5);
 
 SamplerState gHeightMapSamplerState : register(s0);
 SamplerState gLinearSamplerState : register(s1);
@@ -143,9 +144,14 @@ struct DomainOut
 
 float4 main(DomainOut pin) : SV_Target
 {
-	// estimate normal and tangent using central differences
-	float3 N;
+	// normal baked on the CPU from central differences of the heights, see TerrainObject::BakeMaps;
+	// streaming mode binds no normal map, an unbound texture reads 0
+	float3 N = gNormalMapTexture.Sample(gLinearSamplerState, pin.TexCoord).xyz;
+
+	[branch]
+	if (dot(N, N) == 0.0f)
 	{
+		// estimate normal and tangent using central differences
 		float2 l = pin.TexCoord + float2(-gTexelCellSpaceU, 0.0f); // left texel
 		float2 r = pin.TexCoord + float2(+gTexelCellSpaceU, 0.0f); // right texel
 		float2 b = pin.TexCoord + float2(0.0f, +gTexelCellSpaceV); // bottom texel
@@ -162,6 +168,8 @@ float4 main(DomainOut pin) : SV_Target
 		N = cross(T, B);
 	}
 
+	N = normalize(N);
+
 	float3 E = gEyePositionW - pin.PositionW; // the eye vector is oriented from the surface to the eye position
 	float DistToEye = length(E);
 	E /= DistToEye;
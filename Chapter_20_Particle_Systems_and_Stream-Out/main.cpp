@@ -320,7 +320,10 @@ bool TestApp::Init()
 		info.HeightMapDepth = 2049;
 		info.CellSpacing = 0.5f;
 
-		mTerrainObject.init(mDevice, mContext, mTextureManager, info);
+		if (!mTerrainObject.init(mDevice, mContext, mTextureManager, info))
+		{
+			return false;
+		}
 	}
 
 	// particle systems
@@ -460,6 +463,9 @@ void TestApp::UpdateScene(float dt)
 	mRain.update(dt, mTimer.TotalTime());
 
 	mCamera.UpdateView();
+
+	// the shadow pass still draws every patch, casters outside the view matter
+	mTerrainObject.UpdateVisiblePatches(mContext, mCamera);
 }
 
 void TestApp::DrawSceneToShadowMap()
@@ -1048,7 +1054,7 @@ void TestApp::DrawScene()
 			UINT offset = 0;
 
 			mContext->IASetVertexBuffers(0, 1, &mTerrainObject.mPatchQuadVB, &stride, &offset);
-			mContext->IASetIndexBuffer(mTerrainObject.mPatchQuadIB, DXGI_FORMAT_R32_UINT, 0);
+			mContext->IASetIndexBuffer(mTerrainObject.mVisiblePatchQuadIB, DXGI_FORMAT_R32_UINT, 0);
 		}
 
 		// rasterizer, blend and depth-stencil states
@@ -1152,6 +1158,9 @@ void TestApp::DrawScene()
 				mShadowMap.GetSRV()
 			};
 			mContext->PSSetShaderResources(0, 4, SRVs);
+
+			// t4 is the ambient map
+			mContext->PSSetShaderResources(5, 1, &mTerrainObject.mNormalMapSRV);
 		}
 
 		// sampler states
@@ -1166,7 +1175,7 @@ void TestApp::DrawScene()
 
 		// draw call
 		{
-			mContext->DrawIndexed(mTerrainObject.mPatchQuadFaces * 4, 0, 0);
+			mContext->DrawIndexed(mTerrainObject.mVisiblePatchQuadFaces * 4, 0, 0);
 		}
 
 		// unbind SRVs
@@ -1177,6 +1186,7 @@ void TestApp::DrawScene()
 
 			ID3D11ShaderResourceView* const NullSRVs[4] = { nullptr, nullptr, nullptr, nullptr };
 			mContext->PSSetShaderResources(0, 4, NullSRVs);
+			mContext->PSSetShaderResources(5, 1, NullSRV);
 		}
 
 		// unbind shaders
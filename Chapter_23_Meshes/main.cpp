@@ -659,10 +659,15 @@ bool TestApp::Init()
 			HR(mDevice->CreateBuffer(&desc, &InitData, &IB));
 		}
 
+		// position/texcoord/normal streams for the shadow map and normal depth passes
+		std::array<Microsoft::WRL::ComPtr<ID3D11Buffer>, 3> SplitVBs;
+		GameObject::CreateSplitVertexBuffers(mDevice, vertices, SplitVBs);
+
 		for (GameObject* obj : objects)
 		{
 			obj->mVertexBuffer = VB;
 			obj->mIndexBuffer = IB;
+			obj->mSplitVertexBuffers = SplitVBs;
 		}
 	}
 
@@ -924,12 +929,19 @@ void TestApp::DrawSceneToShadowMap()
 		}
 
 		// input layout
-		mContext->IASetInputLayout(mShadowMap.GetIL());
+		mContext->IASetInputLayout(mShadowMap.GetIL(false, obj->HasSplitVertexBuffers()));
 
 		// primitive topology
 		mContext->IASetPrimitiveTopology(obj->mPrimitiveTopology);
 
 		// vertex and index buffers
+		if (obj->HasSplitVertexBuffers())
+		{
+			// no alpha clipping in this pass, a single texcoord is fetched
+			obj->SetSplitVertexBuffers(mContext, false, false);
+			mContext->IASetIndexBuffer(obj->mIndexBuffer.Get(), DXGI_FORMAT_R32_UINT, 0);
+		}
+		else
 		{
 			UINT stride = sizeof(GeometryGenerator::Vertex);
 			UINT offset = 0;
@@ -1093,12 +1105,19 @@ void TestApp::DrawSceneToSSAONormalDepthMap()
 		}
 
 		// input layout
-		mContext->IASetInputLayout(mSSAO.GetNormalDepthIL());
+		mContext->IASetInputLayout(mSSAO.GetNormalDepthIL(false, obj->HasSplitVertexBuffers()));
 
 		// primitive topology
 		mContext->IASetPrimitiveTopology(obj->mPrimitiveTopology);
 
 		// vertex and index buffers
+		if (obj->HasSplitVertexBuffers())
+		{
+			// no alpha clipping in this pass, a single texcoord is fetched
+			obj->SetSplitVertexBuffers(mContext, false, true);
+			mContext->IASetIndexBuffer(obj->mIndexBuffer.Get(), DXGI_FORMAT_R32_UINT, 0);
+		}
+		else
 		{
 			UINT stride = sizeof(GeometryGenerator::Vertex);
 			UINT offset = 0;
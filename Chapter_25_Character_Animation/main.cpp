@@ -87,6 +87,9 @@ public:
 
 	std::vector<GameObjectInstance*> mObjectInstances;
 
+	// shared by the character updates, they run on this thread
+	SkinnedObject::Scratch mSkinningScratch;
+
 	std::array<LightDirectional, 3> mLights;
 	XMFLOAT3 mLightsCache[3];
 	float mLightAngle;
@@ -536,6 +539,7 @@ bool TestApp::Init()
 		//mRock.LoadModel(mDevice, mTextureManager, "rock.m3d");
 
 		mCharacter.LoadModel(mDevice, mTextureManager, "soldier.m3d", true);
+		mCharacter.mSkinnedData.BakeAnimationClips();
 
 		// VS
 		{
@@ -615,14 +619,12 @@ bool TestApp::Init()
 
 		mCharacterInstance1.obj = &mCharacter;
 		mCharacterInstance1.world = XMMatrixScaling(0.05f, 0.05f, -0.05f) * XMMatrixRotationY(XM_PI) * XMMatrixTranslation(-2.0f, 0.0f, -7.0f);
-		mCharacterInstance1.ClipName = "Take1";
-		mCharacterInstance1.transforms.resize(mCharacterInstance1.obj->mSkinnedData.mBoneHierarchy.size());
+		mCharacterInstance1.SetClip("Take1");
 		mObjectInstances.push_back(&mCharacterInstance1);
 
 		mCharacterInstance2.obj = &mCharacter;
 		mCharacterInstance2.world = XMMatrixScaling(0.05f, 0.05f, -0.05f) * XMMatrixRotationY(XM_PI) * XMMatrixTranslation(+2.0f, 0.0f, -7.0f);;
-		mCharacterInstance2.ClipName = "Take1";
-		mCharacterInstance2.transforms.resize(mCharacterInstance2.obj->mSkinnedData.mBoneHierarchy.size());
+		mCharacterInstance2.SetClip("Take1");
 		mObjectInstances.push_back(&mCharacterInstance2);
 	}
 
@@ -709,10 +711,15 @@ bool TestApp::Init()
 			HR(mDevice->CreateBuffer(&desc, &InitData, &IB));
 		}
 
+		// position/texcoord/normal streams for the shadow map and normal depth passes
+		std::array<Microsoft::WRL::ComPtr<ID3D11Buffer>, 3> SplitVBs;
+		GameObject::CreateSplitVertexBuffers(mDevice, vertices, SplitVBs);
+
 		for (GameObject* obj : objects)
 		{
 			obj->mVertexBuffer = VB;
 			obj->mIndexBuffer = IB;
+			obj->mSplitVertexBuffers = SplitVBs;
 		}
 	}
 
@@ -830,8 +837,8 @@ void TestApp::UpdateScene(float dt)
 	//}
 
 	// update characters animation
-	mCharacterInstance1.update(dt);
-	mCharacterInstance2.update(dt);
+	mCharacterInstance1.update(dt, mSkinningScratch);
+	mCharacterInstance2.update(dt, mSkinningScratch);
 
 	// build shadow transform
 	mShadowMap.BuildTranform(mLights[0].mDirection, mSceneBounds);
@@ -950,12 +957,19 @@ void TestApp::DrawSceneToShadowMap()
 		}
 
 		// input layout
-		mContext->IASetInputLayout(mShadowMap.GetIL(obj->mIsSkinned));
+		mContext->IASetInputLayout(mShadowMap.GetIL(obj->mIsSkinned, obj->HasSplitVertexBuffers()));
 
 		// primitive topology
 		mContext->IASetPrimitiveTopology(obj->mPrimitiveTopology);
 
 		// vertex and index buffers
+		if (obj->HasSplitVertexBuffers())
+		{
+			// no alpha clipping in this pass, a single texcoord is fetched
+			obj->SetSplitVertexBuffers(mContext, false, false);
+			mContext->IASetIndexBuffer(obj->mIndexBuffer.Get(), DXGI_FORMAT_R32_UINT, 0);
+		}
+		else
 		{
 			UINT stride = sizeof(GeometryGenerator::Vertex);
 			UINT offset = 0;
@@ -1127,12 +1141,18 @@ void TestApp::DrawSceneToSSAONormalDepthMap()
 		}
 
 		// input layout
-		mContext->IASetInputLayout(mSSAO.GetNormalDepthIL(obj->mIsSkinned));
+		mContext->IASetInputLayout(mSSAO.GetNormalDepthIL(obj->mIsSkinned, obj->HasSplitVertexBuffers()));
 
 		// primitive topology
 		mContext->IASetPrimitiveTopology(obj->mPrimitiveTopology);
 
 		// vertex and index buffers
+		if (obj->HasSplitVertexBuffers())
+		{
+			// bound per subset below
+			mContext->IASetIndexBuffer(obj->mIndexBuffer.Get(), DXGI_FORMAT_R32_UINT, 0);
+		}
+		else
 		{
 			UINT stride = sizeof(GeometryGenerator::Vertex);
 			UINT offset = 0;
@@ -1182,6 +1202,12 @@ void TestApp::DrawSceneToSSAONormalDepthMap()
 				mContext->PSSetShader(mSSAO.GetNormalDepthPS(obj->mIsAlphaClipping[i]), nullptr, 0);
 			}
 
+			// texcoords are fetched per vertex only for alpha clipped subsets
+			if (obj->HasSplitVertexBuffers())
+			{
+				obj->SetSplitVertexBuffers(mContext, obj->mIsAlphaClipping[i], true);
+			}
+
 			// bind SRVs
 			{
 				mContext->PSSetShaderResources(0, 1, &obj->mDiffuseMapSRVs[i]);
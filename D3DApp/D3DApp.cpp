@@ -3,6 +3,10 @@
 #include <sstream>
 #include <cassert>
 #include <vector>
+#include <unordered_map>
+#include <cstdint>
+#include <queue>
+#include <cstring>
 //#include <cstdlib>
 
 #include <directxpackedvector.h>
@@ -89,6 +93,167 @@ float GameTimer::TotalTime() const
 	return (float)((((mStopped ? mStopTime : mCurrTime) - mPauseTime) - mBaseTime) * mSecondsPerCount);
 }
 
+ThreadPool::ThreadPool(UINT threads) :
+	mTask(nullptr),
+	mPendingTasks(0),
+	mGeneration(0),
+	mQuit(false)
+{
+	if (threads == 0)
+	{
+		threads = std::max(1u, std::thread::hardware_concurrency());
+	}
+
+	for (UINT i = 0; i < threads; i++)
+	{
+		mQueues.push_back(std::make_unique<TaskQueue>());
+	}
+
+	// the last queue belongs to the thread calling ParallelFor
+	for (UINT i = 0; i < threads - 1; i++)
+	{
+		mThreads.emplace_back(&ThreadPool::WorkerLoop, this, i);
+	}
+}
+
+ThreadPool::~ThreadPool()
+{
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		mQuit = true;
+	}
+
+	mWakeCV.notify_all();
+
+	for (std::thread& thread : mThreads)
+	{
+		thread.join();
+	}
+}
+
+void ThreadPool::ParallelFor(UINT count, const std::function<void(UINT)>& task)
+{
+	if (count == 0)
+	{
+		return;
+	}
+
+	if (mThreads.empty() || count == 1)
+	{
+		for (UINT i = 0; i < count; i++)
+		{
+			task(i);
+		}
+
+		return;
+	}
+
+	std::lock_guard<std::mutex> dispatch(mDispatchMutex);
+
+	mTask = &task;
+	mPendingTasks = count;
+
+	// contiguous ranges per queue, so neighbouring tasks tend to run on the same thread
+	const UINT queues = GetThreadCount();
+
+	for (UINT q = 0; q < queues; q++)
+	{
+		std::lock_guard<std::mutex> lock(mQueues[q]->mMutex);
+
+		for (UINT i = q * count / queues; i < (q + 1) * count / queues; i++)
+		{
+			mQueues[q]->mTasks.push_back(i);
+		}
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		mGeneration++;
+	}
+
+	mWakeCV.notify_all();
+
+	RunTasks(queues - 1);
+
+	std::unique_lock<std::mutex> lock(mMutex);
+	mDoneCV.wait(lock, [this]() { return mPendingTasks == 0; });
+}
+
+void ThreadPool::WorkerLoop(UINT index)
+{
+	UINT generation = 0;
+
+	while (true)
+	{
+		{
+			std::unique_lock<std::mutex> lock(mMutex);
+			mWakeCV.wait(lock, [&]() { return mQuit || mGeneration != generation; });
+
+			if (mQuit)
+			{
+				return;
+			}
+
+			generation = mGeneration;
+		}
+
+		RunTasks(index);
+	}
+}
+
+void ThreadPool::RunTasks(UINT index)
+{
+	UINT task;
+
+	while (PopTask(index, task) || StealTask(index, task))
+	{
+		(*mTask)(task);
+
+		if (--mPendingTasks == 0)
+		{
+			std::lock_guard<std::mutex> lock(mMutex);
+			mDoneCV.notify_all();
+		}
+	}
+}
+
+bool ThreadPool::PopTask(UINT index, UINT& task)
+{
+	TaskQueue& queue = *mQueues[index];
+	std::lock_guard<std::mutex> lock(queue.mMutex);
+
+	if (queue.mTasks.empty())
+	{
+		return false;
+	}
+
+	task = queue.mTasks.front();
+	queue.mTasks.pop_front();
+
+	return true;
+}
+
+bool ThreadPool::StealTask(UINT index, UINT& task)
+{
+	const UINT queues = GetThreadCount();
+
+	for (UINT k = 1; k < queues; k++)
+	{
+		TaskQueue& queue = *mQueues[(index + k) % queues];
+		std::lock_guard<std::mutex> lock(queue.mMutex);
+
+		if (!queue.mTasks.empty())
+		{
+			task = queue.mTasks.back();
+			queue.mTasks.pop_back();
+
+			return true;
+		}
+	}
+
+	return false;
+}
+
 D3DApp::D3DApp() :
 	mAppPaused(false),
 	mResizing(false),
@@ -899,45 +1064,60 @@ void GeometryGenerator::CreateSphere(float radius, UINT n, Mesh& mesh)
 
 	auto subdivide = [&]()
 	{
-		Mesh copy = mesh;
+		// closed mesh, every edge is shared by two triangles and adds one vertex
+		const UINT triangles = static_cast<UINT>(mesh.mIndices.size() / 3);
+		const UINT edges = static_cast<UINT>(mesh.mIndices.size() / 2);
 
-		mesh.mVertices.clear();
-		mesh.mIndices.clear();
+		mesh.mVertices.reserve(mesh.mVertices.size() + edges);
 
-		for (UINT i = 0; i < (copy.mIndices.size() / 3); i++)
+		std::vector<UINT> indices(triangles * 12);
+
+		std::unordered_map<std::uint64_t, UINT> midpoints;
+		midpoints.reserve(edges);
+
+		auto GetMidpoint = [&](UINT a, UINT b) -> UINT
 		{
-			Vertex v0 = copy.mVertices.at(copy.mIndices.at(i * 3 + 0));
-			Vertex v1 = copy.mVertices.at(copy.mIndices.at(i * 3 + 1));
-			Vertex v2 = copy.mVertices.at(copy.mIndices.at(i * 3 + 2));
+			std::uint64_t key = (a < b) ? ((std::uint64_t)a << 32 | b) : ((std::uint64_t)b << 32 | a);
+
+			auto it = midpoints.find(key);
+
+			if (it != midpoints.end())
+			{
+				return it->second;
+			}
+
+			const XMFLOAT3& pa = mesh.mVertices[a].mPosition;
+			const XMFLOAT3& pb = mesh.mVertices[b].mPosition;
+
+			Vertex m;
+			m.mPosition = XMFLOAT3(0.5f * (pa.x + pb.x), 0.5f * (pa.y + pb.y), 0.5f * (pa.z + pb.z));
 
-			Vertex m0, m1, m2;
-			m0.mPosition = XMFLOAT3(0.5f * (v0.mPosition.x + v1.mPosition.x), 0.5f * (v0.mPosition.y + v1.mPosition.y), 0.5f * (v0.mPosition.z + v1.mPosition.z));
-			m1.mPosition = XMFLOAT3(0.5f * (v1.mPosition.x + v2.mPosition.x), 0.5f * (v1.mPosition.y + v2.mPosition.y), 0.5f * (v1.mPosition.z + v2.mPosition.z));
-			m2.mPosition = XMFLOAT3(0.5f * (v2.mPosition.x + v0.mPosition.x), 0.5f * (v2.mPosition.y + v0.mPosition.y), 0.5f * (v2.mPosition.z + v0.mPosition.z));
+			UINT index = static_cast<UINT>(mesh.mVertices.size());
+			mesh.mVertices.push_back(m);
+			midpoints.emplace(key, index);
 
-			mesh.mVertices.push_back(v0);
-			mesh.mVertices.push_back(v1);
-			mesh.mVertices.push_back(v2);
-			mesh.mVertices.push_back(m0);
-			mesh.mVertices.push_back(m1);
-			mesh.mVertices.push_back(m2);
+			return index;
+		};
 
-			mesh.mIndices.push_back(i * 6 + 0);
-			mesh.mIndices.push_back(i * 6 + 3);
-			mesh.mIndices.push_back(i * 6 + 5);
+		for (UINT i = 0; i < triangles; i++)
+		{
+			UINT v0 = mesh.mIndices[i * 3 + 0];
+			UINT v1 = mesh.mIndices[i * 3 + 1];
+			UINT v2 = mesh.mIndices[i * 3 + 2];
 
-			mesh.mIndices.push_back(i * 6 + 3);
-			mesh.mIndices.push_back(i * 6 + 4);
-			mesh.mIndices.push_back(i * 6 + 5);
+			UINT m0 = GetMidpoint(v0, v1);
+			UINT m1 = GetMidpoint(v1, v2);
+			UINT m2 = GetMidpoint(v2, v0);
 
-			mesh.mIndices.push_back(i * 6 + 5);
-			mesh.mIndices.push_back(i * 6 + 4);
-			mesh.mIndices.push_back(i * 6 + 2);
+			UINT* t = &indices[i * 12];
 
-			mesh.mIndices.push_back(i * 6 + 3);
-			mesh.mIndices.push_back(i * 6 + 1);
-			mesh.mIndices.push_back(i * 6 + 4);
+			t[0x0] = v0; t[0x1] = m0; t[0x2] = m2;
+			t[0x3] = m0; t[0x4] = m1; t[0x5] = m2;
+			t[0x6] = m2; t[0x7] = m1; t[0x8] = v2;
+			t[0x9] = m0; t[0xA] = v1; t[0xB] = m1;
 		}
+
+		mesh.mIndices.swap(indices);
 	};
 
 	while (n--)
@@ -1079,6 +1259,20 @@ void GeometryGenerator::CreateScreenQuad(Mesh& mesh)
 	i.at(3) = 0;   i.at(4) = 2;   i.at(5) = 3;
 }
 
+void GeometryGenerator::SplitVertexStreams(const std::vector<Vertex>& vertices, SplitStreams& streams)
+{
+	streams.mPositions.resize(vertices.size());
+	streams.mTexCoords.resize(vertices.size());
+	streams.mNormals.resize(vertices.size());
+
+	for (UINT i = 0; i < vertices.size(); ++i)
+	{
+		streams.mPositions[i] = vertices[i].mPosition;
+		streams.mTexCoords[i] = vertices[i].mTexCoord;
+		streams.mNormals[i] = vertices[i].mNormal;
+	}
+}
+
 //void GeometryGenerator::Mesh::ComputeNormals(std::vector<Vertex>& vertices, std::vector<UINT>& indices)
 //{
 //	for (Vertex& vertex : vertices)
@@ -1153,6 +1347,132 @@ void GeometryGenerator::Mesh::ComputeNormals(
 	}
 }
 
+void GeometryGenerator::Mesh::BuildAdjacency()
+{
+	const UINT VertexCount = static_cast<UINT>(mVertices.size());
+	const UINT TriangleCount = static_cast<UINT>(mIndices.size() / 3);
+
+	std::vector<UINT>& offsets = mAdjacency.mOffsets;
+	std::vector<UINT>& triangles = mAdjacency.mTriangles;
+
+	// counting sort by vertex, triangles around a vertex keep their index order
+	offsets.assign(VertexCount + 1, 0);
+
+	for (UINT k = 0; k < TriangleCount * 3; k++)
+	{
+		offsets[mIndices[k] + 1]++;
+	}
+
+	for (UINT v = 0; v < VertexCount; v++)
+	{
+		offsets[v + 1] += offsets[v];
+	}
+
+	triangles.resize(TriangleCount * 3);
+
+	std::vector<UINT> cursor(offsets.begin(), offsets.end() - 1);
+
+	for (UINT k = 0; k < TriangleCount * 3; k++)
+	{
+		triangles[cursor[mIndices[k]]++] = k / 3;
+	}
+
+	mAdjacency.mFaceNormals.resize(TriangleCount);
+}
+
+void GeometryGenerator::Mesh::ComputeNormals(NormalWeight weight, ThreadPool* pool)
+{
+	const UINT VertexCount = static_cast<UINT>(mVertices.size());
+	const UINT TriangleCount = static_cast<UINT>(mIndices.size() / 3);
+
+	if (mAdjacency.mOffsets.size() != VertexCount + 1 || mAdjacency.mTriangles.size() != TriangleCount * 3)
+	{
+		BuildAdjacency();
+	}
+
+	const UINT ChunkSize = 4096;
+
+	auto ForEachChunk = [&](UINT count, const std::function<void(UINT, UINT)>& func)
+	{
+		UINT chunks = (count + ChunkSize - 1) / ChunkSize;
+
+		auto task = [&](UINT chunk)
+		{
+			func(chunk * ChunkSize, std::min((chunk + 1) * ChunkSize, count));
+		};
+
+		if (pool)
+		{
+			pool->ParallelFor(chunks, task);
+		}
+		else
+		{
+			for (UINT chunk = 0; chunk < chunks; chunk++)
+			{
+				task(chunk);
+			}
+		}
+	};
+
+	// every triangle writes only its own face normal
+	ForEachChunk(TriangleCount, [&](UINT first, UINT last)
+	{
+		for (UINT t = first; t < last; t++)
+		{
+			XMVECTOR p0 = XMLoadFloat3(&mVertices[mIndices[t * 3 + 0]].mPosition);
+			XMVECTOR p1 = XMLoadFloat3(&mVertices[mIndices[t * 3 + 1]].mPosition);
+			XMVECTOR p2 = XMLoadFloat3(&mVertices[mIndices[t * 3 + 2]].mPosition);
+
+			XMStoreFloat3(&mAdjacency.mFaceNormals[t], XMVector3Cross(p1 - p0, p2 - p0));
+		}
+	});
+
+	// every vertex writes only its own normal, same summation order as the scatter version
+	ForEachChunk(VertexCount, [&](UINT first, UINT last)
+	{
+		for (UINT v = first; v < last; v++)
+		{
+			XMVECTOR N = XMVectorZero();
+
+			for (UINT k = mAdjacency.mOffsets[v]; k < mAdjacency.mOffsets[v + 1]; k++)
+			{
+				UINT t = mAdjacency.mTriangles[k];
+
+				XMVECTOR F = XMLoadFloat3(&mAdjacency.mFaceNormals[t]);
+
+				switch (weight)
+				{
+					case AreaWeighted:
+					{
+						N += F;
+						break;
+					}
+					case AngleWeighted:
+					{
+						UINT corner = (mIndices[t * 3 + 0] == v) ? 0 : (mIndices[t * 3 + 1] == v) ? 1 : 2;
+
+						XMVECTOR p = XMLoadFloat3(&mVertices[v].mPosition);
+						XMVECTOR a = XMLoadFloat3(&mVertices[mIndices[t * 3 + (corner + 1) % 3]].mPosition);
+						XMVECTOR b = XMLoadFloat3(&mVertices[mIndices[t * 3 + (corner + 2) % 3]].mPosition);
+
+						XMVECTOR angle = XMVector3AngleBetweenVectors(a - p, b - p);
+
+						N += XMVector3Normalize(F) * angle;
+						break;
+					}
+					case Unweighted:
+					{
+						N += XMVector3Normalize(F);
+						break;
+					}
+				}
+			}
+
+			XMStoreFloat3(&mVertices[v].mNormal, XMVector3Normalize(N));
+		}
+	});
+}
+
 GeometryGenerator::Waves::Waves() :
 	mRows(0),
 	mCols(0),
@@ -1160,13 +1480,23 @@ GeometryGenerator::Waves::Waves() :
 	mK2(0),
 	mK3(0),
 	mTimeStep(0),
-	mSpaceStep(0)
+	mSpaceStep(0),
+	mTileSize(32),
+	mSleepEpsilon(1e-3f),
+	mThreadPool(nullptr),
+	mTemporalBlock(16),
+	mMaxStepsPerUpdate(64),
+	mAccumulatedTime(0),
+	mTileRows(0),
+	mTileCols(0)
 {}
 
 GeometryGenerator::Waves::~Waves()
 {
-	mPrevVertices.clear();
-	mCurrVertices.clear();
+	mPrevHeights.clear();
+	mCurrHeights.clear();
+	mNormalsX.clear();
+	mNormalsZ.clear();
 }
 
 void GeometryGenerator::Waves::Init(UINT m, UINT n, float dx, float dt, float speed, float damping)
@@ -1183,153 +1513,476 @@ void GeometryGenerator::Waves::Init(UINT m, UINT n, float dx, float dt, float sp
 	mK2 = (4 - 8 * e) / d;
 	mK3 = (2 * e) / d;
 
-	mPrevVertices.clear();
-	mCurrVertices.clear();
-
 	const UINT vertices = m * n;
-	const UINT triangles = (m - 1) * (n - 1) * 2;
-
-	mPrevVertices.resize(vertices);
-	mCurrVertices.resize(vertices);
 
-	float HalfWidth = (n - 1) * dx * 0.5f;
-	float HalfDepth = (m - 1) * dx * 0.5f;
+	mPrevHeights.assign(vertices, 0);
+	mCurrHeights.assign(vertices, 0);
+	mNormalsX.assign(vertices, 0);
+	mNormalsZ.assign(vertices, 0);
 
-	float du = 1.0f / (n - 1);
-	float dv = 1.0f / (m - 1);
-
-	for (UINT i = 0; i < m; i++)
-	{
-		float z = HalfDepth - i * dx;
+	mTileSize = std::max(mTileSize, 3u);
+	mTileRows = (m + mTileSize - 1) / mTileSize;
+	mTileCols = (n + mTileSize - 1) / mTileSize;
 
-		for (UINT j = 0; j < n; j++)
-		{
-			float x =  j * dx - HalfWidth;
+	// flat water, every tile starts asleep
+	mTileActive.assign(mTileRows * mTileCols, 0);
+	mTileStepped.assign(mTileRows * mTileCols, 0);
+	mTileFlattened.assign(mTileRows * mTileCols, 0);
 
-			Vertex vertex;
-			vertex.mPosition = XMFLOAT3(x, 0, z);
-			vertex.mNormal = XMFLOAT3(0, 1, 0);
-			//vertex.mColor = XMFLOAT4(0, 1, 1, 1);
-			vertex.mTexCoord = XMFLOAT2(j * du, i * dv);
+	// nothing uploaded yet
+	mDirtyTileRows.assign(mTileRows, 1);
 
-			mPrevVertices.at(i * n + j) = vertex;
-			mCurrVertices.at(i * n + j) = vertex;
-		}
-	}
+	mAccumulatedTime = 0;
 }
 
 void GeometryGenerator::Waves::Update(float dt)
 {
-	static float t = 0;
+	mAccumulatedTime += dt;
 
-	t += dt;
+	UINT steps = static_cast<UINT>(mAccumulatedTime / mTimeStep);
 
-	if (t >= mTimeStep)
+	if (steps > 0)
 	{
-		for (UINT i = 1; i < mRows-1; i++)
+		mAccumulatedTime -= steps * mTimeStep;
+
+		if (steps > mMaxStepsPerUpdate)
 		{
-			for (UINT j = 1; j < mCols-1; j++)
-			{
-				mPrevVertices.at(i * mCols + j).mPosition.y =
-					mK1 * mPrevVertices.at(i * mCols + j).mPosition.y +
-					mK2 * mCurrVertices.at(i * mCols + j).mPosition.y +
-					mK3 * (mCurrVertices.at((i + 1) * mCols + j).mPosition.y +
-						   mCurrVertices.at((i - 1) * mCols + j).mPosition.y +
-						   mCurrVertices.at(i * mCols + (j + 1)).mPosition.y +
-						   mCurrVertices.at(i * mCols + (j - 1)).mPosition.y);
-			}
+			steps = mMaxStepsPerUpdate;
+			mAccumulatedTime = 0;
 		}
 
-		// std::swap(mPrevVertices, mCurrVertices);
+		Step(steps);
+	}
+}
 
-		for (UINT k = 0; k < mRows * mCols; k++)
-		{
-			Vertex v = mPrevVertices.at(k);
-			mPrevVertices.at(k) = mCurrVertices.at(k);
-			mCurrVertices.at(k) = v;
-		}
+void GeometryGenerator::Waves::Step(UINT count)
+{
+	while (count > 0)
+	{
+		// waves move one cell per step, so a block of at most mTileSize steps
+		// cannot reach past the tiles next to an active one
+		UINT steps = 1;
 
-		for (UINT i = 1; i < mRows - 1; i++)
+		if (!mThreadPool)
 		{
-			for (UINT j = 1; j < mCols - 1; j++)
-			{
-				float l = mCurrVertices.at(i * mCols + (j - 1)).mPosition.y;
-				float r = mCurrVertices.at(i * mCols + (j + 1)).mPosition.y;
-				float t = mCurrVertices.at((i - 1) * mCols + j).mPosition.y;
-				float b = mCurrVertices.at((i + 1) * mCols + j).mPosition.y;
+			steps = std::min(std::min(count, mTemporalBlock), mTileSize);
+			steps = std::max(steps, 1u);
+		}
 
-				Vertex& v = mCurrVertices.at(i * mCols + j);
+		StepTiles(steps);
 
-				v.mNormal.x = l - r;
-				v.mNormal.y = 2 * mSpaceStep;
-				v.mNormal.z = b - t;
+		count -= steps;
+	}
+}
 
-				//v.mTexCoord.x = 0.5f + v.mPosition.x / (mCols * mSpaceStep);
-				//v.mTexCoord.y = 0.5f - v.mPosition.z / (mRows * mSpaceStep);
-			}
+void GeometryGenerator::Waves::ForEachTileRow(const std::function<void(UINT)>& func)
+{
+	if (mThreadPool)
+	{
+		mThreadPool->ParallelFor(mTileRows, func);
+	}
+	else
+	{
+		for (UINT ti = 0; ti < mTileRows; ti++)
+		{
+			func(ti);
 		}
-
-		t = 0;
 	}
 }
 
-void GeometryGenerator::Waves::Disturb(UINT i, UINT j, float magnitude)
+void GeometryGenerator::Waves::GetTileRect(UINT ti, UINT tj, UINT& FirstRow, UINT& LastRow, UINT& FirstCol, UINT& LastCol) const
 {
-	assert(i > 1 && i < mRows - 2);
-	assert(j > 1 && j < mCols - 2);
+	FirstRow = std::max(ti * mTileSize, 1u);
+	LastRow = std::min((ti + 1) * mTileSize, mRows - 1);
+	FirstCol = std::max(tj * mTileSize, 1u);
+	LastCol = std::min((tj + 1) * mTileSize, mCols - 1);
+}
 
-	float HalfMagnitude = 0.5f * magnitude;
+bool GeometryGenerator::Waves::IsTileNear(const std::vector<BYTE>& flags, UINT ti, UINT tj) const
+{
+	for (UINT a = (ti ? ti - 1 : 0); a <= std::min(ti + 1, mTileRows - 1); a++)
+	{
+		for (UINT b = (tj ? tj - 1 : 0); b <= std::min(tj + 1, mTileCols - 1); b++)
+		{
+			if (flags[a * mTileCols + b])
+			{
+				return true;
+			}
+		}
+	}
 
-	mCurrVertices.at(i * mCols + j).mPosition.y += magnitude;
-	mCurrVertices.at((i - 1) * mCols + j).mPosition.y += HalfMagnitude;
-	mCurrVertices.at((i + 1) * mCols + j).mPosition.y += HalfMagnitude;
-	mCurrVertices.at(i * mCols + (j - 1)).mPosition.y += HalfMagnitude;
-	mCurrVertices.at(i * mCols + (j + 1)).mPosition.y += HalfMagnitude;
+	return false;
 }
 
-float GameMath::GetAngle2(XMFLOAT2 P)
+void GeometryGenerator::Waves::StepTiles(UINT steps)
 {
-	float theta = 0;
-	
-	if (P.x >= 0) // Quadrant I or IV
+	// waves can move into the tiles next to an active one, so those are stepped too
+	for (UINT ti = 0; ti < mTileRows; ti++)
 	{
-		theta = std::atan(P.y / P.x); // in [-pi/2, +pi/2]
-
-		if (theta < 0)
+		for (UINT tj = 0; tj < mTileCols; tj++)
 		{
-			theta += XM_2PI; // in [0, 2*pi).
+			mTileStepped[ti * mTileCols + tj] = IsTileNear(mTileActive, ti, tj);
 		}
 	}
-	else // Quadrant II or III
+
+	if (steps > 1)
 	{
-		theta = std::atan(P.y / P.x) + XM_PI; // in [0, 2*pi).
+		StepWavefront(steps);
 	}
+	else
+	{
+		// heights and normals are fused per row of tiles while the rows are still in cache,
+		// the stencil only reads the old heights so the one-row halos are shared read-only
+		ForEachTileRow([&](UINT ti)
+		{
+			UINT r0, r1, c0, c1;
 
-	return theta;
-}
+			for (UINT tj = 0; tj < mTileCols; tj++)
+			{
+				if (mTileStepped[ti * mTileCols + tj])
+				{
+					GetTileRect(ti, tj, r0, r1, c0, c1);
+					StepHeights(mPrevHeights.data(), mCurrHeights.data(), r0, r1, c0, c1);
+				}
+			}
 
-XMMATRIX GameMath::InverseTranspose(XMMATRIX M)
-{
-	M.r[3] = XMVectorSet(0, 0, 0, 1);
-	XMVECTOR det = XMMatrixDeterminant(M);
-	return XMMatrixTranspose(XMMatrixInverse(&det, M));
-}
+			for (UINT tj = 0; tj < mTileCols; tj++)
+			{
+				if (mTileStepped[ti * mTileCols + tj])
+				{
+					GetTileRect(ti, tj, r0, r1, c0, c1);
 
-void BlurEffect::Init(ID3D11Device* device, UINT width, UINT height, DXGI_FORMAT format)
-{
-	OnResize(device, width, height, format);
-	
-	// compile shaders
-}
+					// the first and last row need the new heights of the neighbouring tile rows
+					ComputeNormals(mPrevHeights.data(), r0 + 1, r1 - 1, c0, c1);
+				}
+			}
+		});
 
-void BlurEffect::OnResize(ID3D11Device* device, UINT width, UINT height, DXGI_FORMAT format)
-{
-	SafeRelease(mOutputTextureSRV);
-	//SafeRelease((*mOutputTextureSRV.GetAddressOf()));
-	SafeRelease(mOutputTextureUAV);
+		mPrevHeights.swap(mCurrHeights);
+	}
 
-	mWidth = width;
-	mHeight = height;
+	// a sleeping tile is exactly flat in both buffers, so skipping it is the same as stepping it
+	ForEachTileRow([&](UINT ti)
+	{
+		UINT r0, r1, c0, c1;
+
+		for (UINT tj = 0; tj < mTileCols; tj++)
+		{
+			UINT k = ti * mTileCols + tj;
+
+			mTileFlattened[k] = 0;
+
+			if (!mTileStepped[k])
+			{
+				continue;
+			}
+
+			GetTileRect(ti, tj, r0, r1, c0, c1);
+
+			float amplitude = 0;
+
+			for (UINT i = r0; i < r1; i++)
+			{
+				for (UINT j = c0; j < c1; j++)
+				{
+					amplitude = std::max(amplitude, std::abs(mPrevHeights[i * mCols + j]));
+					amplitude = std::max(amplitude, std::abs(mCurrHeights[i * mCols + j]));
+				}
+			}
+
+			mTileActive[k] = amplitude >= mSleepEpsilon;
+			mTileFlattened[k] = !mTileActive[k];
+
+			if (mTileFlattened[k])
+			{
+				for (UINT i = r0; i < r1; i++)
+				{
+					std::fill(mPrevHeights.begin() + i * mCols + c0, mPrevHeights.begin() + i * mCols + c1, 0.0f);
+					std::fill(mCurrHeights.begin() + i * mCols + c0, mCurrHeights.begin() + i * mCols + c1, 0.0f);
+				}
+			}
+		}
+	});
+
+	ForEachTileRow([&](UINT ti)
+	{
+		UINT r0, r1, c0, c1;
+
+		for (UINT tj = 0; tj < mTileCols; tj++)
+		{
+			if (!IsTileNear(mTileStepped, ti, tj))
+			{
+				continue;
+			}
+
+			GetTileRect(ti, tj, r0, r1, c0, c1);
+
+			mDirtyTileRows[ti] = 1;
+
+			// tiles made of border cells only
+			if (r0 >= r1 || c0 >= c1)
+			{
+				continue;
+			}
+
+			if (steps > 1 || !mTileStepped[ti * mTileCols + tj] || IsTileNear(mTileFlattened, ti, tj))
+			{
+				ComputeNormals(mCurrHeights.data(), r0, r1, c0, c1);
+			}
+			else
+			{
+				ComputeNormals(mCurrHeights.data(), r0, r0 + 1, c0, c1);
+				ComputeNormals(mCurrHeights.data(), std::max(r1 - 1, r0 + 1), r1, c0, c1);
+			}
+		}
+	});
+}
+
+void GeometryGenerator::Waves::StepWavefront(UINT steps)
+{
+	// temporal blocking: step t writes the buffer holding the heights of step t-2,
+	// with a skew of one row per step every row is read by step t-1 before step t
+	// overwrites it, so only the steps+2 rows around the wavefront are live in cache
+	float* buffers[2] = { mPrevHeights.data(), mCurrHeights.data() };
+
+	for (UINT wave = 1; wave + 2 < mRows + steps; wave++)
+	{
+		for (UINT t = 0; t < steps && t < wave; t++)
+		{
+			UINT i = wave - t;
+
+			if (i >= mRows - 1)
+			{
+				continue;
+			}
+
+			UINT ti = i / mTileSize;
+			UINT r0, r1, c0, c1;
+
+			for (UINT tj = 0; tj < mTileCols; tj++)
+			{
+				if (mTileStepped[ti * mTileCols + tj])
+				{
+					GetTileRect(ti, tj, r0, r1, c0, c1);
+					StepHeights(buffers[t % 2], buffers[(t + 1) % 2], i, i + 1, c0, c1);
+				}
+			}
+		}
+	}
+
+	// the last step was written into mPrevHeights
+	if (steps % 2)
+	{
+		mPrevHeights.swap(mCurrHeights);
+	}
+}
+
+void GeometryGenerator::Waves::StepHeights(float* PrevHeights, const float* CurrHeights, UINT FirstRow, UINT LastRow, UINT FirstCol, UINT LastCol)
+{
+	const XMVECTOR K1 = XMVectorReplicate(mK1);
+	const XMVECTOR K2 = XMVectorReplicate(mK2);
+	const XMVECTOR K3 = XMVectorReplicate(mK3);
+
+	for (UINT i = FirstRow; i < LastRow; i++)
+	{
+		float* prev = PrevHeights + i * mCols;
+		const float* curr = CurrHeights + i * mCols;
+		const float* above = curr - mCols;
+		const float* below = curr + mCols;
+
+		UINT j = FirstCol;
+
+		// 4 columns at a time, same operation order as the scalar tail
+		for (; j + 4 <= LastCol; j += 4)
+		{
+			XMVECTOR S = XMLoadFloat4(reinterpret_cast<const XMFLOAT4*>(below + j));
+			S = S + XMLoadFloat4(reinterpret_cast<const XMFLOAT4*>(above + j));
+			S = S + XMLoadFloat4(reinterpret_cast<const XMFLOAT4*>(curr + j + 1));
+			S = S + XMLoadFloat4(reinterpret_cast<const XMFLOAT4*>(curr + j - 1));
+
+			XMVECTOR P = XMLoadFloat4(reinterpret_cast<const XMFLOAT4*>(prev + j));
+			XMVECTOR C = XMLoadFloat4(reinterpret_cast<const XMFLOAT4*>(curr + j));
+
+			XMStoreFloat4(reinterpret_cast<XMFLOAT4*>(prev + j), K1 * P + K2 * C + K3 * S);
+		}
+
+		for (; j < LastCol; j++)
+		{
+			prev[j] = mK1 * prev[j] + mK2 * curr[j] + mK3 * (below[j] + above[j] + curr[j + 1] + curr[j - 1]);
+		}
+	}
+}
+
+void GeometryGenerator::Waves::ComputeNormals(const float* heights, UINT FirstRow, UINT LastRow, UINT FirstCol, UINT LastCol)
+{
+	for (UINT i = FirstRow; i < LastRow; i++)
+	{
+		const float* curr = heights + i * mCols;
+		const float* above = curr - mCols;
+		const float* below = curr + mCols;
+
+		float* nx = mNormalsX.data() + i * mCols;
+		float* nz = mNormalsZ.data() + i * mCols;
+
+		UINT j = FirstCol;
+
+		for (; j + 4 <= LastCol; j += 4)
+		{
+			XMVECTOR L = XMLoadFloat4(reinterpret_cast<const XMFLOAT4*>(curr + j - 1));
+			XMVECTOR R = XMLoadFloat4(reinterpret_cast<const XMFLOAT4*>(curr + j + 1));
+			XMVECTOR T = XMLoadFloat4(reinterpret_cast<const XMFLOAT4*>(above + j));
+			XMVECTOR B = XMLoadFloat4(reinterpret_cast<const XMFLOAT4*>(below + j));
+
+			XMStoreFloat4(reinterpret_cast<XMFLOAT4*>(nx + j), L - R);
+			XMStoreFloat4(reinterpret_cast<XMFLOAT4*>(nz + j), B - T);
+		}
+
+		for (; j < LastCol; j++)
+		{
+			nx[j] = curr[j - 1] - curr[j + 1];
+			nz[j] = below[j] - above[j];
+		}
+	}
+}
+
+GeometryGenerator::Vertex GeometryGenerator::Waves::operator[](int i) const
+{
+	Vertex vertex;
+	GetVertices(&vertex, i, 1);
+	return vertex;
+}
+
+void GeometryGenerator::Waves::GetVertices(std::vector<Vertex>& vertices) const
+{
+	vertices.resize(mRows * mCols);
+	GetVertices(vertices.data(), 0, mRows * mCols);
+}
+
+void GeometryGenerator::Waves::GetVertices(Vertex* vertices, UINT first, UINT count) const
+{
+	const float dx = mSpaceStep;
+
+	float HalfWidth = (mCols - 1) * dx * 0.5f;
+	float HalfDepth = (mRows - 1) * dx * 0.5f;
+
+	float du = 1.0f / (mCols - 1);
+	float dv = 1.0f / (mRows - 1);
+
+	for (UINT k = first; k < first + count; k++)
+	{
+		UINT i = k / mCols;
+		UINT j = k % mCols;
+
+		*vertices++ = Vertex(j * dx - HalfWidth, mCurrHeights[k], HalfDepth - i * dx,
+							 mNormalsX[k], 2 * dx, mNormalsZ[k],
+							 1, 0, 0,
+							 j * du, i * dv);
+	}
+}
+
+void GeometryGenerator::Waves::GetDirtyRows(std::vector<std::pair<UINT, UINT>>& rows) const
+{
+	rows.clear();
+
+	for (UINT ti = 0; ti < mTileRows; ti++)
+	{
+		if (!mDirtyTileRows[ti])
+		{
+			continue;
+		}
+
+		UINT first = ti * mTileSize;
+		UINT last = std::min(first + mTileSize, mRows);
+
+		// merge with the previous range if they touch
+		if (!rows.empty() && rows.back().second == first)
+		{
+			rows.back().second = last;
+		}
+		else
+		{
+			rows.push_back(std::make_pair(first, last));
+		}
+	}
+}
+
+void GeometryGenerator::Waves::ClearDirtyRows()
+{
+	std::fill(mDirtyTileRows.begin(), mDirtyTileRows.end(), 0);
+}
+
+void GeometryGenerator::Waves::WakeTile(UINT i, UINT j)
+{
+	UINT ti = i / mTileSize;
+	UINT tj = j / mTileSize;
+
+	mTileActive[ti * mTileCols + tj] = 1;
+	mDirtyTileRows[ti] = 1;
+}
+
+void GeometryGenerator::Waves::Disturb(UINT i, UINT j, float magnitude)
+{
+	assert(i > 1 && i < mRows - 2);
+	assert(j > 1 && j < mCols - 2);
+
+	float HalfMagnitude = 0.5f * magnitude;
+
+	mCurrHeights.at(i * mCols + j) += magnitude;
+	mCurrHeights.at((i - 1) * mCols + j) += HalfMagnitude;
+	mCurrHeights.at((i + 1) * mCols + j) += HalfMagnitude;
+	mCurrHeights.at(i * mCols + (j - 1)) += HalfMagnitude;
+	mCurrHeights.at(i * mCols + (j + 1)) += HalfMagnitude;
+
+	WakeTile(i, j);
+	WakeTile(i - 1, j);
+	WakeTile(i + 1, j);
+	WakeTile(i, j - 1);
+	WakeTile(i, j + 1);
+}
+
+float GameMath::GetAngle2(XMFLOAT2 P)
+{
+	float theta = 0;
+	
+	if (P.x >= 0) // Quadrant I or IV
+	{
+		theta = std::atan(P.y / P.x); // in [-pi/2, +pi/2]
+
+		if (theta < 0)
+		{
+			theta += XM_2PI; // in [0, 2*pi).
+		}
+	}
+	else // Quadrant II or III
+	{
+		theta = std::atan(P.y / P.x) + XM_PI; // in [0, 2*pi).
+	}
+
+	return theta;
+}
+
+XMMATRIX GameMath::InverseTranspose(XMMATRIX M)
+{
+	M.r[3] = XMVectorSet(0, 0, 0, 1);
+	XMVECTOR det = XMMatrixDeterminant(M);
+	return XMMatrixTranspose(XMMatrixInverse(&det, M));
+}
+
+void BlurEffect::Init(ID3D11Device* device, UINT width, UINT height, DXGI_FORMAT format)
+{
+	OnResize(device, width, height, format);
+	
+	// compile shaders
+}
+
+void BlurEffect::OnResize(ID3D11Device* device, UINT width, UINT height, DXGI_FORMAT format)
+{
+	SafeRelease(mOutputTextureSRV);
+	//SafeRelease((*mOutputTextureSRV.GetAddressOf()));
+	SafeRelease(mOutputTextureUAV);
+
+	mWidth = width;
+	mHeight = height;
 	mFormat = format;
 
 	ID3D11Texture2D* texture = nullptr;
@@ -1946,7 +2599,7 @@ ShadowMap::ShadowMap() :
 	mSRV(nullptr),
 	mPerObjectCB(nullptr),
 	mVertexShader{ nullptr, nullptr },
-	mInputLayout{ nullptr, nullptr },
+	mInputLayout{ nullptr, nullptr, nullptr },
 	mPixelShader{ nullptr, nullptr },
 	mRasterizerState(nullptr),
 	mSamplerState(nullptr)
@@ -1964,6 +2617,7 @@ ShadowMap::~ShadowMap()
 		SafeRelease(mInputLayout[i]);
 		SafeRelease(mPixelShader[i]);
 	}
+	SafeRelease(mInputLayout[2]);
 	
 	SafeRelease(mRasterizerState);
 	SafeRelease(mSamplerState);
@@ -2053,6 +2707,15 @@ void ShadowMap::Init(ID3D11Device* device, UINT width, UINT height)
 			};
 
 			HR(device->CreateInputLayout(desc.data(), desc.size(), pCode->GetBufferPointer(), pCode->GetBufferSize(), &mInputLayout[i]));
+
+			// split streams, same vertex shader
+			std::vector<D3D11_INPUT_ELEMENT_DESC> SplitDesc =
+			{
+				{"POSITION", 0, DXGI_FORMAT_R32G32B32_FLOAT, 0, 0, D3D11_INPUT_PER_VERTEX_DATA, 0},
+				{"TEXCOORD", 0, DXGI_FORMAT_R32G32_FLOAT,    1, 0, D3D11_INPUT_PER_VERTEX_DATA, 0},
+			};
+
+			HR(device->CreateInputLayout(SplitDesc.data(), SplitDesc.size(), pCode->GetBufferPointer(), pCode->GetBufferSize(), &mInputLayout[2]));
 		}
 		else
 		{
@@ -2176,9 +2839,9 @@ ID3D11VertexShader* ShadowMap::GetVS(bool IsSkinned)
 	return mVertexShader[IsSkinned ? 1 : 0];
 }
 
-ID3D11InputLayout* ShadowMap::GetIL(bool IsSkinned)
+ID3D11InputLayout* ShadowMap::GetIL(bool IsSkinned, bool IsSplit)
 {
-	return mInputLayout[IsSkinned ? 1 : 0];
+	return mInputLayout[IsSkinned ? 1 : (IsSplit ? 2 : 0)];
 }
 
 ID3D11PixelShader* ShadowMap::GetPS(bool IsAlphaClipping)
@@ -2206,7 +2869,7 @@ SSAO::SSAO() :
 	mNormalDepthRTV(nullptr),
 	mNormalDepthSRV(nullptr),
 	mNormalDepthVS{ nullptr, nullptr },
-	mNormalDepthIL{ nullptr, nullptr },
+	mNormalDepthIL{ nullptr, nullptr, nullptr },
 	mNormalDepthPS{ nullptr, nullptr },
 	mNormalDepthSS(nullptr),
 	mRandomVectorSRV(nullptr),
@@ -2231,6 +2894,7 @@ SSAO::~SSAO()
 		SafeRelease(mNormalDepthIL[i]);
 		SafeRelease(mNormalDepthPS[i]);
 	}
+	SafeRelease(mNormalDepthIL[2]);
 	SafeRelease(mNormalDepthCB);
 	SafeRelease(mNormalDepthSS);
 	SafeRelease(mRandomVectorSRV);
@@ -2274,6 +2938,16 @@ void SSAO::Init(ID3D11Device* device, UINT width, UINT height, float FieldOfView
 				};
 
 				HR(device->CreateInputLayout(desc.data(), desc.size(), pCode->GetBufferPointer(), pCode->GetBufferSize(), &mNormalDepthIL[i]));
+
+				// split streams, same vertex shader
+				std::vector<D3D11_INPUT_ELEMENT_DESC> SplitDesc =
+				{
+					{"POSITION", 0, DXGI_FORMAT_R32G32B32_FLOAT, 0, 0, D3D11_INPUT_PER_VERTEX_DATA, 0},
+					{"TEXCOORD", 0, DXGI_FORMAT_R32G32_FLOAT,    1, 0, D3D11_INPUT_PER_VERTEX_DATA, 0},
+					{"NORMAL",   0, DXGI_FORMAT_R32G32B32_FLOAT, 2, 0, D3D11_INPUT_PER_VERTEX_DATA, 0},
+				};
+
+				HR(device->CreateInputLayout(SplitDesc.data(), SplitDesc.size(), pCode->GetBufferPointer(), pCode->GetBufferSize(), &mNormalDepthIL[2]));
 			}
 			else
 			{
@@ -2696,9 +3370,9 @@ ID3D11VertexShader* SSAO::GetNormalDepthVS(bool IsSkinned)
 	return mNormalDepthVS[IsSkinned ? 1 : 0];
 }
 
-ID3D11InputLayout* SSAO::GetNormalDepthIL(bool IsSkinned)
+ID3D11InputLayout* SSAO::GetNormalDepthIL(bool IsSkinned, bool IsSplit)
 {
-	return mNormalDepthIL[IsSkinned ? 1 : 0];
+	return mNormalDepthIL[IsSkinned ? 1 : (IsSplit ? 2 : 0)];
 }
 
 ID3D11PixelShader* SSAO::GetNormalDepthPS(bool IsAlphaClipping)
@@ -2935,1091 +3609,5487 @@ float AnimationObject::GetTimeEnd() const
 
 void AnimationObject::interpolate(float t, XMMATRIX& world) const
 {
+	UINT cursor = 0;
+
+	interpolate(t, world, cursor);
+}
+
+void AnimationObject::interpolate(float t, XMMATRIX& world, UINT& cursor) const
+{
+	XMVECTOR S, R, T;
+	interpolate(t, S, R, T, cursor);
+
 	// rotation origin
 	XMVECTOR O = XMVectorSet(0.0f, 0.0f, 0.0f, 1.0f);
 
+	world = XMMatrixAffineTransformation(S, O, R, T);
+}
+
+void AnimationObject::interpolate(float t, XMVECTOR& S, XMVECTOR& R, XMVECTOR& T, UINT& cursor) const
+{
 	if (t <= GetTimeStart()) // return first keyframe
 	{
-		XMVECTOR S = XMLoadFloat3(&keyframes.front().scale);
-		XMVECTOR R = XMLoadFloat4(&keyframes.front().rotation);
-		XMVECTOR T = XMLoadFloat3(&keyframes.front().translation);
-
-		world = XMMatrixAffineTransformation(S, O, R, T);
+		S = XMLoadFloat3(&keyframes.front().scale);
+		R = XMLoadFloat4(&keyframes.front().rotation);
+		T = XMLoadFloat3(&keyframes.front().translation);
 	}
 	else if (t >= GetTimeEnd()) // return last keyframe
 	{
-		XMVECTOR S = XMLoadFloat3(&keyframes.back().scale);
-		XMVECTOR R = XMLoadFloat4(&keyframes.back().rotation);
-		XMVECTOR T = XMLoadFloat3(&keyframes.back().translation);
-
-		world = XMMatrixAffineTransformation(S, O, R, T);
+		S = XMLoadFloat3(&keyframes.back().scale);
+		R = XMLoadFloat4(&keyframes.back().rotation);
+		T = XMLoadFloat3(&keyframes.back().translation);
 	}
 	else // interpolate keyframes
 	{
-		for (UINT i = 0; i < keyframes.size() - 1; ++i)
-		{
-			const KeyFrame& a = keyframes[i + 0];
-			const KeyFrame& b = keyframes[i + 1];
+		cursor = FindKeyFrame(t, cursor);
 
-			if (a.time <= t && t <= b.time)
-			{
-				XMVECTOR Sa = XMLoadFloat3(&a.scale);
-				XMVECTOR Sb = XMLoadFloat3(&b.scale);
+		const KeyFrame& a = keyframes[cursor + 0];
+		const KeyFrame& b = keyframes[cursor + 1];
 
-				XMVECTOR Ra = XMLoadFloat4(&a.rotation);
-				XMVECTOR Rb = XMLoadFloat4(&b.rotation);
+		XMVECTOR Sa = XMLoadFloat3(&a.scale);
+		XMVECTOR Sb = XMLoadFloat3(&b.scale);
 
-				XMVECTOR Ta = XMLoadFloat3(&a.translation);
-				XMVECTOR Tb = XMLoadFloat3(&b.translation);
+		XMVECTOR Ra = XMLoadFloat4(&a.rotation);
+		XMVECTOR Rb = XMLoadFloat4(&b.rotation);
 
-				float x = (t - a.time) / (b.time - a.time);
+		XMVECTOR Ta = XMLoadFloat3(&a.translation);
+		XMVECTOR Tb = XMLoadFloat3(&b.translation);
 
-				XMVECTOR S = XMVectorLerp(Sa, Sb, x);
-				XMVECTOR R = XMQuaternionSlerp(Ra, Rb, x);
-				XMVECTOR T = XMVectorLerp(Ta, Tb, x);
+		float x = (t - a.time) / (b.time - a.time);
 
-				world = XMMatrixAffineTransformation(S, O, R, T);
-				break;
-			}
-		}
+		S = XMVectorLerp(Sa, Sb, x);
+		R = XMQuaternionSlerp(Ra, Rb, x);
+		T = XMVectorLerp(Ta, Tb, x);
 	}
 }
 
-float AnimationClip::GetTimeClipStart() const
+UINT AnimationObject::FindKeyFrame(float t, UINT cursor) const
 {
-	float t = FLT_MAX;
+	const UINT last = static_cast<UINT>(keyframes.size()) - 2;
 
-	for (const AnimationObject& animation : mAnimationObjects)
+	// evenly spaced keyframes, the guess is off by at most one because of rounding
+	if (mInvKeyInterval > 0.0f)
 	{
-		t = std::min(t, animation.GetTimeStart());
+		cursor = std::min(static_cast<UINT>((t - keyframes.front().time) * mInvKeyInterval), last);
 	}
 
-	return t;
-}
-
-float AnimationClip::GetTimeClipEnd() const
-{
-	float t = 0;
-
-	for (const AnimationObject& animation : mAnimationObjects)
+	// the same pair as last time, or the next one
+	if (cursor <= last && keyframes[cursor].time <= t)
+	{
+		for (UINT i = cursor; i <= std::min(cursor + 1, last); ++i)
+		{
+			if (t < keyframes[i + 1].time)
+			{
+				return i;
+			}
+		}
+	}
+	else if (cursor > 0 && cursor <= last + 1 && keyframes[cursor - 1].time <= t)
 	{
-		t = std::max(t, animation.GetTimeEnd());
+		return cursor - 1;
 	}
 
-	return t;
+	// seek or loop, binary search for the first keyframe after t
+	auto it = std::upper_bound(keyframes.begin(), keyframes.end(), t, [](float t, const KeyFrame& keyframe)
+	{
+		return t < keyframe.time;
+	});
+
+	return std::min(static_cast<UINT>(it - keyframes.begin()) - 1, last);
 }
 
-void AnimationClip::interpolate(float t, std::vector<XMMATRIX>& transforms) const
+void AnimationObject::UpdateKeyInterval()
 {
-	transforms.clear();
-	transforms.resize(mAnimationObjects.size());
+	mInvKeyInterval = 0.0f;
 
-	for (UINT i = 0; i < mAnimationObjects.size(); ++i)
+	if (keyframes.size() < 2)
 	{
-		mAnimationObjects[i].interpolate(t, transforms[i]);
+		return;
 	}
-}
 
-TextureManager::TextureManager() :
-	mDevice(nullptr),
-	mContext(nullptr)
-{
-	//mTextureFolder = L"C:/Users/ggarbin/Desktop/3D-Game-Programming-with-DirectX11/textures/";
-	mTextureFolder = L"C:/Users/D3PO/source/repos/3D Game Programming with DirectX 11/textures/";
-}
+	const float interval = (GetTimeEnd() - GetTimeStart()) / (keyframes.size() - 1);
 
-TextureManager::~TextureManager()
-{
-	for (auto& [filename, srv] : mSRVs)
+	if (interval <= 0.0f)
 	{
-		SafeRelease(srv);
+		return;
 	}
-	mSRVs.clear();
 
-	for (ID3D11ShaderResourceView* srv : mNamelessTextureSRVs)
+	// a keyframe more than 1% of the interval off makes the guess unreliable
+	for (UINT i = 0; i < keyframes.size(); ++i)
 	{
-		SafeRelease(srv);
+		if (std::abs(keyframes[i].time - (GetTimeStart() + i * interval)) > 0.01f * interval)
+		{
+			return;
+		}
 	}
-	mNamelessTextureSRVs.clear();
-
-	mDevice = nullptr;
-}
 
-void TextureManager::init(ID3D11Device* device, ID3D11DeviceContext* context)
-{
-	mDevice = device;
-	mContext = context;
+	mInvKeyInterval = 1.0f / interval;
 }
 
-ID3D11ShaderResourceView* TextureManager::CreateSRV(const std::wstring& filename)
+void AnimationObject::resample(float interval)
 {
-	auto i = mSRVs.find(filename);
+	const float start = GetTimeStart();
+	const float duration = GetTimeEnd() - start;
 
-	if (i != mSRVs.end())
+	if (keyframes.size() < 2 || interval <= 0.0f || duration <= 0.0f)
 	{
-		return i->second;
+		return;
 	}
-	else
-	{
-		std::wstring path = mTextureFolder + filename;
 
-		ID3D11ShaderResourceView* srv;
-		ID3D11Resource* resource = nullptr;
+	// shortened so that the keyframes end on the last one
+	const UINT count = static_cast<UINT>(std::ceil(duration / interval)) + 1;
+	interval = duration / (count - 1);
 
-		HR(CreateDDSTextureFromFile(mDevice, path.c_str(), &resource, &srv));
+	std::vector<KeyFrame> resampled(count);
 
-		mSRVs.emplace(filename, srv);
+	UINT cursor = 0;
 
-		// check created texture
+	for (UINT i = 0; i < count; ++i)
+	{
+		KeyFrame& keyframe = resampled[i];
+
+		if (i == 0)
 		{
-			ID3D11Texture2D* texture = nullptr;
-			HR(resource->QueryInterface(IID_ID3D11Texture2D, (void**)&texture));
+			keyframe = keyframes.front();
+		}
+		else if (i == count - 1)
+		{
+			keyframe = keyframes.back();
+		}
+		else
+		{
+			keyframe.time = start + i * interval;
 
-			D3D11_TEXTURE2D_DESC desc;
-			texture->GetDesc(&desc);
+			XMVECTOR S, R, T;
+			interpolate(keyframe.time, S, R, T, cursor);
 
-			SafeRelease(texture);
+			XMStoreFloat3(&keyframe.scale, S);
+			XMStoreFloat4(&keyframe.rotation, R);
+			XMStoreFloat3(&keyframe.translation, T);
 		}
+	}
 
-		SafeRelease(resource);
+	keyframes = std::move(resampled);
 
-		return srv;
-	}
+	UpdateKeyInterval();
 }
 
-ID3D11ShaderResourceView* TextureManager::CreateSRV(const std::vector<std::wstring>& filenames)
+void AnimationClip::UpdateTimeClip()
 {
-	std::wstring MapKey;
+	mTimeClipStart = FLT_MAX;
+	mTimeClipEnd = 0;
 
-	for (const std::wstring& filename : filenames)
+	for (AnimationObject& animation : mAnimationObjects)
 	{
-		MapKey += filename;
-	}
+		mTimeClipStart = std::min(mTimeClipStart, animation.GetTimeStart());
+		mTimeClipEnd = std::max(mTimeClipEnd, animation.GetTimeEnd());
 
-	auto i = mSRVs.find(MapKey);
+		animation.UpdateKeyInterval();
+	}
+}
 
-	if (i != mSRVs.end())
+void AnimationClip::resample(float interval)
+{
+	for (AnimationObject& animation : mAnimationObjects)
 	{
-		return i->second;
+		animation.resample(interval);
 	}
-	else
-	{
-		std::vector<ID3D11Texture2D*> textures(filenames.size(), nullptr);
 
-		for (UINT i = 0; i < filenames.size(); ++i)
+	UpdateTimeClip();
+}
+
+void AnimationClip::interpolate(float t, XMMATRIX* transforms, UINT* cursors) const
+{
+	for (UINT i = 0; i < mAnimationObjects.size(); ++i)
+	{
+		if (cursors)
 		{
-			const std::wstring& filename = filenames.at(i);
+			mAnimationObjects[i].interpolate(t, transforms[i], cursors[i]);
+		}
+		else
+		{
+			mAnimationObjects[i].interpolate(t, transforms[i]);
+		}
+	}
+}
 
-			auto I = mSRVs.find(filename);
+void AnimationClip::interpolate(float t, std::vector<XMMATRIX>& transforms) const
+{
+	transforms.resize(mAnimationObjects.size());
 
-			if (I != mSRVs.end())
-			{
-				HR(I->second->QueryInterface(IID_ID3D11Texture2D, (void**)&textures.at(i)));
-			}
-			else
-			{
-				std::wstring path = mTextureFolder + filename;
-				ID3D11Resource* resource = nullptr;
+	interpolate(t, transforms.data());
+}
 
-				HR(CreateDDSTextureFromFileEx(
-					mDevice,
-					path.c_str(),
-					0,
-					D3D11_USAGE_STAGING,
-					0,
-					D3D11_CPU_ACCESS_READ | D3D11_CPU_ACCESS_WRITE,
-					0,
-					false,
-					&resource,
-					nullptr));
+void BakedAnimationClip::bake(const AnimationClip& clip, float interval)
+{
+	mBoneCount = static_cast<UINT>(clip.mAnimationObjects.size());
+	mGroupCount = (mBoneCount + 3) / 4;
+	mTimes.clear();
+	mKeys.clear();
+	mIsResampled = false;
 
-				HR(resource->QueryInterface(IID_ID3D11Texture2D, (void**)&textures.at(i)));
+	// every key time of every bone, sampling there reproduces the lerps and slerps of each bone exactly
+	for (const AnimationObject& animation : clip.mAnimationObjects)
+	{
+		if (animation.keyframes.size() > 1)
+		{
+			for (const auto& keyframe : animation.keyframes)
+			{
+				mTimes.push_back(keyframe.time);
 			}
+		}
+	}
 
+	std::sort(mTimes.begin(), mTimes.end());
+	mTimes.erase(std::unique(mTimes.begin(), mTimes.end()), mTimes.end());
 
-		} // for each filename
-
-		D3D11_TEXTURE2D_DESC TextureDesc;
-		textures.front()->GetDesc(&TextureDesc);
+	const float start = clip.GetTimeClipStart();
+	const float duration = clip.GetTimeClipEnd() - start;
 
-		D3D11_TEXTURE2D_DESC TextureArrayDesc;
-		TextureArrayDesc.Width = TextureDesc.Width;
-		TextureArrayDesc.Height = TextureDesc.Height;
-		TextureArrayDesc.MipLevels = TextureDesc.MipLevels;
-		TextureArrayDesc.ArraySize = textures.size();
-		TextureArrayDesc.Format = TextureDesc.Format;
-		TextureArrayDesc.SampleDesc.Count = 1;
-		TextureArrayDesc.SampleDesc.Quality = 0;
-		TextureArrayDesc.Usage = D3D11_USAGE_DEFAULT;
-		TextureArrayDesc.BindFlags = D3D11_BIND_SHADER_RESOURCE;
-		TextureArrayDesc.CPUAccessFlags = 0;
-		TextureArrayDesc.MiscFlags = 0;
+	// shortened so that the keyframes end on the last one, as in AnimationObject::resample
+	const UINT count = duration > 0.0f && interval > 0.0f ? static_cast<UINT>(std::ceil(duration / interval)) + 1 : 1;
 
-		ID3D11Texture2D* TextureArray = nullptr;
-		HR(mDevice->CreateTexture2D(&TextureArrayDesc, nullptr, &TextureArray));
+	// if asked to, when the bones' keys don't line up and that takes more keyframes than resampling
+	if (interval > 0.0f && mTimes.size() > count)
+	{
+		mIsResampled = true;
+		mTimes.resize(count);
 
-		for (UINT ArraySlice = 0; ArraySlice < textures.size(); ++ArraySlice)
+		for (UINT i = 0; i < count; ++i)
 		{
-			ID3D11Texture2D* texture = textures.at(ArraySlice);
-
-			for (UINT MipSlice = 0; MipSlice < TextureDesc.MipLevels; ++MipSlice)
-			{
-				D3D11_MAPPED_SUBRESOURCE MappedData;
-
-				HR(mContext->Map(texture, MipSlice, D3D11_MAP_READ, 0, &MappedData));
-
-				UINT subresource = D3D11CalcSubresource(MipSlice, ArraySlice, TextureDesc.MipLevels);
-				mContext->UpdateSubresource(TextureArray, subresource, nullptr, MappedData.pData, MappedData.RowPitch, MappedData.DepthPitch);
-
-				mContext->Unmap(texture, MipSlice);
-			}
+			mTimes[i] = i + 1 < count ? start + i * (duration / (count - 1)) : clip.GetTimeClipEnd();
 		}
+	}
+	else if (mTimes.empty())
+	{
+		// nothing moves
+		mTimes.push_back(start);
+	}
 
-		ID3D11ShaderResourceView* srv;
-
-		D3D11_SHADER_RESOURCE_VIEW_DESC desc;
-		desc.Format = TextureArrayDesc.Format;
-		desc.ViewDimension = D3D11_SRV_DIMENSION_TEXTURE2DARRAY;
-		desc.Texture2DArray.MostDetailedMip = 0;
-		desc.Texture2DArray.MipLevels = TextureArrayDesc.MipLevels;
-		desc.Texture2DArray.FirstArraySlice = 0;
-		desc.Texture2DArray.ArraySize = textures.size();
+	// evenly spaced, within 1% of the interval as in AnimationObject::UpdateKeyInterval
+	mInvKeyInterval = 0.0f;
 
-		HR(mDevice->CreateShaderResourceView(TextureArray, &desc, &srv));
-		mSRVs.emplace(MapKey, srv);
+	const float step = mTimes.size() > 1 ? (mTimes.back() - mTimes.front()) / (mTimes.size() - 1) : 0.0f;
 
-		SafeRelease(TextureArray);
+	if (step > 0.0f)
+	{
+		bool IsEven = true;
 
-		for (ID3D11Texture2D* texture : textures)
+		for (UINT i = 0; i < mTimes.size() && IsEven; ++i)
 		{
-			SafeRelease(texture);
+			IsEven = std::abs(mTimes[i] - (mTimes.front() + i * step)) <= 0.01f * step;
 		}
 
-		return srv;
+		mInvKeyInterval = IsEven ? 1.0f / step : 0.0f;
 	}
-}
 
-UINT TextureManager::CreateRandomTexture1DSRV()
-{
-	XMFLOAT4 RandomValues[1024];
+	// sample every bone at every key time, the padding lanes hold the identity
+	mKeys.resize(mTimes.size() * mGroupCount * StreamCount);
 
-	for (int i = 0; i < 1024; ++i)
-	{
-		RandomValues[i].x = GameMath::RandNorm(-1.0f, +1.0f);
-		RandomValues[i].y = GameMath::RandNorm(-1.0f, +1.0f);
-		RandomValues[i].z = GameMath::RandNorm(-1.0f, +1.0f);
-		RandomValues[i].w = GameMath::RandNorm(-1.0f, +1.0f);
-	}
+	std::vector<UINT> cursors(mBoneCount, 0);
 
-	D3D11_SUBRESOURCE_DATA InitData;
-	InitData.pSysMem = RandomValues;
-	InitData.SysMemPitch = 1024 * sizeof(XMFLOAT4);
-	InitData.SysMemSlicePitch = 0;
+	for (UINT frame = 0; frame < mTimes.size(); ++frame)
+	{
+		for (UINT group = 0; group < mGroupCount; ++group)
+		{
+			XMFLOAT4 streams[StreamCount];
 
-	D3D11_TEXTURE1D_DESC TextureDesc;
-	TextureDesc.Width = 1024;
-	TextureDesc.MipLevels = 1;
-	TextureDesc.Format = DXGI_FORMAT_R32G32B32A32_FLOAT;
-	TextureDesc.Usage = D3D11_USAGE_IMMUTABLE;
-	TextureDesc.BindFlags = D3D11_BIND_SHADER_RESOURCE;
-	TextureDesc.CPUAccessFlags = 0;
-	TextureDesc.MiscFlags = 0;
-	TextureDesc.ArraySize = 1;
+			for (UINT lane = 0; lane < 4; ++lane)
+			{
+				XMFLOAT3 T(0.0f, 0.0f, 0.0f);
+				XMFLOAT3 S(1.0f, 1.0f, 1.0f);
+				XMFLOAT4 Q(0.0f, 0.0f, 0.0f, 1.0f);
 
-	ID3D11Texture1D* texture = nullptr;
-	HR(mDevice->CreateTexture1D(&TextureDesc, &InitData, &texture));
+				const UINT bone = group * 4 + lane;
 
-	D3D11_SHADER_RESOURCE_VIEW_DESC ViewDesc;
-	ViewDesc.Format = TextureDesc.Format;
-	ViewDesc.ViewDimension = D3D11_SRV_DIMENSION_TEXTURE1D;
-	ViewDesc.Texture1D.MipLevels = TextureDesc.MipLevels;
-	ViewDesc.Texture1D.MostDetailedMip = 0;
+				if (bone < mBoneCount)
+				{
+					XMVECTOR VS, VR, VT;
+					clip.mAnimationObjects[bone].interpolate(mTimes[frame], VS, VR, VT, cursors[bone]);
 
-	ID3D11ShaderResourceView* srv = nullptr;
-	HR(mDevice->CreateShaderResourceView(texture, &ViewDesc, &srv));
+					XMStoreFloat3(&T, VT);
+					XMStoreFloat3(&S, VS);
+					XMStoreFloat4(&Q, VR);
+				}
 
-	SafeRelease(texture);
+				const float values[StreamCount] = { T.x, T.y, T.z, S.x, S.y, S.z, Q.x, Q.y, Q.z, Q.w };
 
-	mNamelessTextureSRVs.push_back(srv);
+				for (UINT stream = 0; stream < StreamCount; ++stream)
+				{
+					(&streams[stream].x)[lane] = values[stream];
+				}
+			}
 
-	return mNamelessTextureSRVs.size() - 1;
-}
+			XMVECTOR* keys = &mKeys[(frame * mGroupCount + group) * StreamCount];
 
-ID3D11ShaderResourceView* TextureManager::GetNamelessTextureSRV(UINT index)
-{
-	return mNamelessTextureSRVs.at(index);
+			for (UINT stream = 0; stream < StreamCount; ++stream)
+			{
+				keys[stream] = XMLoadFloat4(&streams[stream]);
+			}
+		}
+	}
 }
 
-bool Model3DLoader::load(const std::string& filename,
-						 std::vector<GeometryGenerator::Vertex>& vertices,
-						 std::vector<UINT>& indices,
-						 std::vector<Subset>& subsets,
-						 std::vector<Model3DMaterial>& materials,
-						 SkinnedObject* SkinnedData)
+void BakedAnimationClip::GetKeyPair(const float* times, UINT count, float InvKeyInterval, float t, UINT& cursor, UINT& a, UINT& b, float& x)
 {
-	std::string base = "C:/Users/D3PO/source/repos/3D Game Programming with DirectX 11/models/";
-	//std::string base = "C:/Users/ggarbin/Desktop/3D-Game-Programming-with-DirectX11/models/";
-	std::ifstream ifs(base + filename);
-
-	UINT nMaterials = 0;
-	UINT nVertices = 0;
-	UINT nTriangles = 0;
-	UINT nBones = 0;
-	UINT nAnimationClips = 0;
+	const UINT last = count - 1;
 
-	std::string ignore;
+	// a and b are the same keyframe at the ends
+	a = 0;
+	b = 0;
+	x = 0.0f;
 
-	if (ifs)
+	if (t >= times[last])
 	{
-		ifs >> ignore; // ignore header
-		ifs >> ignore >> nMaterials;
-		ifs >> ignore >> nVertices;
-		ifs >> ignore >> nTriangles;
-		ifs >> ignore >> nBones;
-		ifs >> ignore >> nAnimationClips;
+		a = b = last;
+	}
+	else if (t > times[0])
+	{
+		// evenly spaced keyframes, the guess is off by at most one because of rounding
+		if (InvKeyInterval > 0.0f)
+		{
+			cursor = std::min(static_cast<UINT>((t - times[0]) * InvKeyInterval), last - 1);
+		}
 
-		LoadMaterials(ifs, nMaterials, materials);
-		LoadSubsets(ifs, nMaterials, subsets);
-		LoadVertices(ifs, nVertices, vertices, SkinnedData ? true : false);
-		LoadTriangles(ifs, nTriangles, indices);
+		// the same pair as last time, the next one or the previous one, otherwise binary search
+		auto IsInside = [&](UINT i)
+		{
+			return i < last && times[i] <= t && t < times[i + 1];
+		};
 
-		if (SkinnedData)
+		if (!IsInside(cursor))
 		{
-			LoadBoneOffsets(ifs, nBones, SkinnedData->mBoneOffsets);
-			LoadBoneHierarchy(ifs, nBones, SkinnedData->mBoneHierarchy);
-			LoadAnimationClips(ifs, nBones, nAnimationClips, SkinnedData->mAnimationClips);
+			if (IsInside(cursor + 1))
+			{
+				cursor += 1;
+			}
+			else if (cursor > 0 && IsInside(cursor - 1))
+			{
+				cursor -= 1;
+			}
+			else
+			{
+				cursor = std::min(static_cast<UINT>(std::upper_bound(times, times + count, t) - times) - 1, last - 1);
+			}
 		}
 
-		return true;
+		a = cursor;
+		b = cursor + 1;
+		x = (t - times[a]) / (times[b] - times[a]);
 	}
-
-	return false;
 }
 
-bool Model3DLoader::load(const std::string& filename,
-						 TextureManager& manager,
-						 GameObject& obj)
+void BakedAnimationClip::interpolate(float t, XMMATRIX* transforms, UINT& cursor) const
 {
-	std::vector<Model3DMaterial> materials;
-
-	if (load(filename, obj.mMesh.mVertices, obj.mMesh.mIndices, obj.mSubsets, materials, obj.mIsSkinned ? &obj.mSkinnedData : nullptr))
-	{
-		for (const Model3DMaterial& material : materials)
+	// one lookup for all the bones
+	UINT a, b;
+	float x;
+	GetKeyPair(mTimes.data(), static_cast<UINT>(mTimes.size()), mInvKeyInterval, t, cursor, a, b, x);
+
+	const XMVECTOR X = XMVectorReplicate(x);
+	const XMVECTOR one = XMVectorReplicate(1.0f);
+	const XMVECTOR two = XMVectorReplicate(2.0f);
+	const XMVECTOR OneMinusX = one - X;
+	// below it slerp falls back to lerp, as XMQuaternionSlerp
+	const XMVECTOR OneMinusEpsilon = XMVectorReplicate(1.0f - 0.00001f);
+
+	for (UINT group = 0; group < mGroupCount; ++group)
+	{
+		const XMVECTOR* A = GetKeys(a, group);
+		const XMVECTOR* B = GetKeys(b, group);
+
+		// scale and translation lerp
+		const XMVECTOR TX = A[StreamTX] + (B[StreamTX] - A[StreamTX]) * X;
+		const XMVECTOR TY = A[StreamTY] + (B[StreamTY] - A[StreamTY]) * X;
+		const XMVECTOR TZ = A[StreamTZ] + (B[StreamTZ] - A[StreamTZ]) * X;
+		const XMVECTOR SX = A[StreamSX] + (B[StreamSX] - A[StreamSX]) * X;
+		const XMVECTOR SY = A[StreamSY] + (B[StreamSY] - A[StreamSY]) * X;
+		const XMVECTOR SZ = A[StreamSZ] + (B[StreamSZ] - A[StreamSZ]) * X;
+
+		// rotation slerp along the shorter arc, 4 bones at a time
+		XMVECTOR CosOmega = A[StreamQX] * B[StreamQX] + A[StreamQY] * B[StreamQY] + A[StreamQZ] * B[StreamQZ] + A[StreamQW] * B[StreamQW];
+
+		const XMVECTOR sign = XMVectorSelect(one, -one, XMVectorLess(CosOmega, XMVectorZero()));
+		CosOmega *= sign;
+
+		const XMVECTOR SinOmega = XMVectorSqrt(XMVectorMax(one - CosOmega * CosOmega, XMVectorZero()));
+		const XMVECTOR omega = XMVectorATan2(SinOmega, CosOmega);
+		const XMVECTOR IsLinear = XMVectorGreaterOrEqual(CosOmega, OneMinusEpsilon);
+
+		const XMVECTOR s0 = XMVectorSelect(XMVectorSin(OneMinusX * omega) / SinOmega, OneMinusX, IsLinear);
+		const XMVECTOR s1 = XMVectorSelect(XMVectorSin(X * omega) / SinOmega, X, IsLinear) * sign;
+
+		const XMVECTOR QX = A[StreamQX] * s0 + B[StreamQX] * s1;
+		const XMVECTOR QY = A[StreamQY] * s0 + B[StreamQY] * s1;
+		const XMVECTOR QZ = A[StreamQZ] * s0 + B[StreamQZ] * s1;
+		const XMVECTOR QW = A[StreamQW] * s0 + B[StreamQW] * s1;
+
+		// XMMatrixAffineTransformation with the origin at 0, rows of the rotation scaled by S plus T
+		const XMVECTOR XX = QX * QX, YY = QY * QY, ZZ = QZ * QZ;
+		const XMVECTOR XY = QX * QY, XZ = QX * QZ, YZ = QY * QZ;
+		const XMVECTOR XW = QX * QW, YW = QY * QW, ZW = QZ * QW;
+
+		// one column of the 3x3 part per vector, the transposes turn them into one matrix per bone
+		const XMMATRIX R0 = XMMatrixTranspose(XMMATRIX((one - two * (YY + ZZ)) * SX, two * (XY + ZW) * SX, two * (XZ - YW) * SX, XMVectorZero()));
+		const XMMATRIX R1 = XMMatrixTranspose(XMMATRIX(two * (XY - ZW) * SY, (one - two * (XX + ZZ)) * SY, two * (YZ + XW) * SY, XMVectorZero()));
+		const XMMATRIX R2 = XMMatrixTranspose(XMMATRIX(two * (XZ + YW) * SZ, two * (YZ - XW) * SZ, (one - two * (XX + YY)) * SZ, XMVectorZero()));
+		const XMMATRIX R3 = XMMatrixTranspose(XMMATRIX(TX, TY, TZ, one));
+
+		const UINT count = std::min(4u, mBoneCount - group * 4);
+
+		for (UINT lane = 0; lane < count; ++lane)
 		{
-			obj.mMaterials.push_back(material.material);
-
-			ID3D11ShaderResourceView* DiffuseMapSRV = manager.CreateSRV(material.DiffuseMapFileName);
-			obj.mDiffuseMapSRVs.push_back(DiffuseMapSRV);
-
-			ID3D11ShaderResourceView* NormalMapSRV = manager.CreateSRV(material.NormalMapFileName);
-			obj.mNormalMapSRVs.push_back(NormalMapSRV);
-
-			obj.mIsAlphaClipping.push_back(material.IsAlphaClipping);
+			transforms[group * 4 + lane] = XMMATRIX(R0.r[lane], R1.r[lane], R2.r[lane], R3.r[lane]);
 		}
-		return true;
 	}
-	return false;
 }
 
-void Model3DLoader::LoadVertices(std::ifstream& ifs,
-								 UINT count,
-								 std::vector<GeometryGenerator::Vertex>& vertices,
-								 bool skinned)
+CompressedAnimationClip::Report CompressedAnimationClip::compress(const AnimationClip& clip, float MaxTranslationError, float MaxRotationError, float MaxScaleError)
 {
-	vertices.clear();
-	vertices.resize(count);
+	mTimeClipStart = clip.GetTimeClipStart();
+	mTimeClipEnd = clip.GetTimeClipEnd();
+	mTracks.clear();
+	mTimes.clear();
+	mRotations.clear();
+	mVectors.clear();
 
-	std::string ignore;
-	ifs >> ignore; // ignore header
+	Report report = {};
 
-	for (UINT i = 0; i < count; ++i)
+	// the angle between two rotations, from the chord as acos loses the small ones
+	auto angle = [](FXMVECTOR Q0, FXMVECTOR Q1)
 	{
-		ifs >> ignore >> vertices[i].mPosition.x >> vertices[i].mPosition.y >> vertices[i].mPosition.z;
-		ifs >> ignore >> vertices[i].mTangent.x >> vertices[i].mTangent.y >> vertices[i].mTangent.z >> ignore; // vertices[i].mTangent.w;
-		ifs >> ignore >> vertices[i].mNormal.x >> vertices[i].mNormal.y >> vertices[i].mNormal.z;
-		ifs >> ignore >> vertices[i].mTexCoord.x >> vertices[i].mTexCoord.y;
+		const float sign = XMVectorGetX(XMVector4Dot(Q0, Q1)) < 0.0f ? -1.0f : 1.0f;
+		const float chord = XMVectorGetX(XMVector4Length(Q0 - Q1 * sign));
 
-		if (skinned)
+		return 4.0f * std::asin(std::min(0.5f * chord, 1.0f));
+	};
+
+	auto distance = [](FXMVECTOR V0, FXMVECTOR V1)
+	{
+		return XMVectorGetX(XMVector3Length(V0 - V1));
+	};
+
+	std::vector<Rotation> rotations;
+	std::vector<UINT> kept;
+
+	for (const AnimationObject& animation : clip.mAnimationObjects)
+	{
+		const auto& keyframes = animation.keyframes;
+		const UINT count = static_cast<UINT>(keyframes.size());
+
+		report.mSourceBytes += keyframes.size() * sizeof(keyframes[0]);
+
+		rotations.resize(count);
+
+		for (UINT k = 0; k < count; ++k)
 		{
-			float weights[4];
-			ifs >> ignore >> weights[0] >> weights[1] >> weights[2] >> weights[3];
-			vertices[i].mWeights.x = weights[0];
-			vertices[i].mWeights.y = weights[1];
-			vertices[i].mWeights.z = weights[2];
+			rotations[k] = EncodeRotation(XMLoadFloat4(&keyframes[k].rotation));
+		}
 
-			UINT BoneIndices[4];
-			ifs >> ignore >> BoneIndices[0] >> BoneIndices[1] >> BoneIndices[2] >> BoneIndices[3];
-			vertices[i].mBoneIndices[0] = (BYTE)BoneIndices[0];
-			vertices[i].mBoneIndices[1] = (BYTE)BoneIndices[1];
-			vertices[i].mBoneIndices[2] = (BYTE)BoneIndices[2];
-			vertices[i].mBoneIndices[3] = (BYTE)BoneIndices[3];
+		// a channel within the max error of its first value at every key is stored once
+		bool IsTranslationConstant = true;
+		bool IsScaleConstant = true;
+
+		for (UINT k = 1; k < count; ++k)
+		{
+			IsTranslationConstant = IsTranslationConstant && distance(XMLoadFloat3(&keyframes[k].translation), XMLoadFloat3(&keyframes[0].translation)) <= MaxTranslationError;
+			IsScaleConstant = IsScaleConstant && distance(XMLoadFloat3(&keyframes[k].scale), XMLoadFloat3(&keyframes[0].scale)) <= MaxScaleError;
+		}
+
+		// the keys between i and j are within the max errors of the interpolation of i and j
+		auto IsReproduced = [&](UINT i, UINT j)
+		{
+			// the keys of a step must stay
+			if (keyframes[j].time <= keyframes[i].time)
+			{
+				return false;
+			}
+
+			const XMVECTOR Ri = DecodeRotation(rotations[i]);
+			const XMVECTOR Rj = DecodeRotation(rotations[j]);
+
+			for (UINT k = i + 1; k < j; ++k)
+			{
+				const float x = (keyframes[k].time - keyframes[i].time) / (keyframes[j].time - keyframes[i].time);
+
+				if (!IsTranslationConstant &&
+					distance(XMVectorLerp(XMLoadFloat3(&keyframes[i].translation), XMLoadFloat3(&keyframes[j].translation), x), XMLoadFloat3(&keyframes[k].translation)) > MaxTranslationError)
+				{
+					return false;
+				}
+
+				if (!IsScaleConstant &&
+					distance(XMVectorLerp(XMLoadFloat3(&keyframes[i].scale), XMLoadFloat3(&keyframes[j].scale), x), XMLoadFloat3(&keyframes[k].scale)) > MaxScaleError)
+				{
+					return false;
+				}
+
+				if (angle(XMQuaternionSlerp(Ri, Rj, x), XMLoadFloat4(&keyframes[k].rotation)) > MaxRotationError)
+				{
+					return false;
+				}
+			}
+
+			return true;
+		};
+
+		kept.assign(1, 0);
+
+		if (count > 1)
+		{
+			// most bones of most clips don't move, the first key is enough
+			bool IsStatic = IsTranslationConstant && IsScaleConstant;
+
+			const XMVECTOR R0 = DecodeRotation(rotations[0]);
+
+			for (UINT k = 1; k < count && IsStatic; ++k)
+			{
+				IsStatic = angle(R0, XMLoadFloat4(&keyframes[k].rotation)) <= MaxRotationError;
+			}
+
+			if (!IsStatic)
+			{
+				// each kept key reaches as far as it can
+				UINT anchor = 0;
+
+				for (UINT j = 2; j < count; ++j)
+				{
+					if (!IsReproduced(anchor, j))
+					{
+						anchor = j - 1;
+						kept.push_back(anchor);
+					}
+				}
+
+				kept.push_back(count - 1);
+			}
+		}
+
+		Track track;
+		track.mFirstKey = static_cast<UINT>(mTimes.size());
+		track.mKeyCount = static_cast<UINT>(kept.size());
+		track.mTranslation = static_cast<UINT>(mVectors.size());
+		track.mTranslationStride = IsTranslationConstant ? 0 : 1;
+
+		for (UINT k = 0; k < (IsTranslationConstant ? 1 : track.mKeyCount); ++k)
+		{
+			mVectors.push_back(keyframes[kept[k]].translation);
+		}
+
+		track.mScale = static_cast<UINT>(mVectors.size());
+		track.mScaleStride = IsScaleConstant ? 0 : 1;
+
+		for (UINT k = 0; k < (IsScaleConstant ? 1 : track.mKeyCount); ++k)
+		{
+			mVectors.push_back(keyframes[kept[k]].scale);
+		}
+
+		for (UINT k : kept)
+		{
+			mTimes.push_back(keyframes[k].time);
+			mRotations.push_back(rotations[k]);
+		}
+
+		mTracks.push_back(track);
+
+		// measured at the source keys and halfway between them
+		UINT SourceCursor = 0;
+		UINT cursor = 0;
+
+		for (UINT k = 0; k < count; ++k)
+		{
+			for (UINT half = 0; half < (k + 1 < count ? 2u : 1u); ++half)
+			{
+				const float t = half ? 0.5f * (keyframes[k].time + keyframes[k + 1].time) : keyframes[k].time;
+
+				XMVECTOR S0, R0, T0;
+				animation.interpolate(t, S0, R0, T0, SourceCursor);
+
+				XMVECTOR S, R, T;
+				interpolate(track, t, cursor, S, R, T);
+
+				report.mMaxTranslationError = std::max(report.mMaxTranslationError, distance(T, T0));
+				report.mMaxRotationError = std::max(report.mMaxRotationError, angle(R, R0));
+				report.mMaxScaleError = std::max(report.mMaxScaleError, distance(S, S0));
+			}
 		}
 	}
+
+	report.mCompressedBytes =
+		mTracks.size() * sizeof(Track) +
+		mTimes.size() * sizeof(float) +
+		mRotations.size() * sizeof(Rotation) +
+		mVectors.size() * sizeof(XMFLOAT3);
+
+	return report;
 }
 
-void Model3DLoader::LoadTriangles(std::ifstream& ifs, UINT count, std::vector<UINT>& indices)
+void CompressedAnimationClip::interpolate(float t, XMMATRIX* transforms, UINT* cursors) const
 {
-	indices.clear();
-	indices.resize(count * 3);
+	// rotation origin
+	const XMVECTOR O = XMVectorSet(0.0f, 0.0f, 0.0f, 1.0f);
 
-	std::string ignore;
-	ifs >> ignore; // ignore header
+	for (UINT bone = 0; bone < mTracks.size(); ++bone)
+	{
+		UINT cursor = 0;
 
-	for (UINT i = 0; i < count; ++i)
+		XMVECTOR S, R, T;
+		interpolate(mTracks[bone], t, cursors ? cursors[bone] : cursor, S, R, T);
+
+		transforms[bone] = XMMatrixAffineTransformation(S, O, R, T);
+	}
+}
+
+CompressedAnimationClip::Rotation CompressedAnimationClip::EncodeRotation(FXMVECTOR Q)
+{
+	// the other components of a unit quaternion are within 1/sqrt(2) of 0 when the largest is left out
+	const float range = 0.70710678f;
+
+	XMFLOAT4 q;
+	XMStoreFloat4(&q, XMQuaternionNormalize(Q));
+
+	const float* c = &q.x;
+
+	UINT largest = 0;
+
+	for (UINT i = 1; i < 4; ++i)
 	{
-		ifs >> indices[i * 3 + 0];
-		ifs >> indices[i * 3 + 1];
-		ifs >> indices[i * 3 + 2];
+		if (std::abs(c[i]) > std::abs(c[largest]))
+		{
+			largest = i;
+		}
+	}
+
+	// q and -q are the same rotation, the largest is made positive and rebuilt from the others
+	const float sign = c[largest] < 0.0f ? -1.0f : 1.0f;
+
+	UINT64 bits = largest;
+	UINT shift = 2;
+
+	for (UINT i = 0; i < 4; ++i)
+	{
+		if (i != largest)
+		{
+			const float v = (c[i] * sign + range) * (32767.0f / (2.0f * range));
+
+			bits |= static_cast<UINT64>(std::clamp(v + 0.5f, 0.0f, 32767.0f)) << shift;
+			shift += 15;
+		}
 	}
+
+	Rotation rotation;
+	rotation.mBits[0] = static_cast<USHORT>(bits);
+	rotation.mBits[1] = static_cast<USHORT>(bits >> 16);
+	rotation.mBits[2] = static_cast<USHORT>(bits >> 32);
+
+	return rotation;
 }
 
-void Model3DLoader::LoadSubsets(std::ifstream& ifs, UINT count, std::vector<Subset>& subsets)
+XMVECTOR CompressedAnimationClip::DecodeRotation(const Rotation& rotation)
 {
-	subsets.clear();
-	subsets.resize(count);
+	const float range = 0.70710678f;
 
-	std::string ignore;
-	ifs >> ignore; // ignore header
+	const UINT64 bits = UINT64(rotation.mBits[0]) | UINT64(rotation.mBits[1]) << 16 | UINT64(rotation.mBits[2]) << 32;
+	const UINT largest = static_cast<UINT>(bits & 3);
 
-	for (UINT i = 0; i < count; ++i)
+	float c[4];
+	float SumOfSquares = 0.0f;
+	UINT shift = 2;
+
+	for (UINT i = 0; i < 4; ++i)
 	{
-		ifs >> ignore >> subsets[i].id;
-		ifs >> ignore >> subsets[i].VertexStart;
-		ifs >> ignore >> subsets[i].VertexCount;
-		ifs >> ignore >> subsets[i].FaceStart;
-		ifs >> ignore >> subsets[i].FaceCount;
+		if (i != largest)
+		{
+			c[i] = ((bits >> shift) & 0x7FFF) * (2.0f * range / 32767.0f) - range;
+			SumOfSquares += c[i] * c[i];
+			shift += 15;
+		}
 	}
+
+	c[largest] = std::sqrt(std::max(1.0f - SumOfSquares, 0.0f));
+
+	return XMVectorSet(c[0], c[1], c[2], c[3]);
 }
 
-void Model3DLoader::LoadMaterials(std::ifstream& ifs, UINT count, std::vector<Model3DMaterial>& materials)
+void CompressedAnimationClip::interpolate(const Track& track, float t, UINT& cursor, XMVECTOR& S, XMVECTOR& R, XMVECTOR& T) const
 {
-	materials.clear();
-	materials.resize(count);
+	// kept keys aren't evenly spaced any more
+	UINT a, b;
+	float x;
+	BakedAnimationClip::GetKeyPair(&mTimes[track.mFirstKey], track.mKeyCount, 0.0f, t, cursor, a, b, x);
 
-	std::string DiffuseMapFileName;
-	std::string NormalMapFileName;
+	const XMFLOAT3* translations = &mVectors[track.mTranslation];
+	const XMFLOAT3* scales = &mVectors[track.mScale];
 
-	std::string ignore;
-	ifs >> ignore; // ignore header
+	T = XMVectorLerp(XMLoadFloat3(&translations[a * track.mTranslationStride]), XMLoadFloat3(&translations[b * track.mTranslationStride]), x);
+	S = XMVectorLerp(XMLoadFloat3(&scales[a * track.mScaleStride]), XMLoadFloat3(&scales[b * track.mScaleStride]), x);
 
-	for (UINT i = 0; i < count; ++i)
+	const XMVECTOR Ra = DecodeRotation(mRotations[track.mFirstKey + a]);
+
+	R = a == b ? Ra : XMQuaternionSlerp(Ra, DecodeRotation(mRotations[track.mFirstKey + b]), x);
+}
+
+TextureManager::TextureManager() :
+	mDevice(nullptr),
+	mContext(nullptr)
+{
+	//mTextureFolder = L"C:/Users/ggarbin/Desktop/3D-Game-Programming-with-DirectX11/textures/";
+	mTextureFolder = L"C:/Users/D3PO/source/repos/3D Game Programming with DirectX 11/textures/";
+}
+
+TextureManager::~TextureManager()
+{
+	for (auto& [filename, srv] : mSRVs)
 	{
-		Material& material = materials[i].material;
+		SafeRelease(srv);
+	}
+	mSRVs.clear();
 
-		ifs >> ignore >> material.mAmbient.x  >> material.mAmbient.y  >> material.mAmbient.z;
-		ifs >> ignore >> material.mDiffuse.x  >> material.mDiffuse.y  >> material.mDiffuse.z;
-		ifs >> ignore >> material.mSpecular.x >> material.mSpecular.y >> material.mSpecular.z;
-		ifs >> ignore >> material.mSpecular.w; // specular factor
-		ifs >> ignore >> material.mReflect.x >> material.mReflect.y >> material.mReflect.z;
-		ifs >> ignore >> materials[i].IsAlphaClipping;
-		ifs >> ignore >> materials[i].EffectName;
-		ifs >> ignore >> DiffuseMapFileName;
-		ifs >> ignore >> NormalMapFileName;
+	for (ID3D11ShaderResourceView* srv : mNamelessTextureSRVs)
+	{
+		SafeRelease(srv);
+	}
+	mNamelessTextureSRVs.clear();
 
-		materials[i].DiffuseMapFileName.resize(DiffuseMapFileName.size(), ' ');
-		std::copy(DiffuseMapFileName.begin(), DiffuseMapFileName.end(), materials[i].DiffuseMapFileName.begin());
+	mDevice = nullptr;
+}
 
-		materials[i].NormalMapFileName.resize(NormalMapFileName.size(), ' ');
-		std::copy(NormalMapFileName.begin(), NormalMapFileName.end(), materials[i].NormalMapFileName.begin());
+void TextureManager::init(ID3D11Device* device, ID3D11DeviceContext* context)
+{
+	mDevice = device;
+	mContext = context;
+}
+
+ID3D11ShaderResourceView* TextureManager::CreateSRV(const std::wstring& filename)
+{
+	auto i = mSRVs.find(filename);
+
+	if (i != mSRVs.end())
+	{
+		return i->second;
+	}
+	else
+	{
+		std::wstring path = mTextureFolder + filename;
+
+		ID3D11ShaderResourceView* srv;
+		ID3D11Resource* resource = nullptr;
+
+		HR(CreateDDSTextureFromFile(mDevice, path.c_str(), &resource, &srv));
+
+		mSRVs.emplace(filename, srv);
+
+		// check created texture
+		{
+			ID3D11Texture2D* texture = nullptr;
+			HR(resource->QueryInterface(IID_ID3D11Texture2D, (void**)&texture));
+
+			D3D11_TEXTURE2D_DESC desc;
+			texture->GetDesc(&desc);
+
+			SafeRelease(texture);
+		}
+
+		SafeRelease(resource);
+
+		return srv;
+	}
+}
+
+ID3D11ShaderResourceView* TextureManager::CreateSRV(const std::vector<std::wstring>& filenames)
+{
+	std::wstring MapKey;
+
+	for (const std::wstring& filename : filenames)
+	{
+		MapKey += filename;
+	}
+
+	auto i = mSRVs.find(MapKey);
+
+	if (i != mSRVs.end())
+	{
+		return i->second;
+	}
+	else
+	{
+		std::vector<ID3D11Texture2D*> textures(filenames.size(), nullptr);
+
+		for (UINT i = 0; i < filenames.size(); ++i)
+		{
+			const std::wstring& filename = filenames.at(i);
+
+			auto I = mSRVs.find(filename);
+
+			if (I != mSRVs.end())
+			{
+				HR(I->second->QueryInterface(IID_ID3D11Texture2D, (void**)&textures.at(i)));
+			}
+			else
+			{
+				std::wstring path = mTextureFolder + filename;
+				ID3D11Resource* resource = nullptr;
+
+				HR(CreateDDSTextureFromFileEx(
+					mDevice,
+					path.c_str(),
+					0,
+					D3D11_USAGE_STAGING,
+					0,
+					D3D11_CPU_ACCESS_READ | D3D11_CPU_ACCESS_WRITE,
+					0,
+					false,
+					&resource,
+					nullptr));
+
+				HR(resource->QueryInterface(IID_ID3D11Texture2D, (void**)&textures.at(i)));
+			}
+
+
+		} // for each filename
+
+		D3D11_TEXTURE2D_DESC TextureDesc;
+		textures.front()->GetDesc(&TextureDesc);
+
+		D3D11_TEXTURE2D_DESC TextureArrayDesc;
+		TextureArrayDesc.Width = TextureDesc.Width;
+		TextureArrayDesc.Height = TextureDesc.Height;
+		TextureArrayDesc.MipLevels = TextureDesc.MipLevels;
+		TextureArrayDesc.ArraySize = textures.size();
+		TextureArrayDesc.Format = TextureDesc.Format;
+		TextureArrayDesc.SampleDesc.Count = 1;
+		TextureArrayDesc.SampleDesc.Quality = 0;
+		TextureArrayDesc.Usage = D3D11_USAGE_DEFAULT;
+		TextureArrayDesc.BindFlags = D3D11_BIND_SHADER_RESOURCE;
+		TextureArrayDesc.CPUAccessFlags = 0;
+		TextureArrayDesc.MiscFlags = 0;
+
+		ID3D11Texture2D* TextureArray = nullptr;
+		HR(mDevice->CreateTexture2D(&TextureArrayDesc, nullptr, &TextureArray));
+
+		for (UINT ArraySlice = 0; ArraySlice < textures.size(); ++ArraySlice)
+		{
+			ID3D11Texture2D* texture = textures.at(ArraySlice);
+
+			for (UINT MipSlice = 0; MipSlice < TextureDesc.MipLevels; ++MipSlice)
+			{
+				D3D11_MAPPED_SUBRESOURCE MappedData;
+
+				HR(mContext->Map(texture, MipSlice, D3D11_MAP_READ, 0, &MappedData));
+
+				UINT subresource = D3D11CalcSubresource(MipSlice, ArraySlice, TextureDesc.MipLevels);
+				mContext->UpdateSubresource(TextureArray, subresource, nullptr, MappedData.pData, MappedData.RowPitch, MappedData.DepthPitch);
+
+				mContext->Unmap(texture, MipSlice);
+			}
+		}
+
+		ID3D11ShaderResourceView* srv;
+
+		D3D11_SHADER_RESOURCE_VIEW_DESC desc;
+		desc.Format = TextureArrayDesc.Format;
+		desc.ViewDimension = D3D11_SRV_DIMENSION_TEXTURE2DARRAY;
+		desc.Texture2DArray.MostDetailedMip = 0;
+		desc.Texture2DArray.MipLevels = TextureArrayDesc.MipLevels;
+		desc.Texture2DArray.FirstArraySlice = 0;
+		desc.Texture2DArray.ArraySize = textures.size();
+
+		HR(mDevice->CreateShaderResourceView(TextureArray, &desc, &srv));
+		mSRVs.emplace(MapKey, srv);
+
+		SafeRelease(TextureArray);
+
+		for (ID3D11Texture2D* texture : textures)
+		{
+			SafeRelease(texture);
+		}
+
+		return srv;
+	}
+}
+
+UINT TextureManager::CreateRandomTexture1DSRV()
+{
+	XMFLOAT4 RandomValues[1024];
+
+	for (int i = 0; i < 1024; ++i)
+	{
+		RandomValues[i].x = GameMath::RandNorm(-1.0f, +1.0f);
+		RandomValues[i].y = GameMath::RandNorm(-1.0f, +1.0f);
+		RandomValues[i].z = GameMath::RandNorm(-1.0f, +1.0f);
+		RandomValues[i].w = GameMath::RandNorm(-1.0f, +1.0f);
+	}
+
+	D3D11_SUBRESOURCE_DATA InitData;
+	InitData.pSysMem = RandomValues;
+	InitData.SysMemPitch = 1024 * sizeof(XMFLOAT4);
+	InitData.SysMemSlicePitch = 0;
+
+	D3D11_TEXTURE1D_DESC TextureDesc;
+	TextureDesc.Width = 1024;
+	TextureDesc.MipLevels = 1;
+	TextureDesc.Format = DXGI_FORMAT_R32G32B32A32_FLOAT;
+	TextureDesc.Usage = D3D11_USAGE_IMMUTABLE;
+	TextureDesc.BindFlags = D3D11_BIND_SHADER_RESOURCE;
+	TextureDesc.CPUAccessFlags = 0;
+	TextureDesc.MiscFlags = 0;
+	TextureDesc.ArraySize = 1;
+
+	ID3D11Texture1D* texture = nullptr;
+	HR(mDevice->CreateTexture1D(&TextureDesc, &InitData, &texture));
+
+	D3D11_SHADER_RESOURCE_VIEW_DESC ViewDesc;
+	ViewDesc.Format = TextureDesc.Format;
+	ViewDesc.ViewDimension = D3D11_SRV_DIMENSION_TEXTURE1D;
+	ViewDesc.Texture1D.MipLevels = TextureDesc.MipLevels;
+	ViewDesc.Texture1D.MostDetailedMip = 0;
+
+	ID3D11ShaderResourceView* srv = nullptr;
+	HR(mDevice->CreateShaderResourceView(texture, &ViewDesc, &srv));
+
+	SafeRelease(texture);
+
+	mNamelessTextureSRVs.push_back(srv);
+
+	return mNamelessTextureSRVs.size() - 1;
+}
+
+ID3D11ShaderResourceView* TextureManager::GetNamelessTextureSRV(UINT index)
+{
+	return mNamelessTextureSRVs.at(index);
+}
+
+bool Model3DLoader::load(const std::string& filename,
+						 std::vector<GeometryGenerator::Vertex>& vertices,
+						 std::vector<UINT>& indices,
+						 std::vector<Subset>& subsets,
+						 std::vector<Model3DMaterial>& materials,
+						 SkinnedObject* SkinnedData)
+{
+	std::string base = "C:/Users/D3PO/source/repos/3D Game Programming with DirectX 11/models/";
+	//std::string base = "C:/Users/ggarbin/Desktop/3D-Game-Programming-with-DirectX11/models/";
+	std::ifstream ifs(base + filename);
+
+	UINT nMaterials = 0;
+	UINT nVertices = 0;
+	UINT nTriangles = 0;
+	UINT nBones = 0;
+	UINT nAnimationClips = 0;
+
+	std::string ignore;
+
+	if (ifs)
+	{
+		ifs >> ignore; // ignore header
+		ifs >> ignore >> nMaterials;
+		ifs >> ignore >> nVertices;
+		ifs >> ignore >> nTriangles;
+		ifs >> ignore >> nBones;
+		ifs >> ignore >> nAnimationClips;
+
+		LoadMaterials(ifs, nMaterials, materials);
+		LoadSubsets(ifs, nMaterials, subsets);
+		LoadVertices(ifs, nVertices, vertices, SkinnedData ? true : false);
+		LoadTriangles(ifs, nTriangles, indices);
+
+		if (SkinnedData)
+		{
+			LoadBoneOffsets(ifs, nBones, SkinnedData->mBoneOffsets);
+			LoadBoneHierarchy(ifs, nBones, SkinnedData->mBoneHierarchy);
+			LoadAnimationClips(ifs, nBones, nAnimationClips, SkinnedData->mAnimationClips, SkinnedData->mAnimationClipHandles);
+		}
+
+		return true;
+	}
+
+	return false;
+}
+
+bool Model3DLoader::load(const std::string& filename,
+						 TextureManager& manager,
+						 GameObject& obj,
+						 MeshOptimizer::CacheStats* before,
+						 MeshOptimizer::CacheStats* after)
+{
+	std::vector<Model3DMaterial> materials;
+
+	if (load(filename, obj.mMesh.mVertices, obj.mMesh.mIndices, obj.mSubsets, materials, obj.mIsSkinned ? &obj.mSkinnedData : nullptr))
+	{
+		// exporters write triangles in arbitrary order, every pass drawing the mesh pays for it
+		MeshOptimizer::Optimize(obj.mMesh, obj.mSubsets, before, after);
+
+		for (const Model3DMaterial& material : materials)
+		{
+			obj.mMaterials.push_back(material.material);
+
+			ID3D11ShaderResourceView* DiffuseMapSRV = manager.CreateSRV(material.DiffuseMapFileName);
+			obj.mDiffuseMapSRVs.push_back(DiffuseMapSRV);
+
+			ID3D11ShaderResourceView* NormalMapSRV = manager.CreateSRV(material.NormalMapFileName);
+			obj.mNormalMapSRVs.push_back(NormalMapSRV);
+
+			obj.mIsAlphaClipping.push_back(material.IsAlphaClipping);
+		}
+		return true;
+	}
+	return false;
+}
+
+void Model3DLoader::LoadVertices(std::ifstream& ifs,
+								 UINT count,
+								 std::vector<GeometryGenerator::Vertex>& vertices,
+								 bool skinned)
+{
+	vertices.clear();
+	vertices.resize(count);
+
+	std::string ignore;
+	ifs >> ignore; // ignore header
+
+	for (UINT i = 0; i < count; ++i)
+	{
+		ifs >> ignore >> vertices[i].mPosition.x >> vertices[i].mPosition.y >> vertices[i].mPosition.z;
+		ifs >> ignore >> vertices[i].mTangent.x >> vertices[i].mTangent.y >> vertices[i].mTangent.z >> ignore; // vertices[i].mTangent.w;
+		ifs >> ignore >> vertices[i].mNormal.x >> vertices[i].mNormal.y >> vertices[i].mNormal.z;
+		ifs >> ignore >> vertices[i].mTexCoord.x >> vertices[i].mTexCoord.y;
+
+		if (skinned)
+		{
+			float weights[4];
+			ifs >> ignore >> weights[0] >> weights[1] >> weights[2] >> weights[3];
+			vertices[i].mWeights.x = weights[0];
+			vertices[i].mWeights.y = weights[1];
+			vertices[i].mWeights.z = weights[2];
+
+			UINT BoneIndices[4];
+			ifs >> ignore >> BoneIndices[0] >> BoneIndices[1] >> BoneIndices[2] >> BoneIndices[3];
+			vertices[i].mBoneIndices[0] = (BYTE)BoneIndices[0];
+			vertices[i].mBoneIndices[1] = (BYTE)BoneIndices[1];
+			vertices[i].mBoneIndices[2] = (BYTE)BoneIndices[2];
+			vertices[i].mBoneIndices[3] = (BYTE)BoneIndices[3];
+		}
+	}
+}
+
+void Model3DLoader::LoadTriangles(std::ifstream& ifs, UINT count, std::vector<UINT>& indices)
+{
+	indices.clear();
+	indices.resize(count * 3);
+
+	std::string ignore;
+	ifs >> ignore; // ignore header
+
+	for (UINT i = 0; i < count; ++i)
+	{
+		ifs >> indices[i * 3 + 0];
+		ifs >> indices[i * 3 + 1];
+		ifs >> indices[i * 3 + 2];
+	}
+}
+
+void Model3DLoader::LoadSubsets(std::ifstream& ifs, UINT count, std::vector<Subset>& subsets)
+{
+	subsets.clear();
+	subsets.resize(count);
+
+	std::string ignore;
+	ifs >> ignore; // ignore header
+
+	for (UINT i = 0; i < count; ++i)
+	{
+		ifs >> ignore >> subsets[i].id;
+		ifs >> ignore >> subsets[i].VertexStart;
+		ifs >> ignore >> subsets[i].VertexCount;
+		ifs >> ignore >> subsets[i].FaceStart;
+		ifs >> ignore >> subsets[i].FaceCount;
+	}
+}
+
+void Model3DLoader::LoadMaterials(std::ifstream& ifs, UINT count, std::vector<Model3DMaterial>& materials)
+{
+	materials.clear();
+	materials.resize(count);
+
+	std::string DiffuseMapFileName;
+	std::string NormalMapFileName;
+
+	std::string ignore;
+	ifs >> ignore; // ignore header
+
+	for (UINT i = 0; i < count; ++i)
+	{
+		Material& material = materials[i].material;
+
+		ifs >> ignore >> material.mAmbient.x  >> material.mAmbient.y  >> material.mAmbient.z;
+		ifs >> ignore >> material.mDiffuse.x  >> material.mDiffuse.y  >> material.mDiffuse.z;
+		ifs >> ignore >> material.mSpecular.x >> material.mSpecular.y >> material.mSpecular.z;
+		ifs >> ignore >> material.mSpecular.w; // specular factor
+		ifs >> ignore >> material.mReflect.x >> material.mReflect.y >> material.mReflect.z;
+		ifs >> ignore >> materials[i].IsAlphaClipping;
+		ifs >> ignore >> materials[i].EffectName;
+		ifs >> ignore >> DiffuseMapFileName;
+		ifs >> ignore >> NormalMapFileName;
+
+		materials[i].DiffuseMapFileName.resize(DiffuseMapFileName.size(), ' ');
+		std::copy(DiffuseMapFileName.begin(), DiffuseMapFileName.end(), materials[i].DiffuseMapFileName.begin());
+
+		materials[i].NormalMapFileName.resize(NormalMapFileName.size(), ' ');
+		std::copy(NormalMapFileName.begin(), NormalMapFileName.end(), materials[i].NormalMapFileName.begin());
+	}
+}
+
+void Model3DLoader::LoadBoneOffsets(std::ifstream& ifs, UINT count, std::vector<XMFLOAT4X4>& BoneOffsets)
+{
+	BoneOffsets.clear();
+	BoneOffsets.resize(count);
+
+	std::string ignore;
+	ifs >> ignore; // ignore header
+
+	for (UINT i = 0; i < count; ++i)
+	{
+		ifs >> ignore >>
+			BoneOffsets[i](0, 0) >> BoneOffsets[i](0, 1) >> BoneOffsets[i](0, 2) >> BoneOffsets[i](0, 3) >>
+			BoneOffsets[i](1, 0) >> BoneOffsets[i](1, 1) >> BoneOffsets[i](1, 2) >> BoneOffsets[i](1, 3) >>
+			BoneOffsets[i](2, 0) >> BoneOffsets[i](2, 1) >> BoneOffsets[i](2, 2) >> BoneOffsets[i](2, 3) >>
+			BoneOffsets[i](3, 0) >> BoneOffsets[i](3, 1) >> BoneOffsets[i](3, 2) >> BoneOffsets[i](3, 3);
+	}
+}
+
+void Model3DLoader::LoadBoneHierarchy(std::ifstream& ifs, UINT count, std::vector<UINT>& BoneHierarchy)
+{
+	BoneHierarchy.clear();
+	BoneHierarchy.resize(count);
+
+	std::string ignore;
+	ifs >> ignore; // ignore header
+
+	for (UINT i = 0; i < count; ++i)
+	{
+		ifs >> ignore >> BoneHierarchy[i];
+	}
+}
+
+void Model3DLoader::LoadAnimationClips(std::ifstream& ifs,
+									   UINT BoneCount,
+									   UINT AnimationClipCount,
+									   std::vector<AnimationClip>& animations,
+									   std::map<std::string, SkinnedObject::ClipHandle>& handles)
+{
+	std::string ignore;
+	ifs >> ignore; // ignore header
+
+	for (UINT ClipIndex = 0; ClipIndex < AnimationClipCount; ++ClipIndex)
+	{
+		std::string ClipName;
+		ifs >> ignore >> ClipName;
+		ifs >> ignore; // {
+
+		AnimationClip clip;
+		clip.mAnimationObjects.resize(BoneCount);
+
+		for (UINT BoneIndex = 0; BoneIndex < BoneCount; ++BoneIndex)
+		{
+			LoadAnimation(ifs, BoneCount, clip.mAnimationObjects[BoneIndex]);
+		}
+		ifs >> ignore; // }
+
+		clip.UpdateTimeClip();
+
+		handles[ClipName] = static_cast<SkinnedObject::ClipHandle>(animations.size());
+		animations.push_back(std::move(clip));
+	}
+}
+
+void Model3DLoader::LoadAnimation(std::ifstream& ifs, UINT BoneCount, AnimationObject& animation)
+{
+	UINT keyframes = 0;
+
+	std::string ignore;
+	ifs >> ignore >> ignore >> keyframes;
+	ifs >> ignore; // {
+
+	animation.keyframes.resize(keyframes);
+
+	for (UINT i = 0; i < keyframes; ++i)
+	{
+		float t = 0.0f;
+		XMFLOAT3 T(0.0f, 0.0f, 0.0f);
+		XMFLOAT3 S(1.0f, 1.0f, 1.0f);
+		XMFLOAT4 R(0.0f, 0.0f, 0.0f, 1.0f);
+
+		ifs >> ignore >> t;
+		ifs >> ignore >> T.x >> T.y >> T.z;
+		ifs >> ignore >> S.x >> S.y >> S.z;
+		ifs >> ignore >> R.x >> R.y >> R.z >> R.w;
+
+		animation.keyframes[i].time = t;
+		animation.keyframes[i].translation = T;
+		animation.keyframes[i].scale = S;
+		animation.keyframes[i].rotation = R;
+	}
+
+	ifs >> ignore; // }
+}
+
+SkinnedObject::ClipHandle SkinnedObject::FindClip(const std::string& ClipName) const
+{
+	auto it = mAnimationClipHandles.find(ClipName);
+
+	return it != mAnimationClipHandles.end() ? it->second : InvalidClip;
+}
+
+bool SkinnedObject::HasKeyFrames() const
+{
+	for (const AnimationClip& clip : mAnimationClips)
+	{
+		for (const AnimationObject& animation : clip.mAnimationObjects)
+		{
+			if (animation.keyframes.empty())
+			{
+				return false;
+			}
+		}
+	}
+
+	return true;
+}
+
+void SkinnedObject::BakeAnimationClips(float interval)
+{
+	// the compressed clips can't be baked, keep them
+	assert(HasKeyFrames());
+
+	if (!HasKeyFrames())
+	{
+		return;
+	}
+
+	mCompressedAnimationClips.clear();
+	mBakedAnimationClips.resize(mAnimationClips.size());
+
+	for (UINT i = 0; i < mAnimationClips.size(); ++i)
+	{
+		mBakedAnimationClips[i].bake(mAnimationClips[i], interval);
+	}
+}
+
+std::map<std::string, CompressedAnimationClip::Report> SkinnedObject::CompressAnimationClips(float MaxTranslationError,
+																							 float MaxRotationError,
+																							 float MaxScaleError,
+																							 bool IsSourceKept)
+{
+	std::map<std::string, CompressedAnimationClip::Report> reports;
+
+	// compressed already, keep them
+	assert(HasKeyFrames());
+
+	if (!HasKeyFrames())
+	{
+		return reports;
+	}
+
+	mBakedAnimationClips.clear();
+	mCompressedAnimationClips.resize(mAnimationClips.size());
+
+	for (const auto& [ClipName, clip] : mAnimationClipHandles)
+	{
+		reports[ClipName] = mCompressedAnimationClips[clip].compress(mAnimationClips[clip], MaxTranslationError, MaxRotationError, MaxScaleError);
+
+		// the clip times are cached, GetTimeClipStart and GetTimeClipEnd still work
+		if (!IsSourceKept)
+		{
+			for (AnimationObject& animation : mAnimationClips[clip].mAnimationObjects)
+			{
+				animation.keyframes.clear();
+				animation.keyframes.shrink_to_fit();
+			}
+		}
+	}
+
+	return reports;
+}
+
+float SkinnedObject::GetTimeClipStart(const std::string& ClipName) const
+{
+	return mAnimationClips.at(mAnimationClipHandles.at(ClipName)).GetTimeClipStart();
+}
+
+float SkinnedObject::GetTimeClipEnd(const std::string& ClipName) const
+{
+	return mAnimationClips.at(mAnimationClipHandles.at(ClipName)).GetTimeClipEnd();
+}
+
+void SkinnedObject::GetTransforms(ClipHandle clip,
+								  float t,
+								  Scratch& scratch,
+								  XMFLOAT4X4* transforms,
+								  UINT* cursors) const
+{
+	UINT BoneCount = GetBoneCount();
+
+	if (scratch.mToParentTransforms.size() < BoneCount)
+	{
+		scratch.mToParentTransforms.resize(BoneCount);
+		scratch.mToRootTransforms.resize(BoneCount);
+	}
+
+	XMMATRIX* ToParentTransforms = scratch.mToParentTransforms.data();
+	XMMATRIX* ToRootTransforms = scratch.mToRootTransforms.data();
+
+	// interpolate all the bones of this clip at t
+	if (clip < mBakedAnimationClips.size())
+	{
+		UINT cursor = 0;
+
+		mBakedAnimationClips[clip].interpolate(t, ToParentTransforms, cursors ? cursors[0] : cursor);
+	}
+	else if (clip < mCompressedAnimationClips.size())
+	{
+		mCompressedAnimationClips[clip].interpolate(t, ToParentTransforms, cursors);
+	}
+	else
+	{
+		mAnimationClips[clip].interpolate(t, ToParentTransforms, cursors);
+	}
+
+	// traverse the hierarchy and ...
+
+	// the root bone has index 0 and has no parent,
+	// so its ToRootTransform is just its local bone transform
+	ToRootTransforms[0] = ToParentTransforms[0];
+
+	// find the ToRootTransform of the children
+	for (UINT i = 1; i < BoneCount; ++i)
+	{
+		XMMATRIX ToParent = ToParentTransforms[i];
+
+		// parent's ToRoot
+		UINT ParentIndex = mBoneHierarchy[i];
+		XMMATRIX ToRoot = ToRootTransforms[ParentIndex];
+
+		ToRootTransforms[i] = ToParent * ToRoot;
+	}
+
+	// ... and transform all the bones to the root space
+	for (UINT i = 0; i < BoneCount; ++i)
+	{
+		// premultiply by the bone offset transform to get the final transform.
+		XMMATRIX offset = XMLoadFloat4x4(&mBoneOffsets[i]);
+		XMMATRIX ToRoot = ToRootTransforms[i];
+		XMStoreFloat4x4(&transforms[i], offset * ToRoot);
+	}
+}
+
+void SkinnedObject::GetTransforms(const std::string& animation,
+								  float t,
+								  std::vector<XMFLOAT4X4>& transforms) const
+{
+	Scratch scratch;
+
+	transforms.resize(GetBoneCount());
+
+	GetTransforms(mAnimationClipHandles.at(animation), t, scratch, transforms.data());
+}
+
+std::vector<Subset> MeshOptimizer::GetSubsets(UINT VertexCount, UINT IndexCount, const std::vector<Subset>& subsets)
+{
+	if (!subsets.empty())
+	{
+		return subsets;
+	}
+
+	Subset subset;
+	subset.id = 0;
+	subset.VertexStart = 0;
+	subset.VertexCount = VertexCount;
+	subset.FaceStart = 0;
+	subset.FaceCount = IndexCount / 3;
+
+	return std::vector<Subset>(1, subset);
+}
+
+MeshOptimizer::CacheStats MeshOptimizer::ComputeCacheStats(const std::vector<UINT>& indices, UINT VertexCount, const std::vector<Subset>& subsets, UINT CacheSize)
+{
+	CacheStats stats;
+
+	// cache[v] = time stamp when v entered the FIFO
+	std::vector<UINT> cache(VertexCount, 0);
+	std::vector<bool> referenced(VertexCount, false);
+
+	UINT time = CacheSize + 1;
+	UINT misses = 0;
+	UINT triangles = 0;
+	UINT vertices = 0;
+
+	for (const Subset& subset : GetSubsets(VertexCount, static_cast<UINT>(indices.size()), subsets))
+	{
+		// flush
+		time += CacheSize;
+
+		for (UINT k = subset.FaceStart * 3; k < (subset.FaceStart + subset.FaceCount) * 3; k++)
+		{
+			UINT v = indices[k];
+
+			if (time - cache[v] > CacheSize)
+			{
+				cache[v] = time++;
+				misses++;
+			}
+
+			if (!referenced[v])
+			{
+				referenced[v] = true;
+				vertices++;
+			}
+		}
+
+		triangles += subset.FaceCount;
+	}
+
+	stats.ACMR = triangles ? static_cast<float>(misses) / triangles : 0;
+	stats.ATVR = vertices ? static_cast<float>(misses) / vertices : 0;
+
+	return stats;
+}
+
+void MeshOptimizer::OptimizeVertexCache(std::vector<UINT>& indices, UINT VertexCount, const std::vector<Subset>& subsets, UINT CacheSize)
+{
+	std::vector<UINT> offsets(VertexCount + 1);
+	std::vector<UINT> adjacency;
+	std::vector<UINT> live(VertexCount);
+	std::vector<UINT> cache(VertexCount);
+	std::vector<bool> emitted;
+	std::vector<UINT> DeadEnd;
+	std::vector<UINT> candidates;
+	std::vector<UINT> output;
+
+	for (const Subset& subset : GetSubsets(VertexCount, static_cast<UINT>(indices.size()), subsets))
+	{
+		const UINT* triangles = indices.data() + subset.FaceStart * 3;
+		const UINT count = subset.FaceCount;
+
+		if (count == 0)
+		{
+			continue;
+		}
+
+		// vertex -> local triangle adjacency, live[v] = triangles of v not emitted yet
+		std::fill(offsets.begin(), offsets.end(), 0);
+
+		for (UINT k = 0; k < count * 3; k++)
+		{
+			offsets[triangles[k] + 1]++;
+		}
+
+		for (UINT v = 0; v < VertexCount; v++)
+		{
+			live[v] = offsets[v + 1];
+			offsets[v + 1] += offsets[v];
+		}
+
+		adjacency.resize(count * 3);
+
+		std::vector<UINT> cursor(offsets.begin(), offsets.end() - 1);
+
+		for (UINT k = 0; k < count * 3; k++)
+		{
+			adjacency[cursor[triangles[k]]++] = k / 3;
+		}
+
+		std::fill(cache.begin(), cache.end(), 0);
+		emitted.assign(count, false);
+		DeadEnd.clear();
+		output.clear();
+		output.reserve(count * 3);
+
+		UINT time = CacheSize + 1;
+		UINT scan = 0;
+		int fan = static_cast<int>(triangles[0]);
+
+		while (fan >= 0)
+		{
+			candidates.clear();
+
+			// emit every live triangle around the fanning vertex
+			for (UINT k = offsets[fan]; k < offsets[fan + 1]; k++)
+			{
+				UINT t = adjacency[k];
+
+				if (emitted[t])
+				{
+					continue;
+				}
+
+				for (UINT c = 0; c < 3; c++)
+				{
+					UINT v = triangles[t * 3 + c];
+
+					output.push_back(v);
+					DeadEnd.push_back(v);
+					candidates.push_back(v);
+					live[v]--;
+
+					if (time - cache[v] > CacheSize)
+					{
+						cache[v] = time++;
+					}
+				}
+
+				emitted[t] = true;
+			}
+
+			// next fanning vertex: the candidate that will still be in cache after its own triangles
+			// are emitted and that entered the cache the earliest
+			fan = -1;
+			int best = -1;
+
+			for (UINT v : candidates)
+			{
+				if (live[v] == 0)
+				{
+					continue;
+				}
+
+				int priority = 0;
+
+				if (time - cache[v] + 2 * live[v] <= CacheSize)
+				{
+					priority = static_cast<int>(time - cache[v]);
+				}
+
+				if (priority > best)
+				{
+					best = priority;
+					fan = static_cast<int>(v);
+				}
+			}
+
+			// dead end: most recently used vertex with live triangles, else the next live triangle
+			while (fan < 0 && !DeadEnd.empty())
+			{
+				UINT v = DeadEnd.back();
+				DeadEnd.pop_back();
+
+				if (live[v] > 0)
+				{
+					fan = static_cast<int>(v);
+				}
+			}
+
+			while (fan < 0 && scan < count)
+			{
+				if (!emitted[scan])
+				{
+					fan = static_cast<int>(triangles[scan * 3]);
+				}
+
+				scan++;
+			}
+		}
+
+		std::copy(output.begin(), output.end(), indices.begin() + subset.FaceStart * 3);
+	}
+}
+
+void MeshOptimizer::OptimizeVertexFetch(std::vector<GeometryGenerator::Vertex>& vertices, std::vector<UINT>& indices, const std::vector<Subset>& subsets)
+{
+	const UINT VertexCount = static_cast<UINT>(vertices.size());
+	const UINT unused = static_cast<UINT>(-1);
+
+	std::vector<UINT> remap(VertexCount);
+	std::vector<GeometryGenerator::Vertex> copy(vertices);
+
+	const std::vector<Subset> ranges = GetSubsets(VertexCount, static_cast<UINT>(indices.size()), subsets);
+
+	for (const Subset& subset : ranges)
+	{
+		UINT first = subset.VertexStart;
+		UINT last = subset.VertexStart + subset.VertexCount;
+
+		UINT* triangles = indices.data() + subset.FaceStart * 3;
+		UINT count = subset.FaceCount * 3;
+
+		// vertices shared with other subsets would have to move across ranges, leave those alone
+		bool contained = last <= VertexCount;
+
+		for (const Subset& other : ranges)
+		{
+			if (&other != &subset && other.VertexStart < last && first < other.VertexStart + other.VertexCount)
+			{
+				contained = false;
+			}
+		}
+
+		for (UINT k = 0; k < count && contained; k++)
+		{
+			contained = (triangles[k] >= first && triangles[k] < last);
+		}
+
+		if (!contained)
+		{
+			continue;
+		}
+
+		std::fill(remap.begin() + first, remap.begin() + last, unused);
+
+		UINT next = first;
+
+		for (UINT k = 0; k < count; k++)
+		{
+			UINT& v = triangles[k];
+
+			if (remap[v] == unused)
+			{
+				remap[v] = next++;
+			}
+
+			v = remap[v];
+		}
+
+		// vertices no triangle uses go to the end of the range
+		for (UINT v = first; v < last; v++)
+		{
+			if (remap[v] == unused)
+			{
+				remap[v] = next++;
+			}
+
+			vertices[remap[v]] = copy[v];
+		}
+	}
+}
+
+void MeshOptimizer::Optimize(GeometryGenerator::Mesh& mesh, const std::vector<Subset>& subsets, CacheStats* before, CacheStats* after)
+{
+	const UINT VertexCount = static_cast<UINT>(mesh.mVertices.size());
+
+	if (before)
+	{
+		*before = ComputeCacheStats(mesh.mIndices, VertexCount, subsets);
+	}
+
+	OptimizeVertexCache(mesh.mIndices, VertexCount, subsets);
+	OptimizeVertexFetch(mesh.mVertices, mesh.mIndices, subsets);
+
+	// cached adjacency refers to the old order
+	mesh.mAdjacency = GeometryGenerator::Mesh::Adjacency();
+
+	if (after)
+	{
+		*after = ComputeCacheStats(mesh.mIndices, VertexCount, subsets);
+	}
+}
+
+XMMATRIX VertexPacker::PackedMesh::GetDequantizeMatrix() const
+{
+	return XMMatrixScaling(mPositionScale.x, mPositionScale.y, mPositionScale.z) *
+		   XMMatrixTranslation(mPositionOffset.x, mPositionOffset.y, mPositionOffset.z);
+}
+
+UINT VertexPacker::EncodeOctahedral(const XMFLOAT3& v)
+{
+	float l1 = std::abs(v.x) + std::abs(v.y) + std::abs(v.z);
+
+	if (l1 == 0.0f)
+	{
+		return 0;
+	}
+
+	float x = v.x / l1;
+	float y = v.y / l1;
+
+	if (v.z < 0.0f)
+	{
+		float ox = (1.0f - std::abs(y)) * (x >= 0.0f ? 1.0f : -1.0f);
+		float oy = (1.0f - std::abs(x)) * (y >= 0.0f ? 1.0f : -1.0f);
+
+		x = ox;
+		y = oy;
+	}
+
+	XMVECTOR N = XMVector3Normalize(XMLoadFloat3(&v));
+
+	// rounding to nearest is not the closest direction, pick the best of the four neighbours
+	float fx = std::floor(x * 32767.0f);
+	float fy = std::floor(y * 32767.0f);
+
+	UINT best = 0;
+	float BestDot = -2.0f;
+
+	for (UINT i = 0; i < 4; i++)
+	{
+		int qx = static_cast<int>(std::max(-32767.0f, std::min(32767.0f, fx + (i & 1))));
+		int qy = static_cast<int>(std::max(-32767.0f, std::min(32767.0f, fy + (i >> 1))));
+
+		UINT e = (static_cast<UINT>(qx) & 0xFFFF) | (static_cast<UINT>(qy) << 16);
+
+		XMFLOAT3 d = DecodeOctahedral(e);
+		float dot = XMVectorGetX(XMVector3Dot(N, XMLoadFloat3(&d)));
+
+		if (dot > BestDot)
+		{
+			BestDot = dot;
+			best = e;
+		}
+	}
+
+	return best;
+}
+
+XMFLOAT3 VertexPacker::DecodeOctahedral(UINT e)
+{
+	float x = std::max(-1.0f, static_cast<short>(e & 0xFFFF) / 32767.0f);
+	float y = std::max(-1.0f, static_cast<short>(e >> 16) / 32767.0f);
+	float z = 1.0f - std::abs(x) - std::abs(y);
+
+	if (z < 0.0f)
+	{
+		float ox = (1.0f - std::abs(y)) * (x >= 0.0f ? 1.0f : -1.0f);
+		float oy = (1.0f - std::abs(x)) * (y >= 0.0f ? 1.0f : -1.0f);
+
+		x = ox;
+		y = oy;
+	}
+
+	XMFLOAT3 v(x, y, z);
+	XMStoreFloat3(&v, XMVector3Normalize(XMLoadFloat3(&v)));
+
+	return v;
+}
+
+void VertexPacker::Pack(const GeometryGenerator::Mesh& mesh,
+						bool skinned,
+						PackedMesh& packed,
+						float MaxPositionError,
+						float MaxTexCoordError)
+{
+	using namespace DirectX::PackedVector;
+
+	const UINT VertexCount = static_cast<UINT>(mesh.mVertices.size());
+
+	packed = PackedMesh();
+	packed.mIsSkinned = skinned;
+
+	// positions, quantized to the bounds if the grid is fine enough
+	std::vector<std::array<USHORT, 4>> positions(VertexCount);
+
+	if (VertexCount > 0)
+	{
+		XMVECTOR vmin = XMLoadFloat3(&mesh.mVertices[0].mPosition);
+		XMVECTOR vmax = vmin;
+
+		for (const auto& vertex : mesh.mVertices)
+		{
+			XMVECTOR P = XMLoadFloat3(&vertex.mPosition);
+
+			vmin = XMVectorMin(vmin, P);
+			vmax = XMVectorMax(vmax, P);
+		}
+
+		// a flat axis still gets a non zero scale so the dequantize matrix stays invertible
+		XMVECTOR scale = XMVectorMax(vmax - vmin, XMVectorReplicate(1e-20f));
+		XMVECTOR step = scale / 65535.0f;
+
+		XMStoreFloat3(&packed.mPositionOffset, vmin);
+		XMStoreFloat3(&packed.mPositionScale, scale);
+
+		// the error is measured on what the vertex shader gets, the unorm value through the dequantize matrix
+		XMMATRIX dequantize = packed.GetDequantizeMatrix();
+
+		float error = 0.0f;
+
+		for (UINT i = 0; i < VertexCount; i++)
+		{
+			XMVECTOR P = XMLoadFloat3(&mesh.mVertices[i].mPosition);
+			XMVECTOR Q = XMVectorRound((P - vmin) / step);
+			Q = XMVectorClamp(Q, XMVectorZero(), XMVectorReplicate(65535.0f));
+
+			XMFLOAT3 q;
+			XMStoreFloat3(&q, Q);
+
+			positions[i] = { static_cast<USHORT>(q.x), static_cast<USHORT>(q.y), static_cast<USHORT>(q.z), 65535 };
+
+			XMVECTOR unorm = XMVectorSetW(Q / 65535.0f, 1.0f);
+
+			error = std::max(error, XMVectorGetX(XMVector3Length(XMVector3TransformCoord(unorm, dequantize) - P)));
+		}
+
+		packed.mIsPositionQuantized = error <= MaxPositionError;
+	}
+
+	if (!packed.mIsPositionQuantized)
+	{
+		packed.mPositionOffset = XMFLOAT3(0, 0, 0);
+		packed.mPositionScale = XMFLOAT3(1, 1, 1);
+	}
+
+	// texture coordinates, half precision is enough for uv in a small range only
+	std::vector<std::array<HALF, 2>> TexCoords(VertexCount);
+
+	packed.mIsTexCoordHalf = true;
+
+	for (UINT i = 0; i < VertexCount; i++)
+	{
+		const XMFLOAT2& uv = mesh.mVertices[i].mTexCoord;
+
+		TexCoords[i] = { XMConvertFloatToHalf(uv.x), XMConvertFloatToHalf(uv.y) };
+
+		float eu = std::abs(XMConvertHalfToFloat(TexCoords[i][0]) - uv.x);
+		float ev = std::abs(XMConvertHalfToFloat(TexCoords[i][1]) - uv.y);
+
+		// the negated compare also catches overflow to infinity
+		if (!(eu <= MaxTexCoordError && ev <= MaxTexCoordError))
+		{
+			packed.mIsTexCoordHalf = false;
+		}
+	}
+
+	auto AddElement = [&](LPCSTR name, DXGI_FORMAT format, UINT size)
+	{
+		packed.mInputLayout.push_back({ name, 0, format, 0, packed.mStride, D3D11_INPUT_PER_VERTEX_DATA, 0 });
+		packed.mStride += size;
+	};
+
+	if (packed.mIsPositionQuantized)
+	{
+		AddElement("POSITION", DXGI_FORMAT_R16G16B16A16_UNORM, 8);
+	}
+	else
+	{
+		AddElement("POSITION", DXGI_FORMAT_R32G32B32_FLOAT, 12);
+	}
+
+	AddElement("NORMAL",  DXGI_FORMAT_R16G16_SNORM, 4);
+	AddElement("TANGENT", DXGI_FORMAT_R16G16_SNORM, 4);
+
+	if (packed.mIsTexCoordHalf)
+	{
+		AddElement("TEXCOORD", DXGI_FORMAT_R16G16_FLOAT, 4);
+	}
+	else
+	{
+		AddElement("TEXCOORD", DXGI_FORMAT_R32G32_FLOAT, 8);
+	}
+
+	if (skinned)
+	{
+		AddElement("WEIGHTS",     DXGI_FORMAT_R8G8B8A8_UNORM, 4);
+		AddElement("BONEINDICES", DXGI_FORMAT_R8G8B8A8_UINT,  4);
+	}
+
+	packed.mVertices.resize(VertexCount * packed.mStride);
+
+	for (UINT i = 0; i < VertexCount; i++)
+	{
+		const GeometryGenerator::Vertex& vertex = mesh.mVertices[i];
+		BYTE* p = packed.mVertices.data() + i * packed.mStride;
+
+		auto write = [&p](const void* data, UINT size)
+		{
+			std::memcpy(p, data, size);
+			p += size;
+		};
+
+		if (packed.mIsPositionQuantized)
+		{
+			write(positions[i].data(), 8);
+		}
+		else
+		{
+			write(&vertex.mPosition, 12);
+		}
+
+		UINT normal = EncodeOctahedral(vertex.mNormal);
+		UINT tangent = EncodeOctahedral(vertex.mTangent);
+
+		write(&normal, 4);
+		write(&tangent, 4);
+
+		if (packed.mIsTexCoordHalf)
+		{
+			write(TexCoords[i].data(), 4);
+		}
+		else
+		{
+			write(&vertex.mTexCoord, 8);
+		}
+
+		if (skinned)
+		{
+			float weights[4] =
+			{
+				vertex.mWeights.x,
+				vertex.mWeights.y,
+				vertex.mWeights.z,
+				1.0f - vertex.mWeights.x - vertex.mWeights.y - vertex.mWeights.z
+			};
+
+			// largest remainder rounding, so the implicit fourth weight decodes exactly too
+			BYTE bytes[4];
+			float remainders[4];
+			UINT sum = 0;
+
+			for (UINT k = 0; k < 4; k++)
+			{
+				float w = std::max(0.0f, std::min(1.0f, weights[k])) * 255.0f;
+
+				bytes[k] = static_cast<BYTE>(std::floor(w));
+				remainders[k] = w - bytes[k];
+				sum += bytes[k];
+			}
+
+			for (; sum < 255; sum++)
+			{
+				UINT k = static_cast<UINT>(std::max_element(remainders, remainders + 4) - remainders);
+
+				bytes[k]++;
+				remainders[k] = -1.0f;
+			}
+
+			write(bytes, 4);
+			write(vertex.mBoneIndices, 4);
+		}
+	}
+}
+
+void VertexPacker::Unpack(const PackedMesh& packed, std::vector<GeometryGenerator::Vertex>& vertices)
+{
+	using namespace DirectX::PackedVector;
+
+	const UINT VertexCount = packed.mStride == 0 ? 0 : static_cast<UINT>(packed.mVertices.size() / packed.mStride);
+
+	vertices.resize(VertexCount);
+
+	for (UINT i = 0; i < VertexCount; i++)
+	{
+		GeometryGenerator::Vertex& vertex = vertices[i];
+		const BYTE* p = packed.mVertices.data() + i * packed.mStride;
+
+		auto read = [&p](void* data, UINT size)
+		{
+			std::memcpy(data, p, size);
+			p += size;
+		};
+
+		if (packed.mIsPositionQuantized)
+		{
+			USHORT q[4];
+			read(q, 8);
+
+			// as the vertex shader reads R16G16B16A16_UNORM
+			vertex.mPosition.x = packed.mPositionOffset.x + packed.mPositionScale.x * (q[0] / 65535.0f);
+			vertex.mPosition.y = packed.mPositionOffset.y + packed.mPositionScale.y * (q[1] / 65535.0f);
+			vertex.mPosition.z = packed.mPositionOffset.z + packed.mPositionScale.z * (q[2] / 65535.0f);
+		}
+		else
+		{
+			read(&vertex.mPosition, 12);
+		}
+
+		UINT normal;
+		UINT tangent;
+
+		read(&normal, 4);
+		read(&tangent, 4);
+
+		vertex.mNormal = DecodeOctahedral(normal);
+		vertex.mTangent = DecodeOctahedral(tangent);
+
+		if (packed.mIsTexCoordHalf)
+		{
+			HALF uv[2];
+			read(uv, 4);
+
+			vertex.mTexCoord = XMFLOAT2(XMConvertHalfToFloat(uv[0]), XMConvertHalfToFloat(uv[1]));
+		}
+		else
+		{
+			read(&vertex.mTexCoord, 8);
+		}
+
+		if (packed.mIsSkinned)
+		{
+			BYTE weights[4];
+			read(weights, 4);
+			read(vertex.mBoneIndices, 4);
+
+			vertex.mWeights = XMFLOAT3(weights[0] / 255.0f, weights[1] / 255.0f, weights[2] / 255.0f);
+		}
+		else
+		{
+			vertex.mWeights = XMFLOAT3(0, 0, 0);
+			ZeroMemory(&vertex.mBoneIndices, sizeof(vertex.mBoneIndices));
+		}
+	}
+}
+
+MeshSimplifier::Quadric::Quadric() :
+	weight(0)
+{
+	std::fill(q, q + 10, 0.0);
+}
+
+MeshSimplifier::Quadric::Quadric(double a, double b, double c, double d, double w) :
+	weight(w)
+{
+	q[0] = w * a * a; q[1] = w * a * b; q[2] = w * a * c; q[3] = w * a * d;
+	q[4] = w * b * b; q[5] = w * b * c; q[6] = w * b * d;
+	q[7] = w * c * c; q[8] = w * c * d;
+	q[9] = w * d * d;
+}
+
+MeshSimplifier::Quadric& MeshSimplifier::Quadric::operator+=(const Quadric& other)
+{
+	for (UINT i = 0; i < 10; i++)
+	{
+		q[i] += other.q[i];
+	}
+
+	weight += other.weight;
+
+	return *this;
+}
+
+double MeshSimplifier::Quadric::evaluate(const XMFLOAT3& p) const
+{
+	double x = p.x;
+	double y = p.y;
+	double z = p.z;
+
+	return q[0] * x * x + 2 * q[1] * x * y + 2 * q[2] * x * z + 2 * q[3] * x +
+		   q[4] * y * y + 2 * q[5] * y * z + 2 * q[6] * y +
+		   q[7] * z * z + 2 * q[8] * z +
+		   q[9];
+}
+
+float MeshSimplifier::DistanceToTriangle(FXMVECTOR p, FXMVECTOR a, FXMVECTOR b, GXMVECTOR c)
+{
+	XMVECTOR ab = b - a;
+	XMVECTOR ac = c - a;
+	XMVECTOR ap = p - a;
+
+	float d1 = XMVectorGetX(XMVector3Dot(ab, ap));
+	float d2 = XMVectorGetX(XMVector3Dot(ac, ap));
+
+	if (d1 <= 0 && d2 <= 0)
+	{
+		return XMVectorGetX(XMVector3Length(ap));
+	}
+
+	XMVECTOR bp = p - b;
+
+	float d3 = XMVectorGetX(XMVector3Dot(ab, bp));
+	float d4 = XMVectorGetX(XMVector3Dot(ac, bp));
+
+	if (d3 >= 0 && d4 <= d3)
+	{
+		return XMVectorGetX(XMVector3Length(bp));
+	}
+
+	float vc = d1 * d4 - d3 * d2;
+
+	if (vc <= 0 && d1 >= 0 && d3 <= 0)
+	{
+		return XMVectorGetX(XMVector3Length(ap - ab * (d1 / (d1 - d3))));
+	}
+
+	XMVECTOR cp = p - c;
+
+	float d5 = XMVectorGetX(XMVector3Dot(ab, cp));
+	float d6 = XMVectorGetX(XMVector3Dot(ac, cp));
+
+	if (d6 >= 0 && d5 <= d6)
+	{
+		return XMVectorGetX(XMVector3Length(cp));
+	}
+
+	float vb = d5 * d2 - d1 * d6;
+
+	if (vb <= 0 && d2 >= 0 && d6 <= 0)
+	{
+		return XMVectorGetX(XMVector3Length(ap - ac * (d2 / (d2 - d6))));
+	}
+
+	float va = d3 * d6 - d5 * d4;
+
+	if (va <= 0 && d4 - d3 >= 0 && d5 - d6 >= 0)
+	{
+		return XMVectorGetX(XMVector3Length(bp - (c - b) * ((d4 - d3) / ((d4 - d3) + (d5 - d6)))));
+	}
+
+	// inside, va + vb + vc is the squared length of ab x ac
+	float denominator = va + vb + vc;
+
+	if (denominator <= 0)
+	{
+		return std::min(XMVectorGetX(XMVector3Length(ap)), std::min(XMVectorGetX(XMVector3Length(bp)), XMVectorGetX(XMVector3Length(cp))));
+	}
+
+	return XMVectorGetX(XMVector3Length(ap - ab * (vb / denominator) - ac * (vc / denominator)));
+}
+
+float MeshSimplifier::Simplify(const GeometryGenerator::Mesh& mesh,
+							   const std::vector<Subset>& subsets,
+							   UINT TargetTriangles,
+							   GeometryGenerator::Mesh& simplified,
+							   std::vector<Subset>& SimplifiedSubsets)
+{
+	typedef GeometryGenerator::Vertex Vertex;
+
+	const UINT VertexCount = static_cast<UINT>(mesh.mVertices.size());
+	const UINT TriangleCount = static_cast<UINT>(mesh.mIndices.size() / 3);
+	const UINT none = static_cast<UINT>(-1);
+
+	std::vector<UINT> indices(mesh.mIndices);
+
+	std::vector<Subset> ranges(subsets);
+
+	if (ranges.empty())
+	{
+		ranges.resize(1);
+		ranges[0].id = 0;
+		ranges[0].VertexCount = VertexCount;
+		ranges[0].FaceCount = TriangleCount;
+	}
+
+	// vertices sharing a position are the wedges of a UV or normal seam, collapses move a position with all
+	// of its wedges so the seam never opens
+	std::vector<UINT> pos(VertexCount);
+	std::vector<XMFLOAT3> positions;
+	std::vector<std::vector<UINT>> wedges;
+
+	{
+		std::vector<UINT> order(VertexCount);
+
+		for (UINT v = 0; v < VertexCount; v++)
+		{
+			order[v] = v;
+		}
+
+		auto less = [&](UINT a, UINT b)
+		{
+			const XMFLOAT3& pa = mesh.mVertices[a].mPosition;
+			const XMFLOAT3& pb = mesh.mVertices[b].mPosition;
+
+			if (pa.x != pb.x) return pa.x < pb.x;
+			if (pa.y != pb.y) return pa.y < pb.y;
+			return pa.z < pb.z;
+		};
+
+		std::sort(order.begin(), order.end(), less);
+
+		for (UINT k = 0; k < VertexCount; k++)
+		{
+			if (k == 0 || less(order[k - 1], order[k]))
+			{
+				positions.push_back(mesh.mVertices[order[k]].mPosition);
+				wedges.emplace_back();
+			}
+
+			pos[order[k]] = static_cast<UINT>(positions.size() - 1);
+			wedges.back().push_back(order[k]);
+		}
+	}
+
+	const UINT PositionCount = static_cast<UINT>(positions.size());
+
+	std::vector<bool> locked(PositionCount, false);
+
+	// a position used by triangles of two subsets sits on a subset boundary
+	{
+		std::vector<UINT> PositionSubset(PositionCount, none);
+
+		for (UINT s = 0; s < ranges.size(); s++)
+		{
+			for (UINT k = ranges[s].FaceStart * 3; k < (ranges[s].FaceStart + ranges[s].FaceCount) * 3; k++)
+			{
+				UINT p = pos[indices[k]];
+
+				if (PositionSubset[p] == none)
+				{
+					PositionSubset[p] = s;
+				}
+				else if (PositionSubset[p] != s)
+				{
+					locked[p] = true;
+				}
+			}
+		}
+	}
+
+	// an edge between two positions used by a single triangle is on the border, seam edges are used twice
+	{
+		std::vector<std::uint64_t> edges;
+		edges.reserve(TriangleCount * 3);
+
+		for (UINT t = 0; t < TriangleCount; t++)
+		{
+			for (UINT c = 0; c < 3; c++)
+			{
+				std::uint64_t a = pos[indices[t * 3 + c]];
+				std::uint64_t b = pos[indices[t * 3 + (c + 1) % 3]];
+
+				edges.push_back(a < b ? (a << 32 | b) : (b << 32 | a));
+			}
+		}
+
+		std::sort(edges.begin(), edges.end());
+
+		for (UINT k = 0; k < edges.size();)
+		{
+			UINT n = 1;
+
+			while (k + n < edges.size() && edges[k + n] == edges[k])
+			{
+				n++;
+			}
+
+			if (n == 1)
+			{
+				locked[static_cast<UINT>(edges[k] >> 32)] = true;
+				locked[static_cast<UINT>(edges[k] & 0xFFFFFFFF)] = true;
+			}
+
+			k += n;
+		}
+	}
+
+	std::vector<std::vector<UINT>> PositionTriangles(PositionCount);
+	std::vector<Quadric> quadrics(PositionCount);
+
+	for (UINT t = 0; t < TriangleCount; t++)
+	{
+		XMVECTOR p0 = XMLoadFloat3(&mesh.mVertices[indices[t * 3 + 0]].mPosition);
+		XMVECTOR p1 = XMLoadFloat3(&mesh.mVertices[indices[t * 3 + 1]].mPosition);
+		XMVECTOR p2 = XMLoadFloat3(&mesh.mVertices[indices[t * 3 + 2]].mPosition);
+
+		XMVECTOR N = XMVector3Cross(p1 - p0, p2 - p0);
+		float area = 0.5f * XMVectorGetX(XMVector3Length(N));
+
+		XMFLOAT3 n;
+		XMStoreFloat3(&n, XMVector3Normalize(N));
+		float d = -XMVectorGetX(XMVector3Dot(XMVector3Normalize(N), p0));
+
+		Quadric plane(n.x, n.y, n.z, d, area);
+
+		for (UINT c = 0; c < 3; c++)
+		{
+			quadrics[pos[indices[t * 3 + c]]] += plane;
+			PositionTriangles[pos[indices[t * 3 + c]]].push_back(t);
+		}
+	}
+
+	struct Collapse
+	{
+		double cost;
+		UINT from;
+		UINT to;
+		UINT FromVersion;
+		UINT ToVersion;
+
+		bool operator>(const Collapse& other) const { return cost > other.cost; }
+	};
+
+	std::priority_queue<Collapse, std::vector<Collapse>, std::greater<Collapse>> heap;
+	std::vector<UINT> version(PositionCount, 0);
+	std::vector<bool> removed(TriangleCount, false);
+	std::vector<bool> collapsed(PositionCount, false);
+
+	// every position of mesh is tracked on a triangle of the simplified surface, the distance to it bounds
+	// the distance to the whole surface from above
+	std::vector<UINT> tracked(PositionCount, none);
+	std::vector<std::vector<UINT>> TrianglePositions(TriangleCount);
+
+	for (UINT p = 0; p < PositionCount; p++)
+	{
+		if (!PositionTriangles[p].empty())
+		{
+			tracked[p] = PositionTriangles[p][0];
+			TrianglePositions[tracked[p]].push_back(p);
+		}
+	}
+
+	auto distance = [&](UINT p, UINT t)
+	{
+		return DistanceToTriangle(XMLoadFloat3(&positions[p]),
+								  XMLoadFloat3(&positions[pos[indices[t * 3 + 0]]]),
+								  XMLoadFloat3(&positions[pos[indices[t * 3 + 1]]]),
+								  XMLoadFloat3(&positions[pos[indices[t * 3 + 2]]]));
+	};
+
+	auto push = [&](UINT from, UINT to)
+	{
+		if (locked[from] || from == to)
+		{
+			return;
+		}
+
+		Quadric q = quadrics[from];
+		q += quadrics[to];
+
+		Collapse collapse;
+		collapse.cost = std::max(q.evaluate(positions[to]), 0.0) / std::max(q.weight, 1e-12);
+		collapse.from = from;
+		collapse.to = to;
+		collapse.FromVersion = version[from];
+		collapse.ToVersion = version[to];
+
+		heap.push(collapse);
+	};
+
+	for (UINT t = 0; t < TriangleCount; t++)
+	{
+		for (UINT c = 0; c < 3; c++)
+		{
+			push(pos[indices[t * 3 + c]], pos[indices[t * 3 + (c + 1) % 3]]);
+			push(pos[indices[t * 3 + (c + 1) % 3]], pos[indices[t * 3 + c]]);
+		}
+	}
+
+	auto HasPosition = [&](UINT t, UINT p)
+	{
+		return pos[indices[t * 3 + 0]] == p || pos[indices[t * 3 + 1]] == p || pos[indices[t * 3 + 2]] == p;
+	};
+
+	auto GetNeighbours = [&](UINT p, std::vector<UINT>& neighbours)
+	{
+		neighbours.clear();
+
+		for (UINT t : PositionTriangles[p])
+		{
+			if (removed[t])
+			{
+				continue;
+			}
+
+			for (UINT c = 0; c < 3; c++)
+			{
+				UINT w = pos[indices[t * 3 + c]];
+
+				if (w != p && std::find(neighbours.begin(), neighbours.end(), w) == neighbours.end())
+				{
+					neighbours.push_back(w);
+				}
+			}
+		}
+	};
+
+	std::vector<UINT> FromNeighbours;
+	std::vector<UINT> ToNeighbours;
+	std::vector<UINT> partner(VertexCount, none);
+	std::vector<UINT> displaced;
+
+	UINT triangles = TriangleCount;
+
+	while (triangles > TargetTriangles && !heap.empty())
+	{
+		Collapse collapse = heap.top();
+		heap.pop();
+
+		const UINT u = collapse.from;
+		const UINT v = collapse.to;
+
+		if (collapsed[u] || collapsed[v] || collapse.FromVersion != version[u] || collapse.ToVersion != version[v])
+		{
+			continue;
+		}
+
+		// the edge must still exist and the collapse must keep the surface manifold:
+		// u and v may only share the positions opposite to their common triangles
+		UINT shared = 0;
+
+		for (UINT t : PositionTriangles[u])
+		{
+			if (!removed[t] && HasPosition(t, v))
+			{
+				shared++;
+			}
+		}
+
+		if (shared == 0)
+		{
+			continue;
+		}
+
+		GetNeighbours(u, FromNeighbours);
+		GetNeighbours(v, ToNeighbours);
+
+		UINT common = 0;
+
+		for (UINT w : FromNeighbours)
+		{
+			if (std::find(ToNeighbours.begin(), ToNeighbours.end(), w) != ToNeighbours.end())
+			{
+				common++;
+			}
+		}
+
+		if (common != shared)
+		{
+			continue;
+		}
+
+		// each wedge of u that shares a triangle with a wedge of v merges into it, two wedges of u
+		// can't merge into the same wedge of v or the seam between them would close
+		bool paired = true;
+		UINT partners = 0;
+
+		for (UINT w : wedges[u])
+		{
+			partner[w] = none;
+		}
+
+		for (UINT t : PositionTriangles[u])
+		{
+			if (removed[t] || !HasPosition(t, v))
+			{
+				continue;
+			}
+
+			UINT a = none;
+			UINT b = none;
+
+			for (UINT c = 0; c < 3; c++)
+			{
+				UINT w = indices[t * 3 + c];
+
+				if (pos[w] == u) a = w;
+				if (pos[w] == v) b = w;
+			}
+
+			if (partner[a] == none)
+			{
+				for (UINT w : wedges[u])
+				{
+					paired = paired && partner[w] != b;
+				}
+
+				partner[a] = b;
+				partners++;
+			}
+			else
+			{
+				paired = paired && partner[a] == b;
+			}
+		}
+
+		// a seam only collapses along itself, so the attributes on both of its sides keep lining up
+		if (!paired || (wedges[u].size() > 1 && partners < 2))
+		{
+			continue;
+		}
+
+		// moving u onto v must not flip or degenerate the triangles that survive
+		bool flipped = false;
+
+		for (UINT t : PositionTriangles[u])
+		{
+			if (removed[t] || HasPosition(t, v))
+			{
+				continue;
+			}
+
+			XMVECTOR p[3];
+			XMVECTOR q[3];
+
+			for (UINT c = 0; c < 3; c++)
+			{
+				UINT w = pos[indices[t * 3 + c]];
+
+				p[c] = XMLoadFloat3(&positions[w]);
+				q[c] = XMLoadFloat3(&positions[w == u ? v : w]);
+			}
+
+			XMVECTOR N0 = XMVector3Cross(p[1] - p[0], p[2] - p[0]);
+			XMVECTOR N1 = XMVector3Cross(q[1] - q[0], q[2] - q[0]);
+
+			if (XMVectorGetX(XMVector3Dot(N0, N1)) <= 0)
+			{
+				flipped = true;
+				break;
+			}
+		}
+
+		if (flipped)
+		{
+			continue;
+		}
+
+		displaced.clear();
+
+		for (UINT t : PositionTriangles[u])
+		{
+			if (removed[t])
+			{
+				continue;
+			}
+
+			displaced.insert(displaced.end(), TrianglePositions[t].begin(), TrianglePositions[t].end());
+			TrianglePositions[t].clear();
+
+			if (HasPosition(t, v))
+			{
+				removed[t] = true;
+				triangles--;
+			}
+			else
+			{
+				for (UINT c = 0; c < 3; c++)
+				{
+					UINT& w = indices[t * 3 + c];
+
+					if (pos[w] == u && partner[w] != none)
+					{
+						w = partner[w];
+					}
+				}
+
+				PositionTriangles[v].push_back(t);
+			}
+		}
+
+		// the wedges of u without a twin at v keep their attributes and move to v's position
+		for (UINT w : wedges[u])
+		{
+			if (partner[w] == none)
+			{
+				pos[w] = v;
+				wedges[v].push_back(w);
+			}
+		}
+
+		wedges[u].clear();
+
+		collapsed[u] = true;
+		quadrics[v] += quadrics[u];
+		version[v]++;
+
+		// the positions tracked on the triangles that changed move to the closest triangle around v
+		for (UINT p : displaced)
+		{
+			float closest = FLT_MAX;
+
+			for (UINT t : PositionTriangles[v])
+			{
+				if (!removed[t])
+				{
+					float d = distance(p, t);
+
+					if (d < closest)
+					{
+						closest = d;
+						tracked[p] = t;
+					}
+				}
+			}
+
+			TrianglePositions[tracked[p]].push_back(p);
+		}
+
+		// only v's quadric changed, the queued edges between other positions keep their costs
+		GetNeighbours(v, ToNeighbours);
+
+		for (UINT w : ToNeighbours)
+		{
+			push(w, v);
+			push(v, w);
+		}
+	}
+
+	float error = 0;
+
+	for (UINT p = 0; p < PositionCount; p++)
+	{
+		if (tracked[p] != none)
+		{
+			error = std::max(error, distance(p, tracked[p]));
+		}
+	}
+
+	// compact, surviving vertices keep their order so subset vertex ranges stay contiguous
+	std::vector<UINT> remap(VertexCount, none);
+	std::vector<bool> used(VertexCount, false);
+
+	for (UINT t = 0; t < TriangleCount; t++)
+	{
+		if (!removed[t])
+		{
+			used[indices[t * 3 + 0]] = used[indices[t * 3 + 1]] = used[indices[t * 3 + 2]] = true;
+		}
+	}
+
+	simplified.mVertices.clear();
+	simplified.mIndices.clear();
+	simplified.mAdjacency = GeometryGenerator::Mesh::Adjacency();
+	simplified.mAABB = mesh.mAABB;
+
+	for (UINT v = 0; v < VertexCount; v++)
+	{
+		if (used[v])
+		{
+			remap[v] = static_cast<UINT>(simplified.mVertices.size());
+			simplified.mVertices.push_back(mesh.mVertices[v]);
+			simplified.mVertices.back().mPosition = positions[pos[v]];
+		}
+	}
+
+	SimplifiedSubsets = subsets;
+
+	for (UINT s = 0; s < ranges.size(); s++)
+	{
+		UINT FaceStart = static_cast<UINT>(simplified.mIndices.size() / 3);
+
+		for (UINT t = ranges[s].FaceStart; t < ranges[s].FaceStart + ranges[s].FaceCount; t++)
+		{
+			if (!removed[t])
+			{
+				simplified.mIndices.push_back(remap[indices[t * 3 + 0]]);
+				simplified.mIndices.push_back(remap[indices[t * 3 + 1]]);
+				simplified.mIndices.push_back(remap[indices[t * 3 + 2]]);
+			}
+		}
+
+		if (!subsets.empty())
+		{
+			Subset& subset = SimplifiedSubsets[s];
+
+			UINT first = static_cast<UINT>(std::count(used.begin(), used.begin() + subset.VertexStart, true));
+			UINT count = static_cast<UINT>(std::count(used.begin() + subset.VertexStart, used.begin() + subset.VertexStart + subset.VertexCount, true));
+
+			subset.VertexStart = first;
+			subset.VertexCount = count;
+			subset.FaceStart = FaceStart;
+			subset.FaceCount = static_cast<UINT>(simplified.mIndices.size() / 3) - FaceStart;
+		}
+	}
+
+	return error;
+}
+
+void GameObject::LoadModel(ID3D11Device* device, TextureManager& manager, const std::string& filename, bool skinned,
+						   MeshOptimizer::CacheStats* before, MeshOptimizer::CacheStats* after)
+{
+	mIsSkinned = skinned;
+	Model3DLoader().load(filename, manager, *this, before, after);
+}
+
+void GameObject::CreateSplitVertexBuffers(ID3D11Device* device,
+										  const std::vector<GeometryGenerator::Vertex>& vertices,
+										  std::array<Microsoft::WRL::ComPtr<ID3D11Buffer>, 3>& buffers)
+{
+	GeometryGenerator::SplitStreams streams;
+	GeometryGenerator::SplitVertexStreams(vertices, streams);
+
+	const void* data[3] = { streams.mPositions.data(), streams.mTexCoords.data(), streams.mNormals.data() };
+	const UINT stride[3] = { sizeof(XMFLOAT3), sizeof(XMFLOAT2), sizeof(XMFLOAT3) };
+
+	for (UINT i = 0; i < 3; ++i)
+	{
+		D3D11_BUFFER_DESC desc;
+		desc.ByteWidth = stride[i] * vertices.size();
+		desc.Usage = D3D11_USAGE_IMMUTABLE;
+		desc.BindFlags = D3D11_BIND_VERTEX_BUFFER;
+		desc.CPUAccessFlags = 0;
+		desc.MiscFlags = 0;
+		desc.StructureByteStride = 0;
+
+		D3D11_SUBRESOURCE_DATA InitData;
+		InitData.pSysMem = data[i];
+		InitData.SysMemPitch = 0;
+		InitData.SysMemSlicePitch = 0;
+
+		HR(device->CreateBuffer(&desc, &InitData, buffers[i].ReleaseAndGetAddressOf()));
+	}
+}
+
+void GameObject::SetSplitVertexBuffers(ID3D11DeviceContext* context, bool IsAlphaClipping, bool normals) const
+{
+	ID3D11Buffer* vbs[3] = { mSplitVertexBuffers[0].Get(), mSplitVertexBuffers[1].Get(), mSplitVertexBuffers[2].Get() };
+	UINT stride[3] = { sizeof(XMFLOAT3), IsAlphaClipping ? sizeof(XMFLOAT2) : 0, sizeof(XMFLOAT3) };
+	UINT offset[3] = { 0, 0, 0 };
+
+	context->IASetVertexBuffers(0, normals ? 3 : 2, vbs, stride, offset);
+}
+
+std::vector<GameObject::LODReport> GameObject::BuildLODs(UINT levels, float ratio)
+{
+	mLODs.clear();
+
+	std::vector<LODReport> reports;
+	std::vector<XMFLOAT3> positions(mMesh.mVertices.size());
+
+	for (UINT i = 0; i < mMesh.mVertices.size(); i++)
+	{
+		positions[i] = mMesh.mVertices[i].mPosition;
+	}
+
+	BoundingSphere::CreateFromPoints(mLODBounds, positions.size(), positions.data(), sizeof(XMFLOAT3));
+
+	const UINT SourceTriangles = static_cast<UINT>(mMesh.mIndices.size() / 3);
+	UINT triangles = SourceTriangles;
+	float target = static_cast<float>(SourceTriangles);
+
+	for (UINT level = 1; level <= levels; level++)
+	{
+		target *= ratio;
+
+		// simplified from mMesh so the error is measured against it
+		LevelOfDetail lod;
+		lod.mError = MeshSimplifier::Simplify(mMesh, mSubsets, static_cast<UINT>(target), lod.mMesh, lod.mSubsets);
+
+		// nothing left to collapse without touching locked vertices
+		if (lod.mMesh.mIndices.size() / 3 >= triangles)
+		{
+			break;
+		}
+
+		triangles = static_cast<UINT>(lod.mMesh.mIndices.size() / 3);
+
+		LODReport report;
+		report.mSourceTriangles = SourceTriangles;
+		report.mSourceVertices = static_cast<UINT>(mMesh.mVertices.size());
+		report.mTriangles = triangles;
+		report.mVertices = static_cast<UINT>(lod.mMesh.mVertices.size());
+		report.mError = lod.mError;
+
+		reports.push_back(report);
+		mLODs.push_back(std::move(lod));
+	}
+
+	return reports;
+}
+
+UINT GameObject::SelectLOD(const CameraObject& camera, float ScreenHeight, float MaxPixelError) const
+{
+	if (mLODs.empty() || mLODBounds.Radius <= 0.0f)
+	{
+		return 0;
+	}
+
+	BoundingSphere bounds;
+	mLODBounds.Transform(bounds, mWorld);
+
+	float scale = bounds.Radius / mLODBounds.Radius;
+
+	float distance = XMVectorGetX(XMVector3Length(XMLoadFloat3(&bounds.Center) - XMLoadFloat3(&camera.mPosition))) - bounds.Radius;
+	distance = std::max(distance, camera.mNearZ);
+
+	float PixelsPerUnit = ScreenHeight / (2.0f * distance * std::tan(0.5f * camera.mFovAngleY));
+
+	UINT level = 0;
+
+	for (UINT k = 1; k <= mLODs.size(); k++)
+	{
+		if (mLODs[k - 1].mError * scale * PixelsPerUnit > MaxPixelError)
+		{
+			break;
+		}
+
+		level = k;
+	}
+
+	return level;
+}
+
+bool GameObjectInstance::SetClip(const std::string& name)
+{
+	ClipName = name;
+	clip = obj->mSkinnedData.FindClip(name);
+	cursors.assign(obj->mSkinnedData.GetBoneCount(), 0);
+
+	XMFLOAT4X4 identity;
+	XMStoreFloat4x4(&identity, XMMatrixIdentity());
+	transforms.assign(obj->mSkinnedData.GetBoneCount(), identity);
+
+	assert(clip != SkinnedObject::InvalidClip);
+
+	return clip != SkinnedObject::InvalidClip;
+}
+
+void GameObjectInstance::update(float dt, SkinnedObject::Scratch& scratch)
+{
+	const SkinnedObject& data = obj->mSkinnedData;
+
+	if (clip == SkinnedObject::InvalidClip)
+	{
+		return;
+	}
+
+	time += dt;
+	data.GetTransforms(clip, time, scratch, transforms.data(), cursors.data());
+
+	if (time > data.GetTimeClipEnd(clip))
+	{
+		time = 0; // loop animation
+	}
+}
+
+UINT CrowdAnimation::AddInstance(const SkinnedObject& data, SkinnedObject::ClipHandle clip, float time)
+{
+	const UINT instance = GetInstanceCount();
+
+	mSkinnedData.push_back(&data);
+	mClips.push_back(clip);
+	mTimes.push_back(time);
+	mPaletteOffsets.push_back(static_cast<UINT>(mPalette.size()));
+
+	mPalette.resize(mPalette.size() + data.GetBoneCount());
+	mCursors.resize(mPalette.size(), 0);
+	mScratches.resize((GetInstanceCount() + ChunkSize - 1) / ChunkSize);
+
+	return instance;
+}
+
+void CrowdAnimation::clear()
+{
+	mSkinnedData.clear();
+	mClips.clear();
+	mTimes.clear();
+	mPaletteOffsets.clear();
+	mPalette.clear();
+	mCursors.clear();
+	mScratches.clear();
+}
+
+void CrowdAnimation::update(float dt)
+{
+	const UINT count = GetInstanceCount();
+	const UINT chunks = static_cast<UINT>(mScratches.size());
+
+	// every instance writes only its own time, cursors and bone transforms
+	auto task = [&](UINT chunk)
+	{
+		for (UINT i = chunk * ChunkSize; i < std::min((chunk + 1) * ChunkSize, count); ++i)
+		{
+			const SkinnedObject& data = *mSkinnedData[i];
+
+			mTimes[i] += dt;
+			data.GetTransforms(mClips[i], mTimes[i], mScratches[chunk], &mPalette[mPaletteOffsets[i]], &mCursors[mPaletteOffsets[i]]);
+
+			if (mTimes[i] > data.GetTimeClipEnd(mClips[i]))
+			{
+				mTimes[i] = 0; // loop animation
+			}
+		}
+	};
+
+	if (mThreadPool)
+	{
+		mThreadPool->ParallelFor(chunks, task);
+	}
+	else
+	{
+		for (UINT chunk = 0; chunk < chunks; chunk++)
+		{
+			task(chunk);
+		}
+	}
+}
+
+TiledHeightMap::TiledHeightMap() :
+	mMaxResidentTiles(64),
+	mThreadPool(nullptr),
+	mFile(nullptr),
+	mMapping(nullptr),
+	mTileRows(0),
+	mTileCols(0),
+	mTileStride(0),
+	mIsCompressed(false),
+	mClock(0)
+{
+	ZeroMemory(&mHeader, sizeof(mHeader));
+}
+
+TiledHeightMap::~TiledHeightMap()
+{
+	Close();
+}
+
+bool TiledHeightMap::ReadRaw(std::istream& is, RawFormat format, float HeightScale, float* heights, size_t count)
+{
+	switch (format)
+	{
+	case RawR8:
+	{
+		std::vector<unsigned char> texels(count);
+		is.read(reinterpret_cast<char*>(texels.data()), std::streamsize(count));
+
+		std::transform(texels.begin(), texels.end(), heights, [HeightScale](unsigned char texel)
+		{
+			return (texel / 255.0f) * HeightScale;
+		});
+		break;
+	}
+
+	case RawR16:
+	{
+		std::vector<unsigned char> texels(2 * count);
+		is.read(reinterpret_cast<char*>(texels.data()), std::streamsize(2 * count));
+
+		for (size_t i = 0; i < count; ++i)
+		{
+			heights[i] = ((texels[2 * i] | (texels[2 * i + 1] << 8)) / 65535.0f) * HeightScale;
+		}
+		break;
+	}
+
+	case RawR32F:
+	{
+		is.read(reinterpret_cast<char*>(heights), std::streamsize(count * sizeof(float)));
+
+		std::transform(heights, heights + count, heights, [HeightScale](float texel)
+		{
+			return texel * HeightScale;
+		});
+		break;
+	}
+
+	default:
+		return false;
+	}
+
+	return static_cast<bool>(is);
+}
+
+bool TiledHeightMap::Convert(const std::wstring& RawFileName,
+							 UINT width,
+							 UINT depth,
+							 float HeightScale,
+							 UINT TileSize,
+							 const std::wstring& TiledFileName,
+							 RawFormat format,
+							 bool IsCompressed)
+{
+	if (width == 0 || depth == 0 || TileSize == 0)
+	{
+		return false;
+	}
+
+	std::ifstream ifs(RawFileName.c_str(), std::ios_base::binary);
+	std::ofstream ofs(TiledFileName.c_str(), std::ios_base::binary);
+
+	if (!ifs || !ofs)
+	{
+		return false;
+	}
+
+	const UINT TileRows = (depth + TileSize - 1) / TileSize;
+	const UINT TileCols = (width + TileSize - 1) / TileSize;
+
+	// one row of tiles of the RAW file at a time
+	std::vector<float> band(TileSize * width);
+	std::vector<float> tile(TileSize * TileSize);
+
+	Header header = { { 'T', 'H', 'M', '1' }, width, depth, TileSize, 0.0f, 0.0f };
+
+	if (IsCompressed)
+	{
+		// first pass for the height range the 16-bit steps span
+		float MinHeight = +FLT_MAX;
+		float MaxHeight = -FLT_MAX;
+
+		for (UINT ti = 0; ti < TileRows; ++ti)
+		{
+			UINT rows = std::min(TileSize, depth - ti * TileSize);
+
+			if (!ReadRaw(ifs, format, HeightScale, band.data(), size_t(rows) * width))
+			{
+				return false;
+			}
+
+			auto range = std::minmax_element(band.begin(), band.begin() + size_t(rows) * width);
+
+			MinHeight = std::min(MinHeight, *range.first);
+			MaxHeight = std::max(MaxHeight, *range.second);
+		}
+
+		ifs.clear();
+		ifs.seekg(0);
+
+		memcpy(header.mMagic, "THC1", 4);
+		header.mMinHeight = MinHeight;
+		header.mHeightStep = MaxHeight > MinHeight ? (MaxHeight - MinHeight) / 65535.0f : 1.0f;
+	}
+
+	const UINT64 TileBytes = UINT64(TileSize) * TileSize * sizeof(float);
+	const UINT64 TileStride = (TileBytes + FileAlignment - 1) / FileAlignment * FileAlignment;
+
+	std::vector<char> padding(FileAlignment, 0);
+	std::vector<UINT64> offsets(TileRows * TileCols + 1, 0);
+
+	ofs.write(reinterpret_cast<const char*>(&header), sizeof(header));
+
+	if (IsCompressed)
+	{
+		// rewritten once the tile sizes are known
+		ofs.write(reinterpret_cast<const char*>(offsets.data()), offsets.size() * sizeof(UINT64));
+	}
+	else
+	{
+		ofs.write(padding.data(), FileAlignment - sizeof(header));
+	}
+
+	std::vector<USHORT> texels(TileSize * TileSize);
+	std::vector<BYTE> bytes;
+
+	for (UINT ti = 0; ti < TileRows; ++ti)
+	{
+		UINT rows = std::min(TileSize, depth - ti * TileSize);
+
+		if (!ReadRaw(ifs, format, HeightScale, band.data(), size_t(rows) * width))
+		{
+			return false;
+		}
+
+		for (UINT tj = 0; tj < TileCols; ++tj)
+		{
+			for (UINT r = 0; r < TileSize; ++r)
+			{
+				UINT row = std::min(r, rows - 1);
+
+				for (UINT c = 0; c < TileSize; ++c)
+				{
+					UINT col = std::min(tj * TileSize + c, width - 1);
+
+					tile[r * TileSize + c] = band[row * width + col];
+				}
+			}
+
+			if (IsCompressed)
+			{
+				for (UINT i = 0; i < TileSize * TileSize; ++i)
+				{
+					float step = std::round((tile[i] - header.mMinHeight) / header.mHeightStep);
+					texels[i] = static_cast<USHORT>(std::max(0.0f, std::min(step, 65535.0f)));
+				}
+
+				EncodeTile(texels.data(), TileSize, bytes);
+
+				offsets[ti * TileCols + tj] = static_cast<UINT64>(ofs.tellp());
+				ofs.write(reinterpret_cast<const char*>(bytes.data()), bytes.size());
+			}
+			else
+			{
+				ofs.write(reinterpret_cast<const char*>(tile.data()), TileBytes);
+				ofs.write(padding.data(), TileStride - TileBytes);
+			}
+		}
+	}
+
+	if (IsCompressed)
+	{
+		offsets.back() = static_cast<UINT64>(ofs.tellp());
+
+		ofs.seekp(sizeof(header));
+		ofs.write(reinterpret_cast<const char*>(offsets.data()), offsets.size() * sizeof(UINT64));
+	}
+
+	return static_cast<bool>(ofs);
+}
+
+bool TiledHeightMap::Open(const std::wstring& FileName)
+{
+	Close();
+
+	mFile = CreateFileW(FileName.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_RANDOM_ACCESS, nullptr);
+
+	if (mFile == INVALID_HANDLE_VALUE)
+	{
+		mFile = nullptr;
+		return false;
+	}
+
+	DWORD read = 0;
+
+	if (!ReadFile(mFile, &mHeader, sizeof(mHeader), &read, nullptr) ||
+		read != sizeof(mHeader) ||
+		(memcmp(mHeader.mMagic, "THM1", 4) != 0 && memcmp(mHeader.mMagic, "THC1", 4) != 0) ||
+		mHeader.mTileSize == 0)
+	{
+		Close();
+		return false;
+	}
+
+	mIsCompressed = memcmp(mHeader.mMagic, "THC1", 4) == 0;
+
+	const UINT64 TileBytes = UINT64(mHeader.mTileSize) * mHeader.mTileSize * sizeof(float);
+
+	mTileStride = (TileBytes + FileAlignment - 1) / FileAlignment * FileAlignment;
+	mTileRows = (mHeader.mDepth + mHeader.mTileSize - 1) / mHeader.mTileSize;
+	mTileCols = (mHeader.mWidth + mHeader.mTileSize - 1) / mHeader.mTileSize;
+
+	if (mIsCompressed)
+	{
+		mTileOffsets.resize(mTileRows * mTileCols + 1);
+
+		const DWORD size = static_cast<DWORD>(mTileOffsets.size() * sizeof(UINT64));
+
+		if (!ReadFile(mFile, mTileOffsets.data(), size, &read, nullptr) || read != size)
+		{
+			Close();
+			return false;
+		}
+
+		// reject truncated files up front, a view past the end of the file cannot be mapped
+		LARGE_INTEGER FileSize;
+
+		if (!GetFileSizeEx(mFile, &FileSize) ||
+			!std::is_sorted(mTileOffsets.begin(), mTileOffsets.end()) ||
+			mTileOffsets.back() > UINT64(FileSize.QuadPart))
+		{
+			Close();
+			return false;
+		}
+	}
+
+	mMapping = CreateFileMappingW(mFile, nullptr, PAGE_READONLY, 0, 0, nullptr);
+
+	if (mMapping == nullptr)
+	{
+		Close();
+		return false;
+	}
+
+	mTiles.resize(mTileRows * mTileCols);
+
+	for (Tile& tile : mTiles)
+	{
+		tile.mView = nullptr;
+		tile.mHeights = nullptr;
+		tile.mLastUse = 0;
+	}
+
+	return true;
+}
+
+void TiledHeightMap::Close()
+{
+	while (!mResidentTiles.empty())
+	{
+		UnmapTile(mResidentTiles.back());
+	}
+
+	mTiles.clear();
+	mTileOffsets.clear();
+
+	if (mMapping != nullptr)
+	{
+		CloseHandle(mMapping);
+		mMapping = nullptr;
+	}
+
+	if (mFile != nullptr)
+	{
+		CloseHandle(mFile);
+		mFile = nullptr;
+	}
+
+	ZeroMemory(&mHeader, sizeof(mHeader));
+	mTileRows = 0;
+	mTileCols = 0;
+	mIsCompressed = false;
+}
+
+void TiledHeightMap::Update(float row, float col, float radius)
+{
+	if (mTiles.empty())
+	{
+		return;
+	}
+
+	const float size = static_cast<float>(mHeader.mTileSize);
+
+	auto GetTileRange = [size](float center, float radius, UINT count, UINT& first, UINT& last)
+	{
+		float lo = std::floor((center - radius) / size);
+		float hi = std::floor((center + radius) / size);
+
+		first = static_cast<UINT>(std::max(0.0f, std::min(lo, count - 1.0f)));
+		last = static_cast<UINT>(std::max(0.0f, std::min(hi, count - 1.0f)));
+	};
+
+	UINT ti0, ti1, tj0, tj1;
+	GetTileRange(row, radius, mTileRows, ti0, ti1);
+	GetTileRange(col, radius, mTileCols, tj0, tj1);
+
+	if (mIsCompressed && mThreadPool)
+	{
+		std::vector<UINT> missing;
+
+		for (UINT ti = ti0; ti <= ti1; ++ti)
+		{
+			for (UINT tj = tj0; tj <= tj1; ++tj)
+			{
+				if (mTiles[ti * mTileCols + tj].mHeights == nullptr)
+				{
+					missing.push_back(ti * mTileCols + tj);
+				}
+			}
+		}
+
+		// tiles decode independently, only making them resident below is serial
+		std::vector<std::vector<float>> decoded(missing.size());
+
+		mThreadPool->ParallelFor(static_cast<UINT>(missing.size()), [&](UINT k)
+		{
+			DecodeTile(missing[k], decoded[k]);
+		});
+
+		for (size_t k = 0; k < missing.size(); ++k)
+		{
+			Tile& tile = mTiles[missing[k]];
+
+			if (!decoded[k].empty())
+			{
+				tile.mDecoded = std::move(decoded[k]);
+				tile.mHeights = tile.mDecoded.data();
+
+				mResidentTiles.push_back(missing[k]);
+			}
+		}
+	}
+
+	for (UINT ti = ti0; ti <= ti1; ++ti)
+	{
+		for (UINT tj = tj0; tj <= tj1; ++tj)
+		{
+			GetTile(ti, tj);
+		}
+	}
+}
+
+const float* TiledHeightMap::GetTile(UINT ti, UINT tj)
+{
+	UINT index = ti * mTileCols + tj;
+	Tile& tile = mTiles[index];
+
+	if (tile.mHeights == nullptr)
+	{
+		if (mIsCompressed)
+		{
+			if (!DecodeTile(index, tile.mDecoded))
+			{
+				return nullptr;
+			}
+
+			tile.mHeights = tile.mDecoded.data();
+		}
+		else
+		{
+			const UINT64 offset = FileAlignment + index * mTileStride;
+			const SIZE_T size = SIZE_T(mHeader.mTileSize) * mHeader.mTileSize * sizeof(float);
+
+			tile.mView = MapViewOfFile(mMapping, FILE_MAP_READ, DWORD(offset >> 32), DWORD(offset & 0xFFFFFFFF), size);
+
+			if (tile.mView == nullptr)
+			{
+				return nullptr;
+			}
+
+			tile.mHeights = static_cast<const float*>(tile.mView);
+		}
+
+		mResidentTiles.push_back(index);
+	}
+
+	tile.mLastUse = ++mClock;
+
+	// the tile just used has the newest stamp and is never the one evicted
+	while (mResidentTiles.size() > std::max(mMaxResidentTiles, 1u))
+	{
+		UINT oldest = mResidentTiles[0];
+
+		for (UINT i : mResidentTiles)
+		{
+			if (mTiles[i].mLastUse < mTiles[oldest].mLastUse)
+			{
+				oldest = i;
+			}
+		}
+
+		UnmapTile(oldest);
+	}
+
+	return tile.mHeights;
+}
+
+float TiledHeightMap::GetHeight(int row, int col)
+{
+	if (mTiles.empty())
+	{
+		return 0.0f;
+	}
+
+	row = std::max(0, std::min(row, static_cast<int>(mHeader.mDepth) - 1));
+	col = std::max(0, std::min(col, static_cast<int>(mHeader.mWidth) - 1));
+
+	const UINT size = mHeader.mTileSize;
+	const float* tile = GetTile(row / size, col / size);
+
+	return tile != nullptr ? tile[(row % size) * size + (col % size)] : 0.0f;
+}
+
+USHORT TiledHeightMap::Predict(const USHORT* texels, UINT size, UINT r, UINT c)
+{
+	if (r == 0)
+	{
+		return c > 0 ? texels[c - 1] : 0;
+	}
+
+	if (c == 0)
+	{
+		return texels[(r - 1) * size];
+	}
+
+	// median edge detector (LOCO-I), picks a neighbour across edges and the plane fit elsewhere
+	const int a = texels[r * size + c - 1];
+	const int b = texels[(r - 1) * size + c];
+	const int d = texels[(r - 1) * size + c - 1];
+
+	if (d >= std::max(a, b))
+	{
+		return static_cast<USHORT>(std::min(a, b));
+	}
+
+	if (d <= std::min(a, b))
+	{
+		return static_cast<USHORT>(std::max(a, b));
+	}
+
+	return static_cast<USHORT>(a + b - d);
+}
+
+void TiledHeightMap::EncodeTile(const USHORT* texels, UINT size, std::vector<BYTE>& bytes)
+{
+	bytes.clear();
+
+	UINT64 bits = 0;
+	UINT count = 0;
+
+	// LSB first, n <= 32
+	auto write = [&](UINT value, UINT n)
+	{
+		bits |= UINT64(value) << count;
+		count += n;
+
+		while (count >= 8)
+		{
+			bytes.push_back(static_cast<BYTE>(bits));
+			bits >>= 8;
+			count -= 8;
+		}
+	};
+
+	std::vector<UINT> residuals(size);
+
+	for (UINT r = 0; r < size; ++r)
+	{
+		for (UINT c = 0; c < size; ++c)
+		{
+			int e = int(texels[r * size + c]) - int(Predict(texels, size, r, c));
+
+			// zigzag, small magnitudes of either sign get small codes
+			residuals[c] = (UINT(e) << 1) ^ UINT(e >> 31);
+		}
+
+		// the k with the fewest bits for this row
+		UINT k = 0;
+		UINT64 BestBits = UINT64(-1);
+
+		for (UINT n = 0; n < 16; ++n)
+		{
+			UINT64 total = 0;
+
+			for (UINT z : residuals)
+			{
+				total += (z >> n) < EscapeQuotient ? (z >> n) + 1 + n : EscapeQuotient + 17;
+			}
+
+			if (total < BestBits)
+			{
+				BestBits = total;
+				k = n;
+			}
+		}
+
+		write(k, 4);
+
+		for (UINT z : residuals)
+		{
+			UINT q = z >> k;
+
+			if (q < EscapeQuotient)
+			{
+				write((1u << q) - 1, q + 1); // q ones and a zero
+				write(z & ((1u << k) - 1), k);
+			}
+			else
+			{
+				write((1u << EscapeQuotient) - 1, EscapeQuotient);
+				write(z, 17);
+			}
+		}
+	}
+
+	if (count > 0)
+	{
+		bytes.push_back(static_cast<BYTE>(bits));
+	}
+}
+
+bool TiledHeightMap::DecodeTile(const BYTE* bytes, size_t count, UINT size, USHORT* texels)
+{
+	UINT64 bits = 0;
+	UINT available = 0;
+	size_t position = 0;
+
+	auto read = [&](UINT n)
+	{
+		while (available < n)
+		{
+			bits |= UINT64(position < count ? bytes[position] : 0) << available;
+			++position;
+			available += 8;
+		}
+
+		UINT value = static_cast<UINT>(bits & ((UINT64(1) << n) - 1));
+		bits >>= n;
+		available -= n;
+
+		return value;
+	};
+
+	for (UINT r = 0; r < size; ++r)
+	{
+		const UINT k = read(4);
+
+		for (UINT c = 0; c < size; ++c)
+		{
+			UINT q = 0;
+
+			while (q < EscapeQuotient && read(1))
+			{
+				++q;
+			}
+
+			UINT z = q < EscapeQuotient ? (q << k) | read(k) : read(17);
+			int e = int(z >> 1) ^ -int(z & 1);
+
+			texels[r * size + c] = static_cast<USHORT>(Predict(texels, size, r, c) + e);
+		}
+	}
+
+	// reading past the end means the tile is truncated
+	return position <= count;
+}
+
+bool TiledHeightMap::DecodeTile(UINT index, std::vector<float>& heights) const
+{
+	const UINT64 first = mTileOffsets[index];
+	const UINT64 last = mTileOffsets[index + 1];
+
+	// views must start at a multiple of the allocation granularity
+	const UINT64 offset = first / FileAlignment * FileAlignment;
+
+	const void* view = MapViewOfFile(mMapping, FILE_MAP_READ, DWORD(offset >> 32), DWORD(offset & 0xFFFFFFFF), SIZE_T(last - offset));
+
+	if (view == nullptr)
+	{
+		return false;
+	}
+
+	const UINT size = mHeader.mTileSize;
+
+	std::vector<USHORT> texels(size * size);
+
+	bool IsDecoded = DecodeTile(static_cast<const BYTE*>(view) + (first - offset), SIZE_T(last - first), size, texels.data());
+
+	UnmapViewOfFile(view);
+
+	if (!IsDecoded)
+	{
+		return false;
+	}
+
+	heights.resize(size * size);
+
+	for (UINT i = 0; i < size * size; ++i)
+	{
+		heights[i] = mHeader.mMinHeight + texels[i] * mHeader.mHeightStep;
+	}
+
+	return true;
+}
+
+void TiledHeightMap::UnmapTile(UINT index)
+{
+	Tile& tile = mTiles[index];
+
+	if (tile.mView != nullptr)
+	{
+		UnmapViewOfFile(tile.mView);
+		tile.mView = nullptr;
+	}
+
+	// release the memory, not just the size
+	std::vector<float>().swap(tile.mDecoded);
+	tile.mHeights = nullptr;
+
+	mResidentTiles.erase(std::find(mResidentTiles.begin(), mResidentTiles.end(), index));
+}
+
+TerrainObject::TerrainObject() :
+	mVertexShader(nullptr),
+	mInputLayout(nullptr),
+	mHullShader(nullptr),
+	mDomainShader(nullptr),
+	mPixelShader(nullptr),
+	mPatchQuadVB(nullptr),
+	mPatchQuadIB(nullptr),
+	mVisiblePatchQuadIB(nullptr),
+	mHeightMapTexture(nullptr),
+	mHeightMapSRV(nullptr),
+	mHeightMapSS(nullptr),
+	mLayerMapArraySRV(nullptr),
+	mBlendMapSRV(nullptr),
+	mNormalMapTexture(nullptr),
+	mNormalMapSRV(nullptr),
+	mBlendMapTexture(nullptr),
+	mPatchQuadVertices(0),
+	mPatchQuadFaces(0),
+	mVisiblePatchQuadFaces(0),
+	mPatchQuadRows(0),
+	mPatchQuadCols(0),
+	mThreadPool(nullptr),
+	mWorld(XMMatrixIdentity())
+{
+	mMaterial.mAmbient  = XMFLOAT4(1.0f, 1.0f, 1.0f, 1.0f);
+	mMaterial.mDiffuse  = XMFLOAT4(1.0f, 1.0f, 1.0f, 1.0f);
+	mMaterial.mSpecular = XMFLOAT4(0.0f, 0.0f, 0.0f, 64.0f);
+	mMaterial.mReflect  = XMFLOAT4(0.0f, 0.0f, 0.0f, 1.0f);
+}
+
+TerrainObject::~TerrainObject()
+{
+	SafeRelease(mVertexShader);
+	SafeRelease(mInputLayout);
+	SafeRelease(mHullShader);
+	SafeRelease(mDomainShader);
+	SafeRelease(mPixelShader);
+
+	SafeRelease(mPatchQuadVB);
+	SafeRelease(mPatchQuadIB);
+	SafeRelease(mVisiblePatchQuadIB);
+
+	SafeRelease(mHeightMapTexture);
+	SafeRelease(mHeightMapSRV);
+	SafeRelease(mHeightMapSS);
+
+	SafeRelease(mNormalMapTexture);
+	SafeRelease(mNormalMapSRV);
+
+	// the blend map SRV belongs to the texture manager unless it was baked
+	if (mBlendMapTexture)
+	{
+		SafeRelease(mBlendMapSRV);
+		SafeRelease(mBlendMapTexture);
+	}
+}
+
+float TerrainObject::GetWidth() const
+{
+	// total terrain width
+	return (mInitInfo.HeightMapWidth - 1) * mInitInfo.CellSpacing;
+}
+
+float TerrainObject::GetDepth() const
+{
+	// total terrain depth
+	return (mInitInfo.HeightMapDepth - 1) * mInitInfo.CellSpacing;
+}
+
+float TerrainObject::GetHeight(float x, float z) const
+{
+	// transform from terrain local space to "cell" space
+	float w = (x + 0.5f * GetWidth()) / +mInitInfo.CellSpacing;
+	float d = (z - 0.5f * GetDepth()) / -mInitInfo.CellSpacing;
+
+	// clamp to the terrain, the last row/column is reached with s/t = 1 in the last cell
+	w = std::min(std::max(w, 0.0f), mInitInfo.HeightMapWidth - 1.0f);
+	d = std::min(std::max(d, 0.0f), mInitInfo.HeightMapDepth - 1.0f);
+
+	// get the row and column we are in
+	int row = std::min(static_cast<int>(std::floor(d)), static_cast<int>(mInitInfo.HeightMapDepth) - 2);
+	int col = std::min(static_cast<int>(std::floor(w)), static_cast<int>(mInitInfo.HeightMapWidth) - 2);
+
+	// grab the heights of the cell we are in
+	//  A--B
+	//  | /|
+	//  |/ |
+	//  C--D
+	float A = GetTexel(row + 0, col + 0);
+	float B = GetTexel(row + 0, col + 1);
+	float C = GetTexel(row + 1, col + 0);
+	float D = GetTexel(row + 1, col + 1);
+
+	// get the coordinates relative to the cell
+	float s = w - (float)col;
+	float t = d - (float)row;
+
+	if (s + t <= 1.0f) // upper triangle ABC
+	{
+		float uy = B - A;
+		float vy = C - A;
+		return A + s * uy + t * vy;
+	}
+	else // lower triangle DCB
+	{
+		float uy = C - D;
+		float vy = B - D;
+		return D + (1.0f - s) * uy + (1.0f - t) * vy;
+	}
+}
+
+void TerrainObject::GetHeights(const float* xs, const float* zs, float* out, size_t n, XMFLOAT3* normals) const
+{
+	// GetHeight on 4 queries at a time, same operations in the same order so the results match exactly
+	const XMVECTOR HalfWidth = XMVectorReplicate(0.5f * GetWidth());
+	const XMVECTOR HalfDepth = XMVectorReplicate(0.5f * GetDepth());
+	const XMVECTOR PosSpacing = XMVectorReplicate(+mInitInfo.CellSpacing);
+	const XMVECTOR NegSpacing = XMVectorReplicate(-mInitInfo.CellSpacing);
+	const XMVECTOR MaxCol = XMVectorReplicate(mInitInfo.HeightMapWidth - 1.0f);
+	const XMVECTOR MaxRow = XMVectorReplicate(mInitInfo.HeightMapDepth - 1.0f);
+	const XMVECTOR LastCol = XMVectorReplicate(mInitInfo.HeightMapWidth - 2.0f);
+	const XMVECTOR LastRow = XMVectorReplicate(mInitInfo.HeightMapDepth - 2.0f);
+	const XMVECTOR zero = XMVectorZero();
+	const XMVECTOR one = XMVectorReplicate(1.0f);
+
+	for (size_t first = 0; first < n; first += 4)
+	{
+		const size_t count = std::min<size_t>(4, n - first);
+
+		// the last partial group runs on padded copies
+		XMFLOAT4 x(0, 0, 0, 0);
+		XMFLOAT4 z(0, 0, 0, 0);
+
+		std::copy(xs + first, xs + first + count, &x.x);
+		std::copy(zs + first, zs + first + count, &z.x);
+
+		XMVECTOR w = XMVectorDivide(XMLoadFloat4(&x) + HalfWidth, PosSpacing);
+		XMVECTOR d = XMVectorDivide(XMLoadFloat4(&z) - HalfDepth, NegSpacing);
+
+		w = XMVectorMin(XMVectorMax(w, zero), MaxCol);
+		d = XMVectorMin(XMVectorMax(d, zero), MaxRow);
+
+		XMVECTOR row = XMVectorMin(XMVectorFloor(d), LastRow);
+		XMVECTOR col = XMVectorMin(XMVectorFloor(w), LastCol);
+
+		// gather the cell corners
+		XMFLOAT4 rows, cols;
+		XMStoreFloat4(&rows, row);
+		XMStoreFloat4(&cols, col);
+
+		XMFLOAT4 A, B, C, D;
+
+		for (UINT k = 0; k < 4; ++k)
+		{
+			int i = static_cast<int>((&rows.x)[k]);
+			int j = static_cast<int>((&cols.x)[k]);
+
+			(&A.x)[k] = GetTexel(i + 0, j + 0);
+			(&B.x)[k] = GetTexel(i + 0, j + 1);
+			(&C.x)[k] = GetTexel(i + 1, j + 0);
+			(&D.x)[k] = GetTexel(i + 1, j + 1);
+		}
+
+		XMVECTOR VA = XMLoadFloat4(&A);
+		XMVECTOR VB = XMLoadFloat4(&B);
+		XMVECTOR VC = XMLoadFloat4(&C);
+		XMVECTOR VD = XMLoadFloat4(&D);
+
+		XMVECTOR s = w - col;
+		XMVECTOR t = d - row;
+
+		// both triangles, then pick per lane
+		XMVECTOR UpperU = VB - VA;
+		XMVECTOR UpperV = VC - VA;
+		XMVECTOR LowerU = VC - VD;
+		XMVECTOR LowerV = VB - VD;
+
+		XMVECTOR upper = VA + s * UpperU + t * UpperV;
+		XMVECTOR lower = VD + (one - s) * LowerU + (one - t) * LowerV;
+
+		XMVECTOR IsUpper = XMVectorLessOrEqual(s + t, one);
+
+		XMFLOAT4 heights;
+		XMStoreFloat4(&heights, XMVectorSelect(lower, upper, IsUpper));
+
+		std::copy(&heights.x, &heights.x + count, out + first);
+
+		if (normals)
+		{
+			// upper (-uy, spacing, vy), lower (uy, spacing, -vy), rows grow towards -z
+			XMVECTOR nx = XMVectorSelect(LowerU, -UpperU, IsUpper);
+			XMVECTOR ny = PosSpacing;
+			XMVECTOR nz = XMVectorSelect(-LowerV, UpperV, IsUpper);
+
+			XMVECTOR length = XMVectorSqrt(nx * nx + ny * ny + nz * nz);
+
+			XMFLOAT4 NX, NY, NZ;
+			XMStoreFloat4(&NX, nx / length);
+			XMStoreFloat4(&NY, ny / length);
+			XMStoreFloat4(&NZ, nz / length);
+
+			for (size_t k = 0; k < count; ++k)
+			{
+				normals[first + k] = XMFLOAT3((&NX.x)[k], (&NY.x)[k], (&NZ.x)[k]);
+			}
+		}
+	}
+}
+
+float TerrainObject::GetTexel(int i, int j) const
+{
+	if (mTiledHeightMap)
+	{
+		return mTiledHeightMap->GetHeight(i, j);
+	}
+
+	return mHeightMap[i * mInitInfo.HeightMapWidth + j];
+}
+
+bool TerrainObject::Raycast(FXMVECTOR origin, FXMVECTOR dir, float MaxT, float& t) const
+{
+	// the collision tests want a unit direction, distances are scaled back to t at the end
+	const float length = XMVectorGetX(XMVector3Length(dir));
+
+	if (length <= 0.0f || MaxT < 0.0f)
+	{
+		return false;
+	}
+
+	const XMVECTOR unit = dir / length;
+	float dist = MaxT * length;
+
+	bool IsHit = mTiledHeightMap ? MarchCells(origin, unit, dist) : TraverseMinMaxPyramid(origin, unit, dist);
+
+	if (IsHit)
+	{
+		t = dist / length;
+	}
+
+	return IsHit;
+}
+
+void TerrainObject::Raycast(const XMFLOAT3* origins, const XMFLOAT3* dirs, float MaxT, float* t, size_t n) const
+{
+	const UINT RaysPerBlock = 64;
+	const UINT blocks = static_cast<UINT>((n + RaysPerBlock - 1) / RaysPerBlock);
+
+	auto task = [&](UINT block)
+	{
+		const size_t last = std::min(n, size_t(block + 1) * RaysPerBlock);
+
+		for (size_t k = size_t(block) * RaysPerBlock; k < last; ++k)
+		{
+			float hit;
+			t[k] = Raycast(XMLoadFloat3(&origins[k]), XMLoadFloat3(&dirs[k]), MaxT, hit) ? hit : FLT_MAX;
+		}
+	};
+
+	// tiles are paged in on demand while marching, which is not thread safe
+	if (mThreadPool && !mTiledHeightMap)
+	{
+		mThreadPool->ParallelFor(blocks, task);
+	}
+	else
+	{
+		for (UINT block = 0; block < blocks; ++block)
+		{
+			task(block);
+		}
+	}
+}
+
+bool TerrainObject::IntersectCell(FXMVECTOR origin, FXMVECTOR dir, UINT row, UINT col, float& dist) const
+{
+	const float spacing = mInitInfo.CellSpacing;
+	const float x = col * spacing - 0.5f * GetWidth();
+	const float z = 0.5f * GetDepth() - row * spacing;
+
+	// same split as GetHeight
+	//  A--B
+	//  | /|
+	//  |/ |
+	//  C--D
+	XMVECTOR A = XMVectorSet(x,           GetTexel(row + 0, col + 0), z,           0.0f);
+	XMVECTOR B = XMVectorSet(x + spacing, GetTexel(row + 0, col + 1), z,           0.0f);
+	XMVECTOR C = XMVectorSet(x,           GetTexel(row + 1, col + 0), z - spacing, 0.0f);
+	XMVECTOR D = XMVectorSet(x + spacing, GetTexel(row + 1, col + 1), z - spacing, 0.0f);
+
+	// the tests write 0 on a miss
+	float upper, lower;
+
+	if (!TriangleTests::Intersects(origin, dir, A, B, C, upper))
+	{
+		upper = FLT_MAX;
+	}
+
+	if (!TriangleTests::Intersects(origin, dir, D, C, B, lower))
+	{
+		lower = FLT_MAX;
+	}
+
+	if (std::min(upper, lower) > dist)
+	{
+		return false;
+	}
+
+	dist = std::min(upper, lower);
+
+	return true;
+}
+
+bool TerrainObject::TraverseMinMaxPyramid(FXMVECTOR origin, FXMVECTOR dir, float& dist) const
+{
+	if (mMinMaxPyramid.empty())
+	{
+		return false;
+	}
+
+	const float spacing = mInitInfo.CellSpacing;
+	const float HalfWidth = 0.5f * GetWidth();
+	const float HalfDepth = 0.5f * GetDepth();
+
+	// a little slack so that rays grazing a node's side or a flat node are not lost
+	const float epsilon = 1e-3f * spacing;
+
+	auto IntersectNode = [&](UINT level, UINT i, UINT j, float& NodeDist)
+	{
+		const XMFLOAT2 bounds = GetMinMax(level, i, j);
+
+		const UINT r0 = i << level;
+		const UINT c0 = j << level;
+		const UINT r1 = std::min((i + 1) << level, mMinMaxPyramid[0].mRows);
+		const UINT c1 = std::min((j + 1) << level, mMinMaxPyramid[0].mCols);
+
+		XMVECTOR MinCorner = XMVectorSet(c0 * spacing - HalfWidth - epsilon, bounds.x - epsilon, HalfDepth - r1 * spacing - epsilon, 0.0f);
+		XMVECTOR MaxCorner = XMVectorSet(c1 * spacing - HalfWidth + epsilon, bounds.y + epsilon, HalfDepth - r0 * spacing + epsilon, 0.0f);
+
+		BoundingBox box;
+		BoundingBox::CreateFromPoints(box, MinCorner, MaxCorner);
+
+		return box.Intersects(origin, dir, NodeDist) && NodeDist <= dist;
+	};
+
+	struct Node
+	{
+		UINT level;
+		UINT i;
+		UINT j;
+		float dist;
+	};
+
+	// children are pushed farthest first, at most 3 siblings per level wait on the stack
+	Node stack[3 * 32 + 1];
+	UINT size = 0;
+
+	const UINT root = GetMinMaxLevels() - 1;
+	float RootDist;
+
+	if (!IntersectNode(root, 0, 0, RootDist))
+	{
+		return false;
+	}
+
+	stack[size++] = { root, 0, 0, RootDist };
+
+	bool IsHit = false;
+
+	while (size > 0)
+	{
+		const Node node = stack[--size];
+
+		// a closer hit was found after the node was pushed
+		if (node.dist > dist)
+		{
+			continue;
+		}
+
+		if (node.level == 0)
+		{
+			IsHit |= IntersectCell(origin, dir, node.i, node.j, dist);
+			continue;
+		}
+
+		const MinMaxLevel& child = mMinMaxPyramid[node.level - 1];
+
+		Node children[4];
+		UINT count = 0;
+
+		for (UINT m = 2 * node.i; m < std::min(2 * node.i + 2, child.mRows); ++m)
+		{
+			for (UINT n = 2 * node.j; n < std::min(2 * node.j + 2, child.mCols); ++n)
+			{
+				float ChildDist;
+
+				if (IntersectNode(node.level - 1, m, n, ChildDist))
+				{
+					children[count++] = { node.level - 1, m, n, ChildDist };
+				}
+			}
+		}
+
+		// children don't overlap in xz, so visiting them by entry distance visits the cells front to back
+		std::sort(children, children + count, [](const Node& a, const Node& b) { return a.dist > b.dist; });
+
+		for (UINT k = 0; k < count; ++k)
+		{
+			stack[size++] = children[k];
+		}
+	}
+
+	return IsHit;
+}
+
+bool TerrainObject::MarchCells(FXMVECTOR origin, FXMVECTOR dir, float& dist) const
+{
+	// streaming mode has no pyramid, walk the cells under the ray front to back instead (2D DDA)
+	XMFLOAT3 o, r;
+	XMStoreFloat3(&o, origin);
+	XMStoreFloat3(&r, dir);
+
+	// same transform as GetHeight, from terrain local space to "cell" space
+	const float ow = (o.x + 0.5f * GetWidth()) / +mInitInfo.CellSpacing;
+	const float od = (o.z - 0.5f * GetDepth()) / -mInitInfo.CellSpacing;
+	const float dw = r.x / +mInitInfo.CellSpacing;
+	const float dd = r.z / -mInitInfo.CellSpacing;
+
+	const int LastCol = static_cast<int>(mInitInfo.HeightMapWidth) - 2;
+	const int LastRow = static_cast<int>(mInitInfo.HeightMapDepth) - 2;
+
+	if (LastCol < 0 || LastRow < 0)
+	{
+		return false;
+	}
+
+	// clip the ray to the terrain
+	float t0 = 0.0f;
+	float t1 = dist;
+
+	auto clip = [&](float o, float d, float hi)
+	{
+		if (d == 0.0f)
+		{
+			return o >= 0.0f && o <= hi;
+		}
+
+		float a = (0.0f - o) / d;
+		float b = (hi - o) / d;
+
+		t0 = std::max(t0, std::min(a, b));
+		t1 = std::min(t1, std::max(a, b));
+
+		return t0 <= t1;
+	};
+
+	if (!clip(ow, dw, LastCol + 1.0f) || !clip(od, dd, LastRow + 1.0f))
+	{
+		return false;
+	}
+
+	int col = std::max(0, std::min(static_cast<int>(std::floor(ow + t0 * dw)), LastCol));
+	int row = std::max(0, std::min(static_cast<int>(std::floor(od + t0 * dd)), LastRow));
+
+	const int StepCol = dw > 0.0f ? +1 : -1;
+	const int StepRow = dd > 0.0f ? +1 : -1;
+
+	// distance to the next column/row boundary and between two of them
+	const float DeltaW = dw != 0.0f ? std::abs(1.0f / dw) : FLT_MAX;
+	const float DeltaD = dd != 0.0f ? std::abs(1.0f / dd) : FLT_MAX;
+
+	float NextW = dw != 0.0f ? (col + (dw > 0.0f ? 1 : 0) - ow) / dw : FLT_MAX;
+	float NextD = dd != 0.0f ? (row + (dd > 0.0f ? 1 : 0) - od) / dd : FLT_MAX;
+
+	while (true)
+	{
+		// a hit inside a cell is closer than anything in the cells after it
+		if (IntersectCell(origin, dir, row, col, dist))
+		{
+			return true;
+		}
+
+		if (NextW < NextD)
+		{
+			col += StepCol;
+
+			if (col < 0 || col > LastCol || NextW > t1)
+			{
+				return false;
+			}
+
+			NextW += DeltaW;
+		}
+		else
+		{
+			row += StepRow;
+
+			if (row < 0 || row > LastRow || NextD > t1)
+			{
+				return false;
+			}
+
+			NextD += DeltaD;
+		}
+	}
+}
+
+void TerrainObject::UpdateStreaming(const CameraObject& camera)
+{
+	if (!mTiledHeightMap)
+	{
+		return;
+	}
+
+	// same transform as GetHeight, from terrain local space to texels
+	float col = (camera.mPosition.x + 0.5f * GetWidth()) / +mInitInfo.CellSpacing;
+	float row = (camera.mPosition.z - 0.5f * GetDepth()) / -mInitInfo.CellSpacing;
+
+	mTiledHeightMap->Update(row, col, mInitInfo.StreamingRadius / mInitInfo.CellSpacing);
+}
+
+bool TerrainObject::init(ID3D11Device* device, ID3D11DeviceContext* context, TextureManager& manager, const InitInfo& info)
+{
+	mInitInfo = info;
+
+	if (!mInitInfo.TiledHeightMapFileName.empty())
+	{
+		mTiledHeightMap = std::make_unique<TiledHeightMap>();
+		mTiledHeightMap->mMaxResidentTiles = mInitInfo.MaxResidentTiles;
+		mTiledHeightMap->mThreadPool = mThreadPool;
+
+		// HeightMapWidth/Depth are unset in streaming mode, there is nothing to fall back to
+		if (!mTiledHeightMap->Open(manager.mTextureFolder + mInitInfo.TiledHeightMapFileName))
+		{
+			std::wcout << L"can't open tiled heightmap " << mInitInfo.TiledHeightMapFileName << std::endl;
+			mTiledHeightMap.reset();
+			return false;
+		}
+
+		mInitInfo.HeightMapWidth = mTiledHeightMap->GetWidth();
+		mInitInfo.HeightMapDepth = mTiledHeightMap->GetDepth();
+	}
+
+	// at least one cell, the patch counts below wrap around otherwise
+	if (mInitInfo.HeightMapWidth < 2 || mInitInfo.HeightMapDepth < 2)
+	{
+		std::cout << "heightmap of " << mInitInfo.HeightMapWidth << " x " << mInitInfo.HeightMapDepth << " texels" << std::endl;
+		return false;
+	}
+
+	// divide heightmap into patches such that each patch has CellsPerPatch cells
+	mPatchQuadRows = ((mInitInfo.HeightMapDepth - 1) / CellsPerPatch) + 1;
+	mPatchQuadCols = ((mInitInfo.HeightMapWidth - 1) / CellsPerPatch) + 1;
+
+	mPatchQuadVertices = mPatchQuadRows * mPatchQuadCols;
+	mPatchQuadFaces = (mPatchQuadRows - 1) * (mPatchQuadCols - 1);
+
+	if (mTiledHeightMap)
+	{
+		ComputeStreamedPatchBoundsY();
+	}
+	else
+	{
+		if (mInitInfo.HeightMapFileName.empty())
+		{
+			GenerateHeightMap();
+		}
+		else
+		{
+			LoadHeightMap(manager);
+			SmoothHeightMap();
+		}
+
+		BuildMinMaxPyramid();
+	}
+
+	BuildPatchPyramid();
+
+	// build quad patch vertex buffer
+	{
+		// kept for UploadDeformation
+		std::vector<VertexData>& vertices = mPatchQuadVertexData;
+		vertices.resize(mPatchQuadRows * mPatchQuadCols);
+
+		float HalfWidth = 0.5f * GetWidth();
+		float HalfDepth = 0.5f * GetDepth();
+
+		float PatchWidth = GetWidth() / (mPatchQuadCols - 1);
+		float PatchDepth = GetDepth() / (mPatchQuadRows - 1);
+		float du = 1.0f / (mPatchQuadCols - 1);
+		float dv = 1.0f / (mPatchQuadRows - 1);
+
+		for (UINT i = 0; i < mPatchQuadRows; ++i)
+		{
+			float z = +HalfDepth - i * PatchDepth;
+
+			for (UINT j = 0; j < mPatchQuadCols; ++j)
+			{
+				float x = -HalfWidth + j * PatchWidth;
+
+				vertices[i * mPatchQuadCols + j].position = XMFLOAT3(x, 0, z);
+
+				// stretch texture over grid
+				vertices[i * mPatchQuadCols + j].TexCoord.x = j * du;
+				vertices[i * mPatchQuadCols + j].TexCoord.y = i * dv;
+			}
+		}
+
+		// store axis-aligned bounding box y-bounds in upper-left patch corner
+		for (UINT i = 0; i < mPatchQuadRows - 1; ++i)
+		{
+			for (UINT j = 0; j < mPatchQuadCols - 1; ++j)
+			{
+				vertices[i * mPatchQuadCols + j].BoundsY = GetPatchBoundsY(i, j);
+			}
+		}
+
+		D3D11_BUFFER_DESC desc;
+		desc.ByteWidth = sizeof(VertexData) * vertices.size();
+		desc.Usage = D3D11_USAGE_DEFAULT; // BoundsY change with Deform
+		desc.BindFlags = D3D11_BIND_VERTEX_BUFFER;
+		desc.CPUAccessFlags = 0;
+		desc.MiscFlags = 0;
+		desc.StructureByteStride = 0;
+
+		D3D11_SUBRESOURCE_DATA InitData;
+		InitData.pSysMem = vertices.data();
+		InitData.SysMemPitch = 0;
+		InitData.SysMemSlicePitch = 0;
+
+		HR(device->CreateBuffer(&desc, &InitData, &mPatchQuadVB));
+	}
+
+	// build quad patch index buffer
+	{
+		std::vector<UINT> indices(mPatchQuadFaces * 4); // 4 indices per quad face
+
+		// iterate over each quad and compute indices
+		UINT k = 0;
+
+		for (UINT i = 0; i < mPatchQuadRows - 1; ++i)
+		{
+			for (UINT j = 0; j < mPatchQuadCols - 1; ++j)
+			{
+				// rop row of 2x2 quad patch
+				indices[k + 0] = (i + 0) * mPatchQuadCols + j;
+				indices[k + 1] = (i + 0) * mPatchQuadCols + j + 1;
+
+				// bottom row of 2x2 quad patch
+				indices[k + 2] = (i + 1) * mPatchQuadCols + j;
+				indices[k + 3] = (i + 1) * mPatchQuadCols + j + 1;
+
+				k += 4; // next quad
+			}
+		}
+
+		D3D11_BUFFER_DESC desc;
+		desc.ByteWidth = sizeof(UINT) * indices.size();
+		desc.Usage = D3D11_USAGE_IMMUTABLE;
+		desc.BindFlags = D3D11_BIND_INDEX_BUFFER;
+		desc.CPUAccessFlags = 0;
+		desc.MiscFlags = 0;
+		desc.StructureByteStride = 0;
+
+		D3D11_SUBRESOURCE_DATA InitData;
+		InitData.pSysMem = indices.data();
+		InitData.SysMemPitch = 0;
+		InitData.SysMemSlicePitch = 0;
+
+		HR(device->CreateBuffer(&desc, &InitData, &mPatchQuadIB));
+
+		// same size, refilled by UpdateVisiblePatches
+		desc.Usage = D3D11_USAGE_DYNAMIC;
+		desc.CPUAccessFlags = D3D11_CPU_ACCESS_WRITE;
+
+		HR(device->CreateBuffer(&desc, nullptr, &mVisiblePatchQuadIB));
+	}
+
+	// build SRVs
+	{
+		// build height map SRV
+		{
+			D3D11_TEXTURE2D_DESC TextureDesc;
+			TextureDesc.Width = mInitInfo.HeightMapWidth;
+			TextureDesc.Height = mInitInfo.HeightMapDepth;
+			TextureDesc.MipLevels = 1;
+			TextureDesc.ArraySize = 1;
+			TextureDesc.Format = DXGI_FORMAT_R16_FLOAT;
+			TextureDesc.SampleDesc.Count = 1;
+			TextureDesc.SampleDesc.Quality = 0;
+			TextureDesc.Usage = D3D11_USAGE_DEFAULT;
+			TextureDesc.BindFlags = D3D11_BIND_SHADER_RESOURCE;
+			TextureDesc.CPUAccessFlags = 0;
+			TextureDesc.MiscFlags = 0;
+
+			ID3D11Texture2D* texture = nullptr;
+
+			if (mTiledHeightMap)
+			{
+				// filled one tile at a time
+				HR(device->CreateTexture2D(&TextureDesc, nullptr, &texture));
+				UploadStreamedHeightMap(context, texture);
+			}
+			else
+			{
+				std::vector<DirectX::PackedVector::HALF> HeightMap(mHeightMap.size());
+
+				std::transform(mHeightMap.begin(),
+							   mHeightMap.end(),
+							   HeightMap.begin(),
+							   DirectX::PackedVector::XMConvertFloatToHalf);
+
+				D3D11_SUBRESOURCE_DATA InitData;
+				InitData.pSysMem = HeightMap.data();
+				InitData.SysMemPitch = mInitInfo.HeightMapWidth * sizeof(DirectX::PackedVector::HALF);
+				InitData.SysMemSlicePitch = 0;
+
+				HR(device->CreateTexture2D(&TextureDesc, &InitData, &texture));
+			}
+
+			D3D11_SHADER_RESOURCE_VIEW_DESC SRVDesc;
+			SRVDesc.Format = TextureDesc.Format;
+			SRVDesc.ViewDimension = D3D11_SRV_DIMENSION_TEXTURE2D;
+			SRVDesc.Texture2D.MostDetailedMip = 0;
+			SRVDesc.Texture2D.MipLevels = -1;
+
+			HR(device->CreateShaderResourceView(texture, &SRVDesc, &mHeightMapSRV));
+
+			// kept for UploadDeformation
+			mHeightMapTexture = texture;
+		}
+		
+		// bake normal map and, without a blend map file, blend map; not in streaming mode, where that
+		// would page in every tile and keep full size maps, TerrainPS.hlsl uses the heights instead
+		if (!mTiledHeightMap)
+		{
+			const UINT width = mInitInfo.HeightMapWidth;
+			const UINT depth = mInitInfo.HeightMapDepth;
+
+			mNormalMap.resize(width * depth);
+
+			if (info.BlendMapFileName.empty())
+			{
+				mBlendMap.resize(width * depth);
+			}
+
+			BakeMaps(0, 0, depth - 1, width - 1);
+
+			D3D11_TEXTURE2D_DESC TextureDesc;
+			TextureDesc.Width = width;
+			TextureDesc.Height = depth;
+			TextureDesc.MipLevels = 1;
+			TextureDesc.ArraySize = 1;
+			TextureDesc.Format = DXGI_FORMAT_R8G8B8A8_SNORM;
+			TextureDesc.SampleDesc.Count = 1;
+			TextureDesc.SampleDesc.Quality = 0;
+			TextureDesc.Usage = D3D11_USAGE_DEFAULT; // rebaked after Deform
+			TextureDesc.BindFlags = D3D11_BIND_SHADER_RESOURCE;
+			TextureDesc.CPUAccessFlags = 0;
+			TextureDesc.MiscFlags = 0;
+
+			D3D11_SUBRESOURCE_DATA InitData;
+			InitData.pSysMem = mNormalMap.data();
+			InitData.SysMemPitch = width * sizeof(DirectX::PackedVector::XMBYTEN4);
+			InitData.SysMemSlicePitch = 0;
+
+			HR(device->CreateTexture2D(&TextureDesc, &InitData, &mNormalMapTexture));
+			HR(device->CreateShaderResourceView(mNormalMapTexture, nullptr, &mNormalMapSRV));
+
+			if (!mBlendMap.empty())
+			{
+				TextureDesc.Format = DXGI_FORMAT_R8G8B8A8_UNORM;
+
+				InitData.pSysMem = mBlendMap.data();
+				InitData.SysMemPitch = width * sizeof(DirectX::PackedVector::XMUBYTEN4);
+
+				HR(device->CreateTexture2D(&TextureDesc, &InitData, &mBlendMapTexture));
+				HR(device->CreateShaderResourceView(mBlendMapTexture, nullptr, &mBlendMapSRV));
+			}
+		}
+
+		// build layer and blend map SRVs
+		mLayerMapArraySRV = manager.CreateSRV(info.LayerMapFileName);
+
+		if (mBlendMapTexture == nullptr && !info.BlendMapFileName.empty())
+		{
+			mBlendMapSRV = manager.CreateSRV(info.BlendMapFileName);
+		}
+	}
+
+	// shaders
+	{
+		// vertex shader
+		{
+			std::wstring path = L"TerrainVS.hlsl";
+
+			ID3DBlob* pCode;
+			HR(D3DCompileFromFile(path.c_str(), nullptr, nullptr, "main", "vs_5_0", 0, 0, &pCode, nullptr));
+			HR(device->CreateVertexShader(pCode->GetBufferPointer(), pCode->GetBufferSize(), nullptr, &mVertexShader));
+
+			// input layout
+			{
+				std::vector<D3D11_INPUT_ELEMENT_DESC> desc =
+				{
+					{"POSITION", 0, DXGI_FORMAT_R32G32B32_FLOAT, 0,  0, D3D11_INPUT_PER_VERTEX_DATA, 0},
+					{"TEXCOORD", 0, DXGI_FORMAT_R32G32_FLOAT,    0, 12, D3D11_INPUT_PER_VERTEX_DATA, 0},
+					{"TEXCOORD", 1, DXGI_FORMAT_R32G32_FLOAT,    0, 20, D3D11_INPUT_PER_VERTEX_DATA, 0}
+				};
+
+				HR(device->CreateInputLayout(desc.data(), desc.size(), pCode->GetBufferPointer(), pCode->GetBufferSize(), &mInputLayout));
+			}
+		}
+
+		// hull shader
+		{
+			std::wstring path = L"TerrainHS.hlsl";
+
+			ID3DBlob* pCode;
+			HR(D3DCompileFromFile(path.c_str(), nullptr, nullptr, "main", "hs_5_0", 0, 0, &pCode, nullptr));
+			HR(device->CreateHullShader(pCode->GetBufferPointer(), pCode->GetBufferSize(), nullptr, &mHullShader));
+		}
+
+		// domain shader
+		{
+			std::wstring path = L"TerrainDS.hlsl";
+
+			ID3DBlob* pCode;
+			HR(D3DCompileFromFile(path.c_str(), nullptr, nullptr, "main", "ds_5_0", 0, 0, &pCode, nullptr));
+			HR(device->CreateDomainShader(pCode->GetBufferPointer(), pCode->GetBufferSize(), nullptr, &mDomainShader));
+		}
+
+		// pixel shader
+		{
+			std::wstring path = L"TerrainPS.hlsl";
+
+			std::vector<D3D_SHADER_MACRO> defines;
+			defines.push_back({ "ENABLE_TEXTURE",         "0" });
+			defines.push_back({ "ENABLE_SPHERE_TEXCOORD", "0" });
+			defines.push_back({ "ENABLE_NORMAL_MAPPING",  "0" });
+			defines.push_back({ "ENABLE_ALPHA_CLIPPING",  "0" });
+			//defines.push_back({ "ENABLE_LIGHTING",       "1" });
+			defines.push_back({ "ENABLE_REFLECTION",      "0" });
+			defines.push_back({ "ENABLE_FOG",             "0" });
+			defines.push_back({ nullptr, nullptr });
+
+			ID3DBlob* pCode;
+			HR(D3DCompileFromFile(path.c_str(), defines.data(), nullptr, "main", "ps_5_0", 0, 0, &pCode, nullptr));
+			HR(device->CreatePixelShader(pCode->GetBufferPointer(), pCode->GetBufferSize(), nullptr, &mPixelShader));
+		}
+	}
+
+	// heightmap sampler state
+	{
+		D3D11_SAMPLER_DESC desc;
+		desc.Filter = D3D11_FILTER_MIN_MAG_LINEAR_MIP_POINT;
+		desc.AddressU = D3D11_TEXTURE_ADDRESS_BORDER;
+		desc.AddressV = D3D11_TEXTURE_ADDRESS_BORDER;
+		desc.AddressW = D3D11_TEXTURE_ADDRESS_WRAP;
+		desc.MipLODBias = 0;
+		desc.MaxAnisotropy = 1;
+		desc.ComparisonFunc = D3D11_COMPARISON_NEVER;
+		ZeroMemory(desc.BorderColor, sizeof(desc.BorderColor));
+		desc.MinLOD = 0;
+		desc.MaxLOD = 0;
+
+		HR(device->CreateSamplerState(&desc, &mHeightMapSS));
+	}
+
+	return true;
+}
+
+void TerrainObject::LoadHeightMap(TextureManager& manager)
+{
+	UINT HeightMapSize = mInitInfo.HeightMapWidth * mInitInfo.HeightMapDepth;
+
+	std::wstring path = manager.mTextureFolder + mInitInfo.HeightMapFileName;
+
+	std::ifstream ifs;
+	ifs.open(path.c_str(), std::ios_base::binary);
+
+	// read the raw data into a float array and scale it
+	mHeightMap.assign(HeightMapSize, 0.0f);
+
+	if (ifs)
+	{
+		TiledHeightMap::ReadRaw(ifs, mInitInfo.HeightMapFormat, mInitInfo.HeightScale, mHeightMap.data(), HeightMapSize);
+		ifs.close();
+	}
+}
+
+void TerrainObject::GenerateHeightMap()
+{
+	const UINT width = mInitInfo.HeightMapWidth;
+	const UINT depth = mInitInfo.HeightMapDepth;
+
+	mHeightMap.resize(width * depth);
+
+	const UINT seed = mInitInfo.NoiseSeed;
+
+	// lattice hash instead of a permutation table, so the noise has no period;
+	// every octave has its own lattice so they don't line up
+	auto hash = [seed](int x, int y, UINT octave)
+	{
+		UINT h = UINT(x) * 0x8DA6B343u ^ UINT(y) * 0xD8163841u ^ (seed + octave) * 0xCB1AB31Fu;
+		h ^= h >> 13;
+		h *= 0x5BD1E995u;
+		h ^= h >> 15;
+		return h;
+	};
+
+	// 8 unit gradients
+	static const float GradientX[8] = { 1.0f, 0.7071068f, 0.0f, -0.7071068f, -1.0f, -0.7071068f,  0.0f,  0.7071068f };
+	static const float GradientY[8] = { 0.0f, 0.7071068f, 1.0f,  0.7071068f,  0.0f, -0.7071068f, -1.0f, -0.7071068f };
+
+	const XMVECTOR one = XMVectorReplicate(1.0f);
+
+	// gradient noise in [-1, 1] at 4 points, the corner gradients are gathered per lane
+	auto noise = [&](FXMVECTOR x, FXMVECTOR y, UINT octave)
+	{
+		XMVECTOR x0 = XMVectorFloor(x);
+		XMVECTOR y0 = XMVectorFloor(y);
+		XMVECTOR fx = x - x0;
+		XMVECTOR fy = y - y0;
+
+		XMFLOAT4 ix, iy;
+		XMStoreFloat4(&ix, x0);
+		XMStoreFloat4(&iy, y0);
+
+		// corners 00, 10, 01, 11
+		XMFLOAT4 gx[4], gy[4];
+
+		for (UINT k = 0; k < 4; ++k)
+		{
+			int i = static_cast<int>((&ix.x)[k]);
+			int j = static_cast<int>((&iy.x)[k]);
+
+			for (UINT c = 0; c < 4; ++c)
+			{
+				UINT g = hash(i + (c & 1), j + (c >> 1), octave) & 7;
+
+				(&gx[c].x)[k] = GradientX[g];
+				(&gy[c].x)[k] = GradientY[g];
+			}
+		}
+
+		XMVECTOR d00 = XMLoadFloat4(&gx[0]) * fx + XMLoadFloat4(&gy[0]) * fy;
+		XMVECTOR d10 = XMLoadFloat4(&gx[1]) * (fx - one) + XMLoadFloat4(&gy[1]) * fy;
+		XMVECTOR d01 = XMLoadFloat4(&gx[2]) * fx + XMLoadFloat4(&gy[2]) * (fy - one);
+		XMVECTOR d11 = XMLoadFloat4(&gx[3]) * (fx - one) + XMLoadFloat4(&gy[3]) * (fy - one);
+
+		// quintic fade
+		XMVECTOR u = fx * fx * fx * (fx * (fx * 6.0f - XMVectorReplicate(15.0f)) + XMVectorReplicate(10.0f));
+		XMVECTOR v = fy * fy * fy * (fy * (fy * 6.0f - XMVectorReplicate(15.0f)) + XMVectorReplicate(10.0f));
+
+		XMVECTOR n = XMVectorLerpV(XMVectorLerpV(d00, d10, u), XMVectorLerpV(d01, d11, u), v);
+
+		// unit gradients peak at sqrt(1/2)
+		return n * 1.4142136f;
+	};
+
+	const UINT octaves = std::max(mInitInfo.NoiseOctaves, 1u);
+	const float frequency = mInitInfo.NoiseFrequency;
+	const XMVECTOR warp = XMVectorReplicate(mInitInfo.NoiseWarp * frequency);
+
+	// every texel depends only on its coordinates, so the result is the same for any number of threads
+	ForEachRowBlock(depth, [&](UINT FirstRow, UINT LastRow)
+	{
+		for (UINT i = FirstRow; i < LastRow; ++i)
+		{
+			for (UINT j = 0; j < width; j += 4)
+			{
+				XMVECTOR x = XMVectorSet(j + 0.0f, j + 1.0f, j + 2.0f, j + 3.0f) * frequency;
+				XMVECTOR y = XMVectorReplicate(i * frequency);
+
+				if (mInitInfo.NoiseWarp != 0.0f)
+				{
+					// offset by two more noise fields with their own lattices
+					XMVECTOR wx = noise(x, y, octaves + 0);
+					XMVECTOR wy = noise(x, y, octaves + 1);
+
+					x += warp * wx;
+					y += warp * wy;
+				}
+
+				XMVECTOR sum = XMVectorZero();
+				float amplitude = 1.0f;
+				float total = 0.0f;
+
+				for (UINT o = 0; o < octaves; ++o)
+				{
+					XMVECTOR n = noise(x, y, o);
+
+					if (mInitInfo.IsNoiseRidged)
+					{
+						// sharp crests where the noise crosses 0
+						n = one - XMVectorAbs(n);
+						n = n * n;
+					}
+
+					sum += n * amplitude;
+					total += amplitude;
+
+					x = x * mInitInfo.NoiseLacunarity;
+					y = y * mInitInfo.NoiseLacunarity;
+					amplitude *= mInitInfo.NoiseGain;
+				}
+
+				// to [0, 1], ridged is there already
+				XMVECTOR h = sum / total;
+
+				if (!mInitInfo.IsNoiseRidged)
+				{
+					h = (h + one) * 0.5f;
+				}
+
+				XMFLOAT4 heights;
+				XMStoreFloat4(&heights, XMVectorSaturate(h) * mInitInfo.HeightScale);
+
+				std::copy(&heights.x, &heights.x + std::min(4u, width - j), &mHeightMap[i * width + j]);
+			}
+		}
+	});
+}
+
+void TerrainObject::SmoothHeightMap()
+{
+	// average each texel with its neighbours within the radius, missing neighbours past the edges
+	// are not included in the average; the filter is separable, so rows are summed first and then
+	// the row sums are summed down the columns
+	const int width = mInitInfo.HeightMapWidth;
+	const int depth = mInitInfo.HeightMapDepth;
+	const int radius = mInitInfo.SmoothRadius;
+
+	if (radius == 0 || width == 0 || depth == 0)
+	{
+		return;
+	}
+
+	auto GetCount = [radius](int i, int size) -> int
+	{
+		return std::min(i + radius, size - 1) - std::max(i - radius, 0) + 1;
+	};
+
+	std::vector<float> ColCounts(width);
+
+	for (int j = 0; j < width; ++j)
+	{
+		ColCounts[j] = static_cast<float>(GetCount(j, width));
+	}
+
+	std::vector<float> RowSums(mHeightMap.size());
+
+	for (UINT pass = 0; pass < mInitInfo.SmoothPasses; ++pass)
+	{
+		// horizontal
+		ForEachRowBlock(depth, [&](UINT FirstRow, UINT LastRow)
+		{
+			for (UINT i = FirstRow; i < LastRow; ++i)
+			{
+				const float* src = &mHeightMap[i * width];
+				float* dst = &RowSums[i * width];
+
+				auto SumEdge = [&](int j)
+				{
+					float sum = 0.0f;
+
+					for (int n = std::max(j - radius, 0); n <= std::min(j + radius, width - 1); ++n)
+					{
+						sum += src[n];
+					}
+
+					dst[j] = sum;
+				};
+
+				int j = 0;
+
+				for (; j < std::min(radius, width); ++j)
+				{
+					SumEdge(j);
+				}
+
+				// interior, every tap is in bounds
+				for (; j + 4 <= width - radius; j += 4)
+				{
+					XMVECTOR sum = XMLoadFloat4(reinterpret_cast<const XMFLOAT4*>(src + j - radius));
+
+					for (int n = j - radius + 1; n <= j + radius; ++n)
+					{
+						sum += XMLoadFloat4(reinterpret_cast<const XMFLOAT4*>(src + n));
+					}
+
+					XMStoreFloat4(reinterpret_cast<XMFLOAT4*>(dst + j), sum);
+				}
+
+				for (; j < width; ++j)
+				{
+					SumEdge(j);
+				}
+			}
+		});
+
+		// vertical, the clamped row range handles the top and bottom edges
+		ForEachRowBlock(depth, [&](UINT FirstRow, UINT LastRow)
+		{
+			for (int i = FirstRow; i < static_cast<int>(LastRow); ++i)
+			{
+				const int first = std::max(i - radius, 0);
+				const int last = std::min(i + radius, depth - 1);
+				const float RowCount = static_cast<float>(last - first + 1);
+
+				float* dst = &mHeightMap[i * width];
+
+				int j = 0;
+
+				for (; j + 4 <= width; j += 4)
+				{
+					XMVECTOR sum = XMLoadFloat4(reinterpret_cast<const XMFLOAT4*>(&RowSums[first * width + j]));
+
+					for (int m = first + 1; m <= last; ++m)
+					{
+						sum += XMLoadFloat4(reinterpret_cast<const XMFLOAT4*>(&RowSums[m * width + j]));
+					}
+
+					XMVECTOR count = XMLoadFloat4(reinterpret_cast<const XMFLOAT4*>(&ColCounts[j])) * RowCount;
+
+					XMStoreFloat4(reinterpret_cast<XMFLOAT4*>(dst + j), XMVectorDivide(sum, count));
+				}
+
+				for (; j < width; ++j)
+				{
+					float sum = RowSums[first * width + j];
+
+					for (int m = first + 1; m <= last; ++m)
+					{
+						sum += RowSums[m * width + j];
+					}
+
+					dst[j] = sum / (ColCounts[j] * RowCount);
+				}
+			}
+		});
+	}
+}
+
+void TerrainObject::ComputeStreamedPatchBoundsY()
+{
+	mPatchBoundsY.assign(mPatchQuadFaces, XMFLOAT2(+FLT_MAX, -FLT_MAX));
+
+	if (mPatchQuadFaces == 0)
+	{
+		return;
+	}
+
+	const UINT size = mTiledHeightMap->GetTileSize();
+
+	for (UINT ti = 0; ti < mTiledHeightMap->GetTileRows(); ++ti)
+	{
+		for (UINT tj = 0; tj < mTiledHeightMap->GetTileCols(); ++tj)
+		{
+			const float* tile = mTiledHeightMap->GetTile(ti, tj);
+
+			if (tile == nullptr)
+			{
+				continue;
+			}
+
+			UINT rows = std::min(size, mInitInfo.HeightMapDepth - ti * size);
+			UINT cols = std::min(size, mInitInfo.HeightMapWidth - tj * size);
+
+			for (UINT r = 0; r < rows; ++r)
+			{
+				UINT pi0, pi1;
+				GetPatchRange(ti * size + r, mPatchQuadRows - 1, pi0, pi1);
+
+				for (UINT c = 0; c < cols; ++c)
+				{
+					UINT pj0, pj1;
+					GetPatchRange(tj * size + c, mPatchQuadCols - 1, pj0, pj1);
+
+					float h = tile[r * size + c];
+
+					for (UINT pi = pi0; pi <= pi1; ++pi)
+					{
+						for (UINT pj = pj0; pj <= pj1; ++pj)
+						{
+							XMFLOAT2& bounds = mPatchBoundsY[pi * (mPatchQuadCols - 1) + pj];
+
+							bounds.x = std::min(bounds.x, h);
+							bounds.y = std::max(bounds.y, h);
+						}
+					}
+				}
+			}
+		}
+	}
+}
+
+void TerrainObject::UploadStreamedHeightMap(ID3D11DeviceContext* context, ID3D11Texture2D* texture)
+{
+	const UINT size = mTiledHeightMap->GetTileSize();
+
+	std::vector<DirectX::PackedVector::HALF> HeightMap(size * size);
+
+	for (UINT ti = 0; ti < mTiledHeightMap->GetTileRows(); ++ti)
+	{
+		for (UINT tj = 0; tj < mTiledHeightMap->GetTileCols(); ++tj)
+		{
+			const float* tile = mTiledHeightMap->GetTile(ti, tj);
+
+			if (tile == nullptr)
+			{
+				continue;
+			}
+
+			UINT rows = std::min(size, mInitInfo.HeightMapDepth - ti * size);
+			UINT cols = std::min(size, mInitInfo.HeightMapWidth - tj * size);
+
+			for (UINT r = 0; r < rows; ++r)
+			{
+				for (UINT c = 0; c < cols; ++c)
+				{
+					HeightMap[r * cols + c] = DirectX::PackedVector::XMConvertFloatToHalf(tile[r * size + c]);
+				}
+			}
+
+			D3D11_BOX box;
+			box.left = tj * size;
+			box.top = ti * size;
+			box.front = 0;
+			box.right = tj * size + cols;
+			box.bottom = ti * size + rows;
+			box.back = 1;
+
+			context->UpdateSubresource(texture, 0, &box, HeightMap.data(), cols * sizeof(DirectX::PackedVector::HALF), 0);
+		}
 	}
 }
 
-void Model3DLoader::LoadBoneOffsets(std::ifstream& ifs, UINT count, std::vector<XMFLOAT4X4>& BoneOffsets)
+void TerrainObject::ForEachRowBlock(UINT rows, const std::function<void(UINT, UINT)>& func)
 {
-	BoneOffsets.clear();
-	BoneOffsets.resize(count);
+	const UINT RowsPerBlock = 32;
+	const UINT blocks = (rows + RowsPerBlock - 1) / RowsPerBlock;
 
-	std::string ignore;
-	ifs >> ignore; // ignore header
+	auto task = [&](UINT block)
+	{
+		func(block * RowsPerBlock, std::min(rows, (block + 1) * RowsPerBlock));
+	};
 
-	for (UINT i = 0; i < count; ++i)
+	if (mThreadPool)
 	{
-		ifs >> ignore >>
-			BoneOffsets[i](0, 0) >> BoneOffsets[i](0, 1) >> BoneOffsets[i](0, 2) >> BoneOffsets[i](0, 3) >>
-			BoneOffsets[i](1, 0) >> BoneOffsets[i](1, 1) >> BoneOffsets[i](1, 2) >> BoneOffsets[i](1, 3) >>
-			BoneOffsets[i](2, 0) >> BoneOffsets[i](2, 1) >> BoneOffsets[i](2, 2) >> BoneOffsets[i](2, 3) >>
-			BoneOffsets[i](3, 0) >> BoneOffsets[i](3, 1) >> BoneOffsets[i](3, 2) >> BoneOffsets[i](3, 3);
+		mThreadPool->ParallelFor(blocks, task);
+	}
+	else
+	{
+		for (UINT block = 0; block < blocks; ++block)
+		{
+			task(block);
+		}
 	}
 }
 
-void Model3DLoader::LoadBoneHierarchy(std::ifstream& ifs, UINT count, std::vector<UINT>& BoneHierarchy)
+void TerrainObject::BakeMaps(UINT FirstRow, UINT FirstCol, UINT LastRow, UINT LastCol)
 {
-	BoneHierarchy.clear();
-	BoneHierarchy.resize(count);
+	const UINT width = mInitInfo.HeightMapWidth;
+	const UINT depth = mInitInfo.HeightMapDepth;
 
-	std::string ignore;
-	ifs >> ignore; // ignore header
+	// nothing is baked in streaming mode
+	if (mNormalMap.empty())
+	{
+		return;
+	}
 
-	for (UINT i = 0; i < count; ++i)
+	LastRow = std::min(LastRow, depth - 1);
+	LastCol = std::min(LastCol, width - 1);
+
+	if (FirstRow > LastRow || FirstCol > LastCol)
 	{
-		ifs >> ignore >> BoneHierarchy[i];
+		return;
 	}
+
+	auto GetBlendRow = [&](UINT i)
+	{
+		return mBlendMap.empty() ? nullptr : &mBlendMap[i * width];
+	};
+
+	ForEachRowBlock(LastRow - FirstRow + 1, [&](UINT first, UINT last)
+	{
+		for (UINT i = FirstRow + first; i < FirstRow + last; ++i)
+		{
+			const float* row = &mHeightMap[i * width];
+
+			BakeRow(i > 0 ? row - width : row,
+					row,
+					i + 1 < depth ? row + width : row,
+					FirstCol,
+					LastCol,
+					&mNormalMap[i * width],
+					GetBlendRow(i));
+		}
+	});
 }
 
-void Model3DLoader::LoadAnimationClips(std::ifstream& ifs,
-									   UINT BoneCount,
-									   UINT AnimationClipCount,
-									   std::map<std::string, AnimationClip>& animations)
+void TerrainObject::BakeRow(const float* above, const float* row, const float* below, UINT FirstCol, UINT LastCol,
+							DirectX::PackedVector::XMBYTEN4* normals, DirectX::PackedVector::XMUBYTEN4* blend) const
 {
-	std::string ignore;
-	ifs >> ignore; // ignore header
+	const UINT width = mInitInfo.HeightMapWidth;
 
-	for (UINT ClipIndex = 0; ClipIndex < AnimationClipCount; ++ClipIndex)
+	// the central differences TerrainPS.hlsl used, N = normalize(l - r, 2 * spacing, b - t)
+	const XMVECTOR NY = XMVectorReplicate(2.0f * mInitInfo.CellSpacing);
+	const XMVECTOR InvHeightScale = XMVectorReplicate(mInitInfo.HeightScale != 0.0f ? 1.0f / mInitInfo.HeightScale : 0.0f);
+	const XMVECTOR one = XMVectorReplicate(1.0f);
+
+	XMVECTOR MinHeight[4], MaxHeight[4], MinSlope[4], MaxSlope[4], InvFalloff[4];
+
+	for (UINT c = 0; c < 4; ++c)
 	{
-		std::string ClipName;
-		ifs >> ignore >> ClipName;
-		ifs >> ignore; // {
+		const BlendRule& rule = mInitInfo.BlendRules[c];
 
-		AnimationClip clip;
-		clip.mAnimationObjects.resize(BoneCount);
+		MinHeight[c] = XMVectorReplicate(rule.MinHeight);
+		MaxHeight[c] = XMVectorReplicate(rule.MaxHeight);
+		MinSlope[c] = XMVectorReplicate(rule.MinSlope);
+		MaxSlope[c] = XMVectorReplicate(rule.MaxSlope);
+		InvFalloff[c] = XMVectorReplicate(1.0f / std::max(rule.Falloff, 1e-4f));
+	}
 
-		for (UINT BoneIndex = 0; BoneIndex < BoneCount; ++BoneIndex)
+	// 1 in [lo, hi], linear down to 0 over falloff on both sides
+	auto ramp = [&](FXMVECTOR x, FXMVECTOR lo, FXMVECTOR hi, FXMVECTOR scale)
+	{
+		return XMVectorSaturate((x - lo) * scale + one) * XMVectorSaturate((hi - x) * scale + one);
+	};
+
+	// 4 texels per iteration, the ones past LastCol are computed and dropped
+	for (UINT j = FirstCol; j <= LastCol; j += 4)
+	{
+		XMVECTOR l, r, t, b, h;
+
+		if (j >= 1 && j + 4 < width)
 		{
-			LoadAnimation(ifs, BoneCount, clip.mAnimationObjects[BoneIndex]);
+			l = XMLoadFloat4(reinterpret_cast<const XMFLOAT4*>(row + j - 1));
+			r = XMLoadFloat4(reinterpret_cast<const XMFLOAT4*>(row + j + 1));
+			t = XMLoadFloat4(reinterpret_cast<const XMFLOAT4*>(above + j));
+			b = XMLoadFloat4(reinterpret_cast<const XMFLOAT4*>(below + j));
+			h = XMLoadFloat4(reinterpret_cast<const XMFLOAT4*>(row + j));
 		}
-		ifs >> ignore; // }
+		else
+		{
+			// clamped to the edges
+			XMFLOAT4 L, R, T, B, H;
+
+			for (UINT k = 0; k < 4; ++k)
+			{
+				const UINT col = std::min(j + k, width - 1);
 
-		animations[ClipName] = clip;
+				(&L.x)[k] = row[col > 0 ? col - 1 : 0];
+				(&R.x)[k] = row[std::min(col + 1, width - 1)];
+				(&T.x)[k] = above[col];
+				(&B.x)[k] = below[col];
+				(&H.x)[k] = row[col];
+			}
+
+			l = XMLoadFloat4(&L);
+			r = XMLoadFloat4(&R);
+			t = XMLoadFloat4(&T);
+			b = XMLoadFloat4(&B);
+			h = XMLoadFloat4(&H);
+		}
+
+		XMVECTOR NX = l - r;
+		XMVECTOR NZ = b - t;
+
+		const XMVECTOR InvLength = XMVectorReciprocalSqrt(NX * NX + NY * NY + NZ * NZ);
+
+		NX *= InvLength;
+		NZ *= InvLength;
+
+		const XMVECTOR UnitNY = NY * InvLength;
+
+		const UINT count = std::min(4u, LastCol - j + 1);
+
+		// one texel per row after the transpose
+		const XMMATRIX N = XMMatrixTranspose(XMMATRIX(NX, UnitNY, NZ, XMVectorZero()));
+
+		for (UINT k = 0; k < count; ++k)
+		{
+			DirectX::PackedVector::XMStoreByteN4(&normals[j + k], N.r[k]);
+		}
+
+		if (blend)
+		{
+			const XMVECTOR height = h * InvHeightScale;
+			const XMVECTOR slope = one - UnitNY;
+
+			XMVECTOR weights[4];
+
+			for (UINT c = 0; c < 4; ++c)
+			{
+				weights[c] = ramp(height, MinHeight[c], MaxHeight[c], InvFalloff[c]) * ramp(slope, MinSlope[c], MaxSlope[c], InvFalloff[c]);
+			}
+
+			const XMMATRIX W = XMMatrixTranspose(XMMATRIX(weights[0], weights[1], weights[2], weights[3]));
+
+			for (UINT k = 0; k < count; ++k)
+			{
+				DirectX::PackedVector::XMStoreUByteN4(&blend[j + k], W.r[k]);
+			}
+		}
 	}
 }
 
-void Model3DLoader::LoadAnimation(std::ifstream& ifs, UINT BoneCount, AnimationObject& animation)
+void TerrainObject::BuildMinMaxPyramid()
 {
-	UINT keyframes = 0;
+	mMinMaxPyramid.clear();
 
-	std::string ignore;
-	ifs >> ignore >> ignore >> keyframes;
-	ifs >> ignore; // {
+	MinMaxLevel level;
+	level.mRows = mInitInfo.HeightMapDepth > 1 ? mInitInfo.HeightMapDepth - 1 : 0;
+	level.mCols = mInitInfo.HeightMapWidth > 1 ? mInitInfo.HeightMapWidth - 1 : 0;
 
-	animation.keyframes.resize(keyframes);
+	if (level.mRows == 0 || level.mCols == 0)
+	{
+		return;
+	}
 
-	for (UINT i = 0; i < keyframes; ++i)
+	while (true)
 	{
-		float t = 0.0f;
-		XMFLOAT3 T(0.0f, 0.0f, 0.0f);
-		XMFLOAT3 S(1.0f, 1.0f, 1.0f);
-		XMFLOAT4 R(0.0f, 0.0f, 0.0f, 1.0f);
+		level.mBounds.resize(level.mRows * level.mCols);
+		mMinMaxPyramid.push_back(level);
 
-		ifs >> ignore >> t;
-		ifs >> ignore >> T.x >> T.y >> T.z;
-		ifs >> ignore >> S.x >> S.y >> S.z;
-		ifs >> ignore >> R.x >> R.y >> R.z >> R.w;
+		if (level.mRows == 1 && level.mCols == 1)
+		{
+			break;
+		}
 
-		animation.keyframes[i].time = t;
-		animation.keyframes[i].translation = T;
-		animation.keyframes[i].scale = S;
-		animation.keyframes[i].rotation = R;
+		level.mRows = (level.mRows + 1) / 2;
+		level.mCols = (level.mCols + 1) / 2;
 	}
 
-	ifs >> ignore; // }
-}
-
-float SkinnedObject::GetTimeClipStart(const std::string& ClipName)
-{
-	return mAnimationClips.at(ClipName).GetTimeClipStart();
+	UpdateMinMaxPyramid(0, 0, mInitInfo.HeightMapDepth - 1, mInitInfo.HeightMapWidth - 1);
 }
 
-float SkinnedObject::GetTimeClipEnd(const std::string& ClipName)
+void TerrainObject::UpdateMinMaxPyramid(UINT FirstRow, UINT FirstCol, UINT LastRow, UINT LastCol)
 {
-	return mAnimationClips.at(ClipName).GetTimeClipEnd();
-}
+	if (mMinMaxPyramid.empty())
+	{
+		return;
+	}
 
-void SkinnedObject::GetTransforms(const std::string& animation,
-								  float t,
-								  std::vector<XMFLOAT4X4>& transforms)
-{
-	UINT BoneCount = mBoneOffsets.size();
+	const UINT width = mInitInfo.HeightMapWidth;
 
-	std::vector<XMMATRIX> ToParentTransforms(BoneCount);
-	std::vector<XMMATRIX> ToRootTransforms(BoneCount);
+	// a texel is a corner of up to four cells
+	UINT r0 = FirstRow > 0 ? FirstRow - 1 : 0;
+	UINT c0 = FirstCol > 0 ? FirstCol - 1 : 0;
+	UINT r1 = std::min(LastRow, mMinMaxPyramid[0].mRows - 1);
+	UINT c1 = std::min(LastCol, mMinMaxPyramid[0].mCols - 1);
 
-	// interpolate all the bones of this clip at t
-	mAnimationClips.at(animation).interpolate(t, ToParentTransforms);
+	for (UINT k = 0; k < mMinMaxPyramid.size(); ++k)
+	{
+		MinMaxLevel& level = mMinMaxPyramid[k];
 
-	// traverse the hierarchy and ...
+		ForEachRowBlock(r1 - r0 + 1, [&](UINT FirstBlockRow, UINT LastBlockRow)
+		{
+			for (UINT i = r0 + FirstBlockRow; i < r0 + LastBlockRow; ++i)
+			{
+				for (UINT j = c0; j <= c1; ++j)
+				{
+					XMFLOAT2 bounds;
+
+					if (k == 0)
+					{
+						float A = mHeightMap[(i + 0) * width + (j + 0)];
+						float B = mHeightMap[(i + 0) * width + (j + 1)];
+						float C = mHeightMap[(i + 1) * width + (j + 0)];
+						float D = mHeightMap[(i + 1) * width + (j + 1)];
+
+						bounds.x = std::min(std::min(A, B), std::min(C, D));
+						bounds.y = std::max(std::max(A, B), std::max(C, D));
+					}
+					else
+					{
+						const MinMaxLevel& child = mMinMaxPyramid[k - 1];
+
+						bounds = XMFLOAT2(+FLT_MAX, -FLT_MAX);
+
+						for (UINT m = 2 * i; m < std::min(2 * i + 2, child.mRows); ++m)
+						{
+							for (UINT n = 2 * j; n < std::min(2 * j + 2, child.mCols); ++n)
+							{
+								const XMFLOAT2& b = child.mBounds[m * child.mCols + n];
+
+								bounds.x = std::min(bounds.x, b.x);
+								bounds.y = std::max(bounds.y, b.y);
+							}
+						}
+					}
+
+					level.mBounds[i * level.mCols + j] = bounds;
+				}
+			}
+		});
 
-	// the root bone has index 0 and has no parent,
-	// so its ToRootTransform is just its local bone transform
-	ToRootTransforms[0] = ToParentTransforms[0];
+		r0 /= 2;
+		c0 /= 2;
+		r1 /= 2;
+		c1 /= 2;
+	}
+}
 
-	// find the ToRootTransform of the children
-	for (UINT i = 1; i < BoneCount; ++i)
+XMFLOAT2 TerrainObject::GetPatchBoundsY(UINT i, UINT j) const
+{
+	if (mTiledHeightMap)
 	{
-		XMMATRIX ToParent = ToParentTransforms[i];
-
-		// parent's ToRoot
-		UINT ParentIndex = mBoneHierarchy[i];
-		XMMATRIX ToRoot = ToRootTransforms[ParentIndex];
-
-		ToRootTransforms[i] = ToParent * ToRoot;
+		return mPatchBoundsY[i * (mPatchQuadCols - 1) + j];
 	}
 
-	// ... and transform all the bones to the root space
-	for (UINT i = 0; i < BoneCount; ++i)
+	// CellsPerPatch is a power of two, a patch is exactly one entry of that level
+	UINT level = 0;
+
+	while ((1 << level) < CellsPerPatch)
 	{
-		// premultiply by the bone offset transform to get the final transform.
-		XMMATRIX offset = XMLoadFloat4x4(&mBoneOffsets[i]);
-		XMMATRIX ToRoot = ToRootTransforms[i];
-		XMStoreFloat4x4(&transforms[i], offset * ToRoot);
+		++level;
 	}
 
+	return GetMinMax(level, i, j);
 }
 
-void GameObject::LoadModel(ID3D11Device* device, TextureManager& manager, const std::string& filename, bool skinned)
+void TerrainObject::BuildPatchPyramid()
 {
-	mIsSkinned = skinned;
-	Model3DLoader().load(filename, manager, *this);
-}
+	mPatchPyramid.clear();
 
-void GameObjectInstance::update(float dt)
-{
-	time += dt;
-	obj->mSkinnedData.GetTransforms(ClipName, time, transforms);
+	MinMaxLevel level;
+	level.mRows = mPatchQuadRows > 1 ? mPatchQuadRows - 1 : 0;
+	level.mCols = mPatchQuadCols > 1 ? mPatchQuadCols - 1 : 0;
 
-	if (time > obj->mSkinnedData.GetTimeClipEnd(ClipName))
+	if (level.mRows == 0 || level.mCols == 0)
 	{
-		time = 0; // loop animation
+		return;
 	}
-}
 
-TerrainObject::TerrainObject() :
-	mVertexShader(nullptr),
-	mInputLayout(nullptr),
-	mHullShader(nullptr),
-	mDomainShader(nullptr),
-	mPixelShader(nullptr),
-	mPatchQuadVB(nullptr),
-	mPatchQuadIB(nullptr),
-	mHeightMapSRV(nullptr),
-	mHeightMapSS(nullptr),
-	mLayerMapArraySRV(nullptr),
-	mBlendMapSRV(nullptr),
-	mPatchQuadVertices(0),
-	mPatchQuadFaces(0),
-	mPatchQuadRows(0),
-	mPatchQuadCols(0),
-	mWorld(XMMatrixIdentity())
-{
-	mMaterial.mAmbient  = XMFLOAT4(1.0f, 1.0f, 1.0f, 1.0f);
-	mMaterial.mDiffuse  = XMFLOAT4(1.0f, 1.0f, 1.0f, 1.0f);
-	mMaterial.mSpecular = XMFLOAT4(0.0f, 0.0f, 0.0f, 64.0f);
-	mMaterial.mReflect  = XMFLOAT4(0.0f, 0.0f, 0.0f, 1.0f);
-}
+	while (true)
+	{
+		level.mBounds.resize(level.mRows * level.mCols);
+		mPatchPyramid.push_back(level);
 
-TerrainObject::~TerrainObject()
-{
-	SafeRelease(mVertexShader);
-	SafeRelease(mInputLayout);
-	SafeRelease(mHullShader);
-	SafeRelease(mDomainShader);
-	SafeRelease(mPixelShader);
+		if (level.mRows == 1 && level.mCols == 1)
+		{
+			break;
+		}
 
-	SafeRelease(mPatchQuadVB);
-	SafeRelease(mPatchQuadIB);
+		level.mRows = (level.mRows + 1) / 2;
+		level.mCols = (level.mCols + 1) / 2;
+	}
 
-	SafeRelease(mHeightMapSRV);
-	SafeRelease(mHeightMapSS);
+	UpdatePatchPyramid(0, 0, mPatchPyramid[0].mRows - 1, mPatchPyramid[0].mCols - 1);
 }
 
-float TerrainObject::GetWidth() const
+void TerrainObject::UpdatePatchPyramid(UINT FirstRow, UINT FirstCol, UINT LastRow, UINT LastCol)
 {
-	// total terrain width
-	return (mInitInfo.HeightMapWidth - 1) * mInitInfo.CellSpacing;
-}
+	if (mPatchPyramid.empty())
+	{
+		return;
+	}
 
-float TerrainObject::GetDepth() const
-{
-	// total terrain depth
-	return (mInitInfo.HeightMapDepth - 1) * mInitInfo.CellSpacing;
+	// a handful of patches per side, no need for row blocks here
+	for (UINT k = 0; k < mPatchPyramid.size(); ++k)
+	{
+		MinMaxLevel& level = mPatchPyramid[k];
+
+		for (UINT i = FirstRow; i <= std::min(LastRow, level.mRows - 1); ++i)
+		{
+			for (UINT j = FirstCol; j <= std::min(LastCol, level.mCols - 1); ++j)
+			{
+				XMFLOAT2 bounds;
+
+				if (k == 0)
+				{
+					bounds = GetPatchBoundsY(i, j);
+				}
+				else
+				{
+					const MinMaxLevel& child = mPatchPyramid[k - 1];
+
+					bounds = XMFLOAT2(+FLT_MAX, -FLT_MAX);
+
+					for (UINT m = 2 * i; m < std::min(2 * i + 2, child.mRows); ++m)
+					{
+						for (UINT n = 2 * j; n < std::min(2 * j + 2, child.mCols); ++n)
+						{
+							const XMFLOAT2& b = child.mBounds[m * child.mCols + n];
+
+							bounds.x = std::min(bounds.x, b.x);
+							bounds.y = std::max(bounds.y, b.y);
+						}
+					}
+				}
+
+				level.mBounds[i * level.mCols + j] = bounds;
+			}
+		}
+
+		FirstRow /= 2;
+		FirstCol /= 2;
+		LastRow /= 2;
+		LastCol /= 2;
+	}
 }
 
-float TerrainObject::GetHeight(float x, float z) const
+BoundingBox TerrainObject::GetPatchNodeBox(UINT level, UINT i, UINT j) const
 {
-	// transform from terrain local space to "cell" space
-	float w = (x + 0.5f * GetWidth()) / +mInitInfo.CellSpacing;
-	float d = (z - 0.5f * GetDepth()) / -mInitInfo.CellSpacing;
+	// same patch layout as the quad patch vertex buffer
+	const UINT rows = mPatchPyramid[0].mRows;
+	const UINT cols = mPatchPyramid[0].mCols;
 
-	// get the row and column we are in
-	int row = std::floor(d);
-	int col = std::floor(w);
+	const float PatchWidth = GetWidth() / cols;
+	const float PatchDepth = GetDepth() / rows;
+	const float HalfWidth = 0.5f * GetWidth();
+	const float HalfDepth = 0.5f * GetDepth();
 
-	// grab the heights of the cell we are in
-	//  A--B
-	//  | /|
-	//  |/ |
-	//  C--D
-	float A = mHeightMap[(row + 0) * mInitInfo.HeightMapWidth + (col + 0)];
-	float B = mHeightMap[(row + 0) * mInitInfo.HeightMapWidth + (col + 1)];
-	float C = mHeightMap[(row + 1) * mInitInfo.HeightMapWidth + (col + 0)];
-	float D = mHeightMap[(row + 1) * mInitInfo.HeightMapWidth + (col + 1)];
+	const UINT r0 = i << level;
+	const UINT c0 = j << level;
+	const UINT r1 = std::min((i + 1) << level, rows);
+	const UINT c1 = std::min((j + 1) << level, cols);
 
-	// get the coordinates relative to the cell
-	float s = w - (float)col;
-	float t = d - (float)row;
+	const MinMaxLevel& node = mPatchPyramid[level];
+	const XMFLOAT2& bounds = node.mBounds[i * node.mCols + j];
 
-	if (s + t <= 1.0f) // upper triangle ABC
-	{
-		float uy = B - A;
-		float vy = C - A;
-		return A + s * uy + t * vy;
-	}
-	else // lower triangle DCB
+	XMVECTOR MinCorner = XMVectorSet(c0 * PatchWidth - HalfWidth, bounds.x, HalfDepth - r1 * PatchDepth, 0.0f);
+	XMVECTOR MaxCorner = XMVectorSet(c1 * PatchWidth - HalfWidth, bounds.y, HalfDepth - r0 * PatchDepth, 0.0f);
+
+	BoundingBox box;
+	BoundingBox::CreateFromPoints(box, MinCorner, MaxCorner);
+
+	return box;
+}
+
+void TerrainObject::CullPatches(const BoundingFrustum& frustum, FXMVECTOR eye, std::vector<UINT>& patches, std::vector<float>& distances) const
+{
+	patches.clear();
+	distances.clear();
+
+	if (mPatchPyramid.empty())
 	{
-		float uy = C - D;
-		float vy = B - D;
-		return D + (1.0f - s) * uy + (1.0f - t) * vy;
+		return;
 	}
+
+	const UINT root = static_cast<UINT>(mPatchPyramid.size()) - 1;
+
+	CullPatchNode(frustum, eye, root, 0, 0, false, patches, distances);
 }
 
-void TerrainObject::init(ID3D11Device* device, ID3D11DeviceContext* context, TextureManager& manager, const InitInfo& info)
+void TerrainObject::CullPatchNode(const BoundingFrustum& frustum, FXMVECTOR eye, UINT level, UINT i, UINT j, bool IsInside,
+								  std::vector<UINT>& patches, std::vector<float>& distances) const
 {
-	mInitInfo = info;
-
-	// divide heightmap into patches such that each patch has CellsPerPatch cells
-	mPatchQuadRows = ((mInitInfo.HeightMapDepth - 1) / CellsPerPatch) + 1;
-	mPatchQuadCols = ((mInitInfo.HeightMapWidth - 1) / CellsPerPatch) + 1;
+	// distance from eye to the closest point of the box
+	auto distance = [eye](const BoundingBox& box)
+	{
+		XMVECTOR center = XMLoadFloat3(&box.Center);
+		XMVECTOR extents = XMLoadFloat3(&box.Extents);
+		XMVECTOR closest = XMVectorClamp(eye, center - extents, center + extents);
 
-	mPatchQuadVertices = mPatchQuadRows * mPatchQuadCols;
-	mPatchQuadFaces = (mPatchQuadRows - 1) * (mPatchQuadCols - 1);
+		return XMVectorGetX(XMVector3Length(eye - closest));
+	};
 
-	LoadHeightMap(manager);
-	SmoothHeightMap();
+	const BoundingBox box = GetPatchNodeBox(level, i, j);
 
-	// compute all patch bounds Y
+	// once a node is inside the frustum so is everything below it
+	if (!IsInside)
 	{
-		mPatchBoundsY.resize(mPatchQuadFaces);
+		ContainmentType containment = frustum.Contains(box);
 
-		// for each patch
-		for (UINT i = 0; i < mPatchQuadRows - 1; ++i)
+		if (containment == DISJOINT)
 		{
-			for (UINT j = 0; j < mPatchQuadCols - 1; ++j)
-			{
-				ComputePatchBoundsY(i, j);
-			}
+			return;
 		}
+
+		IsInside = containment == CONTAINS;
 	}
 
-	// build quad patch vertex buffer
+	if (level == 0)
 	{
-		std::vector<VertexData> vertices(mPatchQuadRows * mPatchQuadCols);
-
-		float HalfWidth = 0.5f * GetWidth();
-		float HalfDepth = 0.5f * GetDepth();
-
-		float PatchWidth = GetWidth() / (mPatchQuadCols - 1);
-		float PatchDepth = GetDepth() / (mPatchQuadRows - 1);
-		float du = 1.0f / (mPatchQuadCols - 1);
-		float dv = 1.0f / (mPatchQuadRows - 1);
-
-		for (UINT i = 0; i < mPatchQuadRows; ++i)
-		{
-			float z = +HalfDepth - i * PatchDepth;
+		patches.push_back(i * mPatchPyramid[0].mCols + j);
+		distances.push_back(distance(box));
+		return;
+	}
 
-			for (UINT j = 0; j < mPatchQuadCols; ++j)
-			{
-				float x = -HalfWidth + j * PatchWidth;
+	struct Child
+	{
+		UINT i;
+		UINT j;
+		float distance;
+	};
 
-				vertices[i * mPatchQuadCols + j].position = XMFLOAT3(x, 0, z);
+	const MinMaxLevel& child = mPatchPyramid[level - 1];
 
-				// stretch texture over grid
-				vertices[i * mPatchQuadCols + j].TexCoord.x = j * du;
-				vertices[i * mPatchQuadCols + j].TexCoord.y = i * dv;
-			}
-		}
+	Child children[4];
+	UINT count = 0;
 
-		// store axis-aligned bounding box y-bounds in upper-left patch corner
-		for (UINT i = 0; i < mPatchQuadRows - 1; ++i)
+	for (UINT m = 2 * i; m < std::min(2 * i + 2, child.mRows); ++m)
+	{
+		for (UINT n = 2 * j; n < std::min(2 * j + 2, child.mCols); ++n)
 		{
-			for (UINT j = 0; j < mPatchQuadCols - 1; ++j)
-			{
-				UINT index = i * (mPatchQuadCols - 1) + j;
-				vertices[i * mPatchQuadCols + j].BoundsY = mPatchBoundsY[index];
-			}
+			children[count++] = { m, n, distance(GetPatchNodeBox(level - 1, m, n)) };
 		}
-
-		D3D11_BUFFER_DESC desc;
-		desc.ByteWidth = sizeof(VertexData) * vertices.size();
-		desc.Usage = D3D11_USAGE_IMMUTABLE;
-		desc.BindFlags = D3D11_BIND_VERTEX_BUFFER;
-		desc.CPUAccessFlags = 0;
-		desc.MiscFlags = 0;
-		desc.StructureByteStride = 0;
-
-		D3D11_SUBRESOURCE_DATA InitData;
-		InitData.pSysMem = vertices.data();
-		InitData.SysMemPitch = 0;
-		InitData.SysMemSlicePitch = 0;
-
-		HR(device->CreateBuffer(&desc, &InitData, &mPatchQuadVB));
 	}
 
-	// build quad patch index buffer
+	// nearest first, so the list comes out roughly front to back
+	std::sort(children, children + count, [](const Child& a, const Child& b) { return a.distance < b.distance; });
+
+	for (UINT k = 0; k < count; ++k)
 	{
-		std::vector<UINT> indices(mPatchQuadFaces * 4); // 4 indices per quad face
+		CullPatchNode(frustum, eye, level - 1, children[k].i, children[k].j, IsInside, patches, distances);
+	}
+}
 
-		// iterate over each quad and compute indices
-		UINT k = 0;
+void TerrainObject::UpdateVisiblePatches(ID3D11DeviceContext* context, const CameraObject& camera)
+{
+	// the camera frustum is in view space and terrain local space is world space
+	XMMATRIX V = XMLoadFloat4x4(&camera.mView);
+	XMMATRIX InverseView = XMMatrixInverse(&XMMatrixDeterminant(V), V);
 
-		for (UINT i = 0; i < mPatchQuadRows - 1; ++i)
-		{
-			for (UINT j = 0; j < mPatchQuadCols - 1; ++j)
-			{
-				// rop row of 2x2 quad patch
-				indices[k + 0] = (i + 0) * mPatchQuadCols + j;
-				indices[k + 1] = (i + 0) * mPatchQuadCols + j + 1;
+	XMVECTOR S, R, T; // scale, rotate (quaternion), translate
+	XMMatrixDecompose(&S, &R, &T, InverseView);
 
-				// bottom row of 2x2 quad patch
-				indices[k + 2] = (i + 1) * mPatchQuadCols + j;
-				indices[k + 3] = (i + 1) * mPatchQuadCols + j + 1;
+	BoundingFrustum frustum;
+	camera.mFrustum.Transform(frustum, XMVectorGetX(S), R, T);
 
-				k += 4; // next quad
-			}
-		}
+	CullPatches(frustum, XMLoadFloat3(&camera.mPosition), mVisiblePatches, mVisiblePatchDistances);
 
-		D3D11_BUFFER_DESC desc;
-		desc.ByteWidth = sizeof(UINT) * indices.size();
-		desc.Usage = D3D11_USAGE_IMMUTABLE;
-		desc.BindFlags = D3D11_BIND_INDEX_BUFFER;
-		desc.CPUAccessFlags = 0;
-		desc.MiscFlags = 0;
-		desc.StructureByteStride = 0;
+	D3D11_MAPPED_SUBRESOURCE MappedData;
 
-		D3D11_SUBRESOURCE_DATA InitData;
-		InitData.pSysMem = indices.data();
-		InitData.SysMemPitch = 0;
-		InitData.SysMemSlicePitch = 0;
+	HR(context->Map(mVisiblePatchQuadIB, 0, D3D11_MAP_WRITE_DISCARD, 0, &MappedData));
 
-		HR(device->CreateBuffer(&desc, &InitData, &mPatchQuadIB));
-	}
+	UINT* indices = reinterpret_cast<UINT*>(MappedData.pData);
 
-	// build SRVs
+	// same 2x2 control points as the quad patch index buffer
+	for (UINT patch : mVisiblePatches)
 	{
-		// build height map SRV
-		{
-			D3D11_TEXTURE2D_DESC TextureDesc;
-			TextureDesc.Width = mInitInfo.HeightMapWidth;
-			TextureDesc.Height = mInitInfo.HeightMapDepth;
-			TextureDesc.MipLevels = 1;
-			TextureDesc.ArraySize = 1;
-			TextureDesc.Format = DXGI_FORMAT_R16_FLOAT;
-			TextureDesc.SampleDesc.Count = 1;
-			TextureDesc.SampleDesc.Quality = 0;
-			TextureDesc.Usage = D3D11_USAGE_DEFAULT;
-			TextureDesc.BindFlags = D3D11_BIND_SHADER_RESOURCE;
-			TextureDesc.CPUAccessFlags = 0;
-			TextureDesc.MiscFlags = 0;
+		UINT i = patch / (mPatchQuadCols - 1);
+		UINT j = patch % (mPatchQuadCols - 1);
 
-			std::vector<DirectX::PackedVector::HALF> HeightMap(mHeightMap.size());
+		*indices++ = (i + 0) * mPatchQuadCols + j;
+		*indices++ = (i + 0) * mPatchQuadCols + j + 1;
+		*indices++ = (i + 1) * mPatchQuadCols + j;
+		*indices++ = (i + 1) * mPatchQuadCols + j + 1;
+	}
 
-			std::transform(mHeightMap.begin(),
-						   mHeightMap.end(),
-						   HeightMap.begin(),
-						   DirectX::PackedVector::XMConvertFloatToHalf);
+	context->Unmap(mVisiblePatchQuadIB, 0);
 
-			D3D11_SUBRESOURCE_DATA InitData;
-			InitData.pSysMem = HeightMap.data();
-			InitData.SysMemPitch = mInitInfo.HeightMapWidth * sizeof(DirectX::PackedVector::HALF);
-			InitData.SysMemSlicePitch = 0;
+	mVisiblePatchQuadFaces = static_cast<UINT>(mVisiblePatches.size());
+}
 
-			ID3D11Texture2D* texture = nullptr;
-			HR(device->CreateTexture2D(&TextureDesc, &InitData, &texture));
+bool TerrainObject::Deform(const Brush& brush, D3D11_BOX& dirty)
+{
+	if (mHeightMap.empty() || brush.radius <= 0.0f)
+	{
+		return false;
+	}
 
-			D3D11_SHADER_RESOURCE_VIEW_DESC SRVDesc;
-			SRVDesc.Format = TextureDesc.Format;
-			SRVDesc.ViewDimension = D3D11_SRV_DIMENSION_TEXTURE2D;
-			SRVDesc.Texture2D.MostDetailedMip = 0;
-			SRVDesc.Texture2D.MipLevels = -1;
+	const int width = static_cast<int>(mInitInfo.HeightMapWidth);
+	const int depth = static_cast<int>(mInitInfo.HeightMapDepth);
 
-			HR(device->CreateShaderResourceView(texture, &SRVDesc, &mHeightMapSRV));
+	// same transform as GetHeight, from terrain local space to texels
+	const float col = (brush.x + 0.5f * GetWidth()) / +mInitInfo.CellSpacing;
+	const float row = (brush.z - 0.5f * GetDepth()) / -mInitInfo.CellSpacing;
+	const float radius = brush.radius / mInitInfo.CellSpacing;
 
-			SafeRelease(texture);
-		}
-		
-		// build layer and blend map SRVs
-		mLayerMapArraySRV = manager.CreateSRV(info.LayerMapFileName);
-		mBlendMapSRV = manager.CreateSRV(info.BlendMapFileName);
-	}
+	const int FirstRow = std::max(0, static_cast<int>(std::ceil(row - radius)));
+	const int FirstCol = std::max(0, static_cast<int>(std::ceil(col - radius)));
+	const int LastRow = std::min(depth - 1, static_cast<int>(std::floor(row + radius)));
+	const int LastCol = std::min(width - 1, static_cast<int>(std::floor(col + radius)));
 
-	// shaders
+	if (FirstRow > LastRow || FirstCol > LastCol)
 	{
-		// vertex shader
-		{
-			std::wstring path = L"TerrainVS.hlsl";
+		return false;
+	}
 
-			ID3DBlob* pCode;
-			HR(D3DCompileFromFile(path.c_str(), nullptr, nullptr, "main", "vs_5_0", 0, 0, &pCode, nullptr));
-			HR(device->CreateVertexShader(pCode->GetBufferPointer(), pCode->GetBufferSize(), nullptr, &mVertexShader));
+	const int rows = LastRow - FirstRow + 1;
+	const int cols = LastCol - FirstCol + 1;
 
-			// input layout
+	// smoothing reads the heights before this stamp, one texel around the rect included
+	std::vector<float> source;
+
+	if (brush.mode == BrushSmooth)
+	{
+		source.resize((rows + 2) * (cols + 2));
+
+		for (int i = 0; i < rows + 2; ++i)
+		{
+			for (int j = 0; j < cols + 2; ++j)
 			{
-				std::vector<D3D11_INPUT_ELEMENT_DESC> desc =
-				{
-					{"POSITION", 0, DXGI_FORMAT_R32G32B32_FLOAT, 0,  0, D3D11_INPUT_PER_VERTEX_DATA, 0},
-					{"TEXCOORD", 0, DXGI_FORMAT_R32G32_FLOAT,    0, 12, D3D11_INPUT_PER_VERTEX_DATA, 0},
-					{"TEXCOORD", 1, DXGI_FORMAT_R32G32_FLOAT,    0, 20, D3D11_INPUT_PER_VERTEX_DATA, 0}
-				};
+				int r = std::max(0, std::min(FirstRow + i - 1, depth - 1));
+				int c = std::max(0, std::min(FirstCol + j - 1, width - 1));
 
-				HR(device->CreateInputLayout(desc.data(), desc.size(), pCode->GetBufferPointer(), pCode->GetBufferSize(), &mInputLayout));
+				source[i * (cols + 2) + j] = mHeightMap[r * width + c];
 			}
 		}
+	}
 
-		// hull shader
+	for (int i = FirstRow; i <= LastRow; ++i)
+	{
+		for (int j = FirstCol; j <= LastCol; ++j)
 		{
-			std::wstring path = L"TerrainHS.hlsl";
+			const float dr = (i - row) / radius;
+			const float dc = (j - col) / radius;
+			const float d2 = dr * dr + dc * dc;
 
-			ID3DBlob* pCode;
-			HR(D3DCompileFromFile(path.c_str(), nullptr, nullptr, "main", "hs_5_0", 0, 0, &pCode, nullptr));
-			HR(device->CreateHullShader(pCode->GetBufferPointer(), pCode->GetBufferSize(), nullptr, &mHullShader));
-		}
+			if (d2 >= 1.0f)
+			{
+				continue;
+			}
 
-		// domain shader
-		{
-			std::wstring path = L"TerrainDS.hlsl";
+			// smooth falloff, 1 at the center and 0 with zero slope at the radius
+			const float weight = (1.0f - d2) * (1.0f - d2);
 
-			ID3DBlob* pCode;
-			HR(D3DCompileFromFile(path.c_str(), nullptr, nullptr, "main", "ds_5_0", 0, 0, &pCode, nullptr));
-			HR(device->CreateDomainShader(pCode->GetBufferPointer(), pCode->GetBufferSize(), nullptr, &mDomainShader));
-		}
+			float& h = mHeightMap[i * width + j];
 
-		// pixel shader
-		{
-			std::wstring path = L"TerrainPS.hlsl";
+			switch (brush.mode)
+			{
+			case BrushAdd:
+				h += brush.strength * weight;
+				break;
 
-			std::vector<D3D_SHADER_MACRO> defines;
-			defines.push_back({ "ENABLE_TEXTURE",         "0" });
-			defines.push_back({ "ENABLE_SPHERE_TEXCOORD", "0" });
-			defines.push_back({ "ENABLE_NORMAL_MAPPING",  "0" });
-			defines.push_back({ "ENABLE_ALPHA_CLIPPING",  "0" });
-			//defines.push_back({ "ENABLE_LIGHTING",       "1" });
-			defines.push_back({ "ENABLE_REFLECTION",      "0" });
-			defines.push_back({ "ENABLE_FOG",             "0" });
-			defines.push_back({ nullptr, nullptr });
+			case BrushFlatten:
+				h += (brush.height - h) * std::min(brush.strength * weight, 1.0f);
+				break;
 
-			ID3DBlob* pCode;
-			HR(D3DCompileFromFile(path.c_str(), defines.data(), nullptr, "main", "ps_5_0", 0, 0, &pCode, nullptr));
-			HR(device->CreatePixelShader(pCode->GetBufferPointer(), pCode->GetBufferSize(), nullptr, &mPixelShader));
-		}
-	}
+			case BrushSmooth:
+			{
+				const float* center = &source[(i - FirstRow + 1) * (cols + 2) + (j - FirstCol + 1)];
 
-	// heightmap sampler state
-	{
-		D3D11_SAMPLER_DESC desc;
-		desc.Filter = D3D11_FILTER_MIN_MAG_LINEAR_MIP_POINT;
-		desc.AddressU = D3D11_TEXTURE_ADDRESS_BORDER;
-		desc.AddressV = D3D11_TEXTURE_ADDRESS_BORDER;
-		desc.AddressW = D3D11_TEXTURE_ADDRESS_WRAP;
-		desc.MipLODBias = 0;
-		desc.MaxAnisotropy = 1;
-		desc.ComparisonFunc = D3D11_COMPARISON_NEVER;
-		ZeroMemory(desc.BorderColor, sizeof(desc.BorderColor));
-		desc.MinLOD = 0;
-		desc.MaxLOD = 0;
+				float sum = 0.0f;
 
-		HR(device->CreateSamplerState(&desc, &mHeightMapSS));
+				for (int m = -1; m <= 1; ++m)
+				{
+					for (int n = -1; n <= 1; ++n)
+					{
+						sum += center[m * (cols + 2) + n];
+					}
+				}
+
+				h += (sum / 9.0f - h) * std::min(brush.strength * weight, 1.0f);
+				break;
+			}
+			}
+		}
 	}
-}
 
-void TerrainObject::LoadHeightMap(TextureManager& manager)
-{
-	UINT HeightMapSize = mInitInfo.HeightMapWidth * mInitInfo.HeightMapDepth;
-	std::vector<unsigned char> HeightMap(HeightMapSize);
+	dirty.left = FirstCol;
+	dirty.top = FirstRow;
+	dirty.front = 0;
+	dirty.right = LastCol + 1;
+	dirty.bottom = LastRow + 1;
+	dirty.back = 1;
 
-	std::wstring path = manager.mTextureFolder + mInitInfo.HeightMapFileName;
+	UpdateMinMaxPyramid(FirstRow, FirstCol, LastRow, LastCol);
 
-	std::ifstream ifs;
-	ifs.open(path.c_str(), std::ios_base::binary);
+	UINT PatchRow0, PatchCol0, PatchRow1, PatchCol1;
 
-	if (ifs)
+	if (GetDirtyPatches(dirty, PatchRow0, PatchCol0, PatchRow1, PatchCol1))
 	{
-		ifs.read((char*)HeightMap.data(), (std::streamsize)HeightMap.size());
-		ifs.close();
+		UpdatePatchPyramid(PatchRow0, PatchCol0, PatchRow1, PatchCol1);
 	}
 
-	// copy the raw data into a float array and scale it
-	mHeightMap.resize(HeightMapSize, 0);
-	for (UINT i = 0; i < HeightMapSize; ++i)
-	{
-		mHeightMap[i] = (HeightMap[i] / 255.0f) * mInitInfo.HeightScale;
-	}
+	// a normal depends on the heights around it, UploadDeformation widens dirty the same way
+	BakeMaps(FirstRow > 0 ? FirstRow - 1 : 0, FirstCol > 0 ? FirstCol - 1 : 0, LastRow + 1, LastCol + 1);
+
+	return true;
 }
 
-void TerrainObject::SmoothHeightMap()
+void TerrainObject::UploadDeformation(ID3D11DeviceContext* context, const D3D11_BOX& dirty)
 {
-	std::vector<float> HeightMap(mHeightMap.size());
+	const UINT width = mInitInfo.HeightMapWidth;
+	const UINT cols = dirty.right - dirty.left;
 
-	for (UINT i = 0; i < mInitInfo.HeightMapDepth; ++i)
+	// heights
 	{
-		for (UINT j = 0; j < mInitInfo.HeightMapWidth; ++j)
+		std::vector<DirectX::PackedVector::HALF> HeightMap(cols * (dirty.bottom - dirty.top));
+
+		for (UINT i = dirty.top; i < dirty.bottom; ++i)
 		{
-			HeightMap[i * mInitInfo.HeightMapWidth + j] = average(i, j);
+			std::transform(mHeightMap.begin() + i * width + dirty.left,
+						   mHeightMap.begin() + i * width + dirty.right,
+						   HeightMap.begin() + (i - dirty.top) * cols,
+						   DirectX::PackedVector::XMConvertFloatToHalf);
 		}
-	}
 
-	// replace the old heightmap with the filtered one
-	mHeightMap = HeightMap;
-}
-
-bool TerrainObject::IsInBounds(int i, int j)
-{
-	// true if ij are valid indices, false otherwise
-	return i >= 0 && i < (int)mInitInfo.HeightMapDepth && j >= 0 && j < (int)mInitInfo.HeightMapWidth;
-}
-float TerrainObject::average(int i, int j)
-{
-	// average height of the ij element -> average ij with its eight neighbor pixels
-	// if a pixel is missing neighbor, we don't include it in the average
-	//
-	// ----------
-	// | 1| 2| 3|
-	// ----------
-	// | 4|ij| 6|
-	// ----------
-	// | 7| 8| 9|
-	// ----------
+		context->UpdateSubresource(mHeightMapTexture, 0, &dirty, HeightMap.data(), cols * sizeof(DirectX::PackedVector::HALF), 0);
+	}
 
-	float average = 0.0f;
-	float count = 0.0f;
+	// patch bounds, stored in the upper-left corner of each patch
+	UINT FirstRow, FirstCol, LastRow, LastCol;
 
-	// use int to allow negatives -> UINT overflow
-	for (int m = i - 1; m <= i + 1; ++m)
+	if (GetDirtyPatches(dirty, FirstRow, FirstCol, LastRow, LastCol))
 	{
-		for (int n = j - 1; n <= j + 1; ++n)
+		for (UINT i = FirstRow; i <= LastRow; ++i)
 		{
-			if (IsInBounds(m, n))
+			for (UINT j = FirstCol; j <= LastCol; ++j)
 			{
-				average += mHeightMap[m * mInitInfo.HeightMapWidth + n];
-				++count;
+				mPatchQuadVertexData[i * mPatchQuadCols + j].BoundsY = GetPatchBoundsY(i, j);
 			}
+
+			// one run of vertices per patch row
+			D3D11_BOX box;
+			box.left = (i * mPatchQuadCols + FirstCol) * sizeof(VertexData);
+			box.right = (i * mPatchQuadCols + LastCol + 1) * sizeof(VertexData);
+			box.top = 0;
+			box.bottom = 1;
+			box.front = 0;
+			box.back = 1;
+
+			context->UpdateSubresource(mPatchQuadVB, 0, &box, &mPatchQuadVertexData[i * mPatchQuadCols + FirstCol], 0, 0);
 		}
 	}
 
-	return average / count;
-}
-
-void TerrainObject::ComputePatchBoundsY(UINT i, UINT j)
-{
-	// scan the heightmap values this patch covers and compute the min/max height
+	// baked maps, one texel wider than the heights on each side (see Deform)
+	{
+		D3D11_BOX box = dirty;
+		box.left = dirty.left > 0 ? dirty.left - 1 : 0;
+		box.top = dirty.top > 0 ? dirty.top - 1 : 0;
+		box.right = std::min(dirty.right + 1, width);
+		box.bottom = std::min(dirty.bottom + 1, mInitInfo.HeightMapDepth);
 
-	UINT x0 = j * CellsPerPatch;
-	UINT x1 = (j + 1) * CellsPerPatch;
+		const UINT offset = box.top * width + box.left;
 
-	UINT y0 = i * CellsPerPatch;
-	UINT y1 = (i + 1) * CellsPerPatch;
+		context->UpdateSubresource(mNormalMapTexture, 0, &box, &mNormalMap[offset], width * sizeof(DirectX::PackedVector::XMBYTEN4), 0);
 
-	float MinY = +FLT_MAX;
-	float MaxY = -FLT_MAX;
-	for (UINT y = y0; y <= y1; ++y)
-	{
-		for (UINT x = x0; x <= x1; ++x)
+		if (mBlendMapTexture)
 		{
-			UINT k = y * mInitInfo.HeightMapWidth + x;
-			MinY = std::min(MinY, mHeightMap[k]);
-			MaxY = std::max(MaxY, mHeightMap[k]);
+			context->UpdateSubresource(mBlendMapTexture, 0, &box, &mBlendMap[offset], width * sizeof(DirectX::PackedVector::XMUBYTEN4), 0);
 		}
 	}
+}
+
+void TerrainObject::GetPatchRange(UINT texel, UINT patches, UINT& first, UINT& last)
+{
+	first = (texel % CellsPerPatch == 0 && texel > 0) ? texel / CellsPerPatch - 1 : texel / CellsPerPatch;
+	last = std::min(texel / CellsPerPatch, patches - 1);
+}
+
+bool TerrainObject::GetDirtyPatches(const D3D11_BOX& dirty, UINT& FirstRow, UINT& FirstCol, UINT& LastRow, UINT& LastCol) const
+{
+	if (mPatchQuadFaces == 0)
+	{
+		return false;
+	}
+
+	UINT first, last;
+
+	GetPatchRange(dirty.top, mPatchQuadRows - 1, FirstRow, last);
+	GetPatchRange(dirty.bottom - 1, mPatchQuadRows - 1, first, LastRow);
+	GetPatchRange(dirty.left, mPatchQuadCols - 1, FirstCol, last);
+	GetPatchRange(dirty.right - 1, mPatchQuadCols - 1, first, LastCol);
 
-	UINT index = i * (mPatchQuadCols - 1) + j;
-	mPatchBoundsY[index] = XMFLOAT2(MinY, MaxY);
+	return FirstRow <= LastRow && FirstCol <= LastCol;
 }
 
 ParticleSystem::ParticleSystem() :
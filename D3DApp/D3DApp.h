@@ -9,6 +9,13 @@
 #include <vector>
 #include <array>
 #include <map>
+#include <deque>
+#include <memory>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
 
 #include <glfw3.h>
 #define GLFW_EXPOSE_NATIVE_WIN32
@@ -18,6 +25,7 @@
 #include <DirectXMath.h>
 #include <DirectXColors.h>
 #include <DirectXCollision.h>
+#include <DirectXPackedVector.h>
 using namespace DirectX;
 
 #include <d3dcompiler.h>
@@ -81,6 +89,44 @@ public:
 	void Tick();
 };
 
+class ThreadPool
+{
+	// each thread owns a queue, pops from its front and steals from the back of the others
+	struct TaskQueue
+	{
+		std::mutex mMutex;
+		std::deque<UINT> mTasks;
+	};
+
+	std::vector<std::thread> mThreads;
+	std::vector<std::unique_ptr<TaskQueue>> mQueues; // workers + calling thread
+
+	const std::function<void(UINT)>* mTask;
+	std::atomic<UINT> mPendingTasks;
+
+	std::mutex mDispatchMutex;
+	std::mutex mMutex;
+	std::condition_variable mWakeCV;
+	std::condition_variable mDoneCV;
+	UINT mGeneration;
+	bool mQuit;
+
+	void WorkerLoop(UINT index);
+	void RunTasks(UINT index);
+	bool PopTask(UINT index, UINT& task);
+	bool StealTask(UINT index, UINT& task);
+
+public:
+	// 0 = one thread per hardware thread, the calling thread counts as one of them
+	ThreadPool(UINT threads = 0);
+	~ThreadPool();
+
+	UINT GetThreadCount() const { return static_cast<UINT>(mQueues.size()); }
+
+	// run task(i) for every i in [0, count) and wait, not reentrant from inside a task
+	void ParallelFor(UINT count, const std::function<void(UINT)>& task);
+};
+
 class CameraObject
 {
 public:
@@ -241,6 +287,30 @@ public:
 
 		BoundingBox mAABB;
 
+		// vertex -> triangle adjacency in CSR form, built once and kept across recomputes
+		// of deforming meshes, call BuildAdjacency again if the indices change
+		struct Adjacency
+		{
+			// triangles around vertex v are mTriangles[mOffsets[v], mOffsets[v + 1])
+			std::vector<UINT> mOffsets;
+			std::vector<UINT> mTriangles;
+			// per triangle scratch, cross product of two edges
+			std::vector<XMFLOAT3> mFaceNormals;
+		};
+
+		Adjacency mAdjacency;
+
+		enum NormalWeight
+		{
+			AreaWeighted,
+			AngleWeighted,
+			Unweighted
+		};
+
+		void BuildAdjacency();
+		// gather per vertex, runs over vertex ranges on the pool if one is given
+		void ComputeNormals(NormalWeight weight, ThreadPool* pool = nullptr);
+
 		void ComputeNormals() { ComputeNormals(mVertices, mIndices); };
 		static void ComputeNormals(
 			std::vector<Vertex>& vertices,
@@ -265,6 +335,16 @@ public:
 
 	static void CreateScreenQuad(Mesh& mesh);
 
+	// the attributes depth only passes read, each in its own stream
+	struct SplitStreams
+	{
+		std::vector<XMFLOAT3> mPositions;
+		std::vector<XMFLOAT2> mTexCoords;
+		std::vector<XMFLOAT3> mNormals;
+	};
+
+	static void SplitVertexStreams(const std::vector<Vertex>& vertices, SplitStreams& streams);
+
 	class Waves
 	{
 	public:
@@ -272,12 +352,23 @@ public:
 		~Waves();
 
 		void Init(UINT m, UINT n, float dx, float dt, float speed, float damping);
+		// fixed time step, takes as many steps as fit in the accumulated time and keeps the rest
 		void Update(float dt);
+		void Step(UINT count = 1);
 		void Disturb(UINT i, UINT j, float magnitude);
 
 		// void CreateIndices(std::vector<UINT>& indices);
 
-		const Vertex& operator[](int i) const { return mCurrVertices.at(i); }
+		// vertices are built on demand from the height field
+		Vertex operator[](int i) const;
+		void GetVertices(std::vector<Vertex>& vertices) const;
+		void GetVertices(Vertex* vertices, UINT first, UINT count) const;
+
+		float GetHeight(UINT i, UINT j) const { return mCurrHeights[i * mCols + j]; }
+
+		// [first, last) row ranges whose vertices changed since the last ClearDirtyRows
+		void GetDirtyRows(std::vector<std::pair<UINT, UINT>>& rows) const;
+		void ClearDirtyRows();
 
 		UINT mRows;
 		UINT mCols;
@@ -287,8 +378,47 @@ public:
 		float mTimeStep;
 		float mSpaceStep;
 
-		std::vector<Vertex> mPrevVertices;
-		std::vector<Vertex> mCurrVertices;
+		// the grid is split in mTileSize x mTileSize tiles (set before Init),
+		// a tile whose heights all stay below mSleepEpsilon is flattened and no longer stepped
+		UINT mTileSize;
+		float mSleepEpsilon;
+
+		// if set, rows of tiles are updated in parallel on the pool
+		ThreadPool* mThreadPool;
+
+		// serial multi-step runs up to mTemporalBlock steps per sweep over the grid
+		UINT mTemporalBlock;
+		// time beyond mMaxStepsPerUpdate steps is dropped, so a long frame cannot stall the next ones
+		UINT mMaxStepsPerUpdate;
+
+	private:
+		float mAccumulatedTime;
+
+		void StepTiles(UINT steps);
+		void StepWavefront(UINT steps);
+		void ForEachTileRow(const std::function<void(UINT)>& func);
+		void GetTileRect(UINT ti, UINT tj, UINT& FirstRow, UINT& LastRow, UINT& FirstCol, UINT& LastCol) const;
+		bool IsTileNear(const std::vector<BYTE>& flags, UINT ti, UINT tj) const;
+		void WakeTile(UINT i, UINT j);
+
+		// [FirstRow, LastRow) x [FirstCol, LastCol), border rows/cols are never updated
+		void StepHeights(float* PrevHeights, const float* CurrHeights, UINT FirstRow, UINT LastRow, UINT FirstCol, UINT LastCol);
+		void ComputeNormals(const float* heights, UINT FirstRow, UINT LastRow, UINT FirstCol, UINT LastCol);
+
+		// structure of arrays, prev/curr heights are swapped by pointer
+		std::vector<float> mPrevHeights;
+		std::vector<float> mCurrHeights;
+		// normal y is always 2 * mSpaceStep
+		std::vector<float> mNormalsX;
+		std::vector<float> mNormalsZ;
+
+		// per tile flags, BYTE rather than bool since tile rows are written concurrently
+		UINT mTileRows;
+		UINT mTileCols;
+		std::vector<BYTE> mTileActive;
+		std::vector<BYTE> mTileStepped;
+		std::vector<BYTE> mTileFlattened;
+		std::vector<BYTE> mDirtyTileRows;
 	};
 };
 
@@ -336,12 +466,30 @@ public:
 	float mCurrTime;
 
 	AnimationObject() :
-		mCurrTime(0)
+		mCurrTime(0),
+		mInvKeyInterval(0)
 	{}
 
 	float GetTimeStart() const;
 	float GetTimeEnd() const;
 	void interpolate(float t, XMMATRIX& world) const;
+	// cursor is the keyframe the last call with it started from, 0 at first;
+	// playback usually stays in the same pair of keyframes or moves to the next one
+	void interpolate(float t, XMMATRIX& world, UINT& cursor) const;
+	// the scale, rotation and translation interpolate builds world from
+	void interpolate(float t, XMVECTOR& S, XMVECTOR& R, XMVECTOR& T, UINT& cursor) const;
+
+	// call after changing the keyframes, lookups are O(1) if they are evenly spaced
+	void UpdateKeyInterval();
+	// evenly spaced keyframes at most interval seconds apart from the first one to the last one
+	void resample(float interval);
+
+private:
+	// i such that keyframes[i].time <= t < keyframes[i + 1].time, t strictly inside the keyframes
+	UINT FindKeyFrame(float t, UINT cursor) const;
+
+	// 1 / time between keyframes if evenly spaced, 0 otherwise
+	float mInvKeyInterval;
 };
 
 class AnimationClip
@@ -350,25 +498,206 @@ public:
 	// an AnimationObject for every bone
 	std::vector<AnimationObject> mAnimationObjects;
 
-	float GetTimeClipStart() const;
-	float GetTimeClipEnd() const;
+	AnimationClip() :
+		mTimeClipStart(0),
+		mTimeClipEnd(0)
+	{}
+
+	// cached, call UpdateTimeClip after changing the keyframes (it also calls UpdateKeyInterval)
+	float GetTimeClipStart() const { return mTimeClipStart; }
+	float GetTimeClipEnd() const { return mTimeClipEnd; }
+	void UpdateTimeClip();
+
+	// AnimationObject::resample on every bone
+	void resample(float interval);
+
+	// transforms has room for one matrix per bone, cursors is null or has one cursor per bone
+	// (see AnimationObject::interpolate)
+	void interpolate(float t, XMMATRIX* transforms, UINT* cursors = nullptr) const;
 	void interpolate(float t, std::vector<XMMATRIX>& transforms) const;
+
+private:
+	float mTimeClipStart;
+	float mTimeClipEnd;
+};
+
+// an AnimationClip baked for playback, all bones share one list of key times so a pose needs
+// a single keyframe lookup, and the keys are stored as SoA streams of 4 bones evaluated together
+class BakedAnimationClip
+{
+public:
+	BakedAnimationClip() :
+		mBoneCount(0),
+		mGroupCount(0),
+		mInvKeyInterval(0),
+		mIsResampled(false)
+	{}
+
+	// keyframes at the key times of all the bones, which is exact; with an interval > 0, all bones
+	// are resampled evenly at most interval seconds apart instead if that takes fewer keyframes
+	void bake(const AnimationClip& clip, float interval = 0.0f);
+
+	float GetTimeClipStart() const { return mTimes.front(); }
+	float GetTimeClipEnd() const { return mTimes.back(); }
+	UINT GetBoneCount() const { return mBoneCount; }
+	bool IsResampled() const { return mIsResampled; }
+
+	// same result as AnimationClip::interpolate up to rounding, or to the resampling error,
+	// cursor is the keyframe the last call with it started from, 0 at first
+	void interpolate(float t, XMMATRIX* transforms, UINT& cursor) const;
+
+	// the keyframes around t in count sorted times and the weight of b, a = b at the ends;
+	// InvKeyInterval is 1 / time between keyframes if evenly spaced, 0 otherwise
+	static void GetKeyPair(const float* times, UINT count, float InvKeyInterval, float t, UINT& cursor, UINT& a, UINT& b, float& x);
+
+private:
+	// per frame and group of 4 bones, one vector per component
+	enum Stream
+	{
+		StreamTX, StreamTY, StreamTZ,
+		StreamSX, StreamSY, StreamSZ,
+		StreamQX, StreamQY, StreamQZ, StreamQW,
+		StreamCount
+	};
+
+	const XMVECTOR* GetKeys(UINT frame, UINT group) const { return &mKeys[(frame * mGroupCount + group) * StreamCount]; }
+
+	UINT mBoneCount;
+	UINT mGroupCount;
+
+	std::vector<float> mTimes;
+	// 1 / time between keyframes if evenly spaced, 0 otherwise
+	float mInvKeyInterval;
+	bool mIsResampled;
+
+	std::vector<XMVECTOR> mKeys;
+};
+
+// an AnimationClip made smaller: each bone keeps only the keyframes it can't interpolate from
+// the others, rotations take 48 bits (smallest three) and translations or scales that don't
+// change are stored once
+class CompressedAnimationClip
+{
+public:
+	// sizes in bytes, largest differences to the source at its key times and halfway between them
+	struct Report
+	{
+		size_t mSourceBytes;
+		size_t mCompressedBytes;
+		float mMaxTranslationError;
+		float mMaxRotationError; // radians
+		float mMaxScaleError;
+	};
+
+	CompressedAnimationClip() :
+		mTimeClipStart(0),
+		mTimeClipEnd(0)
+	{}
+
+	// a keyframe is removed if interpolating the ones kept around it, with the quantized rotations,
+	// reproduces it within the max errors; rotation errors are in radians
+	Report compress(const AnimationClip& clip, float MaxTranslationError = 0.001f, float MaxRotationError = 0.001f, float MaxScaleError = 0.001f);
+
+	float GetTimeClipStart() const { return mTimeClipStart; }
+	float GetTimeClipEnd() const { return mTimeClipEnd; }
+	UINT GetBoneCount() const { return static_cast<UINT>(mTracks.size()); }
+
+	// transforms and cursors as AnimationClip::interpolate
+	void interpolate(float t, XMMATRIX* transforms, UINT* cursors = nullptr) const;
+
+private:
+	// 2 bits for the index of the largest component, 15 bits for each of the other three
+	struct Rotation
+	{
+		USHORT mBits[3];
+	};
+
+	static Rotation EncodeRotation(FXMVECTOR Q);
+	static XMVECTOR DecodeRotation(const Rotation& rotation);
+
+	struct Track
+	{
+		// in mTimes and mRotations
+		UINT mFirstKey;
+		UINT mKeyCount;
+		// in mVectors, a stride of 0 for a constant channel
+		UINT mTranslation;
+		UINT mTranslationStride;
+		UINT mScale;
+		UINT mScaleStride;
+	};
+
+	void interpolate(const Track& track, float t, UINT& cursor, XMVECTOR& S, XMVECTOR& R, XMVECTOR& T) const;
+
+	float mTimeClipStart;
+	float mTimeClipEnd;
+
+	std::vector<Track> mTracks;
+	std::vector<float> mTimes;
+	std::vector<Rotation> mRotations;
+	std::vector<XMFLOAT3> mVectors;
 };
 
 class SkinnedObject
 {
 public:
+	// index into mAnimationClips, resolved once with FindClip instead of looking the name up every frame
+	typedef UINT ClipHandle;
+	static const ClipHandle InvalidClip = UINT(-1);
+
+	// caller owned, grows to the largest skeleton it's used with and is then reused,
+	// so GetTransforms doesn't allocate; one per thread
+	struct Scratch
+	{
+		std::vector<XMMATRIX> mToParentTransforms;
+		std::vector<XMMATRIX> mToRootTransforms;
+	};
+
 	// parent index of ith bone
 	std::vector<UINT> mBoneHierarchy;
 	std::vector<XMFLOAT4X4> mBoneOffsets;
-	std::map<std::string, AnimationClip> mAnimationClips;
-
-	float GetTimeClipStart(const std::string& ClipName);
-	float GetTimeClipEnd(const std::string& ClipName);
+	std::vector<AnimationClip> mAnimationClips;
+	std::map<std::string, ClipHandle> mAnimationClipHandles;
+	// at most one of them is filled, one per clip; GetTransforms plays those instead of mAnimationClips
+	std::vector<BakedAnimationClip> mBakedAnimationClips;
+	std::vector<CompressedAnimationClip> mCompressedAnimationClips;
+
+	UINT GetBoneCount() const { return static_cast<UINT>(mBoneOffsets.size()); }
+
+	// InvalidClip if there's no clip with this name
+	ClipHandle FindClip(const std::string& ClipName) const;
+
+	// false once CompressAnimationClips released the keyframes of mAnimationClips
+	bool HasKeyFrames() const;
+
+	// see BakedAnimationClip::bake, drops the compressed clips; needs the keyframes
+	void BakeAnimationClips(float interval = 0.0f);
+	// see CompressedAnimationClip::compress, drops the baked clips and returns the report of each clip
+	// by name; needs the keyframes and, unless IsSourceKept, releases them as AnimationClip::interpolate,
+	// resample and UpdateTimeClip are no longer needed
+	std::map<std::string, CompressedAnimationClip::Report> CompressAnimationClips(float MaxTranslationError = 0.001f,
+																				  float MaxRotationError = 0.001f,
+																				  float MaxScaleError = 0.001f,
+																				  bool IsSourceKept = false);
+
+	float GetTimeClipStart(ClipHandle clip) const { return mAnimationClips[clip].GetTimeClipStart(); }
+	float GetTimeClipEnd(ClipHandle clip) const { return mAnimationClips[clip].GetTimeClipEnd(); }
+	float GetTimeClipStart(const std::string& ClipName) const;
+	float GetTimeClipEnd(const std::string& ClipName) const;
+
+	// transforms has room for GetBoneCount() matrices, cursors is null or
+	// has one per bone kept between calls for the same clip (see AnimationObject::interpolate),
+	// baked clips only use the first one
+	void GetTransforms(ClipHandle clip,
+					   float t,
+					   Scratch& scratch,
+					   XMFLOAT4X4* transforms,
+					   UINT* cursors = nullptr) const;
 
+	// allocates, for one-off queries
 	void GetTransforms(const std::string& animation,
 					   float t,
-					   std::vector<XMFLOAT4X4>& transforms);
+					   std::vector<XMFLOAT4X4>& transforms) const;
 };
 
 struct Subset
@@ -388,6 +717,123 @@ struct Subset
 	{}
 };
 
+class MeshOptimizer
+{
+public:
+	struct CacheStats
+	{
+		float ACMR; // vertex shader invocations per triangle
+		float ATVR; // vertex shader invocations per referenced vertex
+
+		CacheStats() :
+			ACMR(0),
+			ATVR(0)
+		{}
+	};
+
+	// FIFO post-transform cache simulation, the cache is flushed between subsets (draw calls)
+	static CacheStats ComputeCacheStats(const std::vector<UINT>& indices, UINT VertexCount, const std::vector<Subset>& subsets, UINT CacheSize = 16);
+
+	// Tipsify (Sander, Nehab, Barczak 2007), triangles are reordered within their own subset
+	static void OptimizeVertexCache(std::vector<UINT>& indices, UINT VertexCount, const std::vector<Subset>& subsets, UINT CacheSize = 16);
+
+	// vertices are renumbered in first-use order within their subset vertex range
+	static void OptimizeVertexFetch(std::vector<GeometryGenerator::Vertex>& vertices, std::vector<UINT>& indices, const std::vector<Subset>& subsets);
+
+	// an empty subset list stands for a single subset covering the whole mesh
+	static void Optimize(GeometryGenerator::Mesh& mesh, const std::vector<Subset>& subsets, CacheStats* before = nullptr, CacheStats* after = nullptr);
+
+private:
+	static std::vector<Subset> GetSubsets(UINT VertexCount, UINT IndexCount, const std::vector<Subset>& subsets);
+};
+
+// compact vertex layouts, 20 bytes per static vertex and 28 per skinned one instead of sizeof(Vertex):
+//   POSITION    R16G16B16A16_UNORM quantized to the mesh bounds, or R32G32B32_FLOAT if that is too coarse
+//   NORMAL      R16G16_SNORM octahedral
+//   TANGENT     R16G16_SNORM octahedral
+//   TEXCOORD    R16G16_FLOAT, or R32G32_FLOAT if that is too coarse
+//   WEIGHTS     R8G8B8A8_UNORM, the four weights sum to exactly 255
+//   BONEINDICES R8G8B8A8_UINT
+// quantized positions decode with GetDequantizeMatrix, which can be folded into the world matrix;
+// octahedral vectors decode in the vertex shader as
+//   float3 n = float3(e.xy, 1.0f - abs(e.x) - abs(e.y));
+//   if (n.z < 0.0f) n.xy = (1.0f - abs(n.yx)) * (n.xy >= 0.0f ? 1.0f : -1.0f);
+//   n = normalize(n);
+class VertexPacker
+{
+public:
+	struct PackedMesh
+	{
+		std::vector<BYTE> mVertices;
+		UINT mStride;
+		std::vector<D3D11_INPUT_ELEMENT_DESC> mInputLayout;
+
+		bool mIsPositionQuantized;
+		bool mIsTexCoordHalf;
+		bool mIsSkinned;
+
+		// position = mPositionOffset + mPositionScale * stored, stored in [0, 1] as the unorm the vertex shader reads
+		XMFLOAT3 mPositionOffset;
+		XMFLOAT3 mPositionScale;
+
+		PackedMesh() :
+			mStride(0),
+			mIsPositionQuantized(false),
+			mIsTexCoordHalf(false),
+			mIsSkinned(false),
+			mPositionOffset(0, 0, 0),
+			mPositionScale(1, 1, 1)
+		{}
+
+		XMMATRIX GetDequantizeMatrix() const;
+	};
+
+	// the compact encodings are used only if their round trip error stays within the given bounds,
+	// position error is in object space units
+	static void Pack(const GeometryGenerator::Mesh& mesh,
+					 bool skinned,
+					 PackedMesh& packed,
+					 float MaxPositionError = 1e-3f,
+					 float MaxTexCoordError = 1.0f / 4096.0f);
+
+	static void Unpack(const PackedMesh& packed, std::vector<GeometryGenerator::Vertex>& vertices);
+
+	// two snorm16, x in the low half
+	static UINT EncodeOctahedral(const XMFLOAT3& v);
+	static XMFLOAT3 DecodeOctahedral(UINT e);
+};
+
+class MeshSimplifier
+{
+	struct Quadric
+	{
+		// symmetric 4x4 matrix, upper triangle row by row, and the total plane weight
+		double q[10];
+		double weight;
+
+		Quadric();
+		Quadric(double a, double b, double c, double d, double w);
+
+		Quadric& operator+=(const Quadric& other);
+		double evaluate(const XMFLOAT3& p) const;
+	};
+
+	// closest point by the Voronoi region of p (Ericson 2005, 5.1.5)
+	static float DistanceToTriangle(FXMVECTOR p, FXMVECTOR a, FXMVECTOR b, GXMVECTOR c);
+
+public:
+	// quadric error metric (Garland, Heckbert 1997) with half-edge collapses, so surviving vertices keep
+	// all their attributes; vertices sharing a position collapse together and a seam only along itself,
+	// vertices on borders and subset boundaries are never removed; every vertex of mesh is tracked on a
+	// triangle of the simplified mesh, returns the largest object space distance between them, an upper
+	// bound of the one-sided Hausdorff distance from the vertices of mesh to the simplified surface
+	static float Simplify(const GeometryGenerator::Mesh& mesh,
+						  const std::vector<Subset>& subsets,
+						  UINT TargetTriangles,
+						  GeometryGenerator::Mesh& simplified,
+						  std::vector<Subset>& SimplifiedSubsets);
+};
+
 class GameObject
 {
 public:
@@ -445,6 +891,31 @@ public:
 	bool mIsSkinned;
 	SkinnedObject mSkinnedData;
 
+	// split streams for the shadow map and SSAO normal depth passes of static objects,
+	// slot 0 positions, slot 1 texcoords, slot 2 normals; shared and based at mVertexStart like mVertexBuffer
+	std::array<Microsoft::WRL::ComPtr<ID3D11Buffer>, 3> mSplitVertexBuffers;
+
+	struct LevelOfDetail
+	{
+		GeometryGenerator::Mesh mMesh;
+		std::vector<Subset> mSubsets;
+		float mError; // object space, no vertex of mMesh is farther from this level
+	};
+
+	// triangle and vertex counts of mMesh and of a level
+	struct LODReport
+	{
+		UINT mSourceTriangles;
+		UINT mSourceVertices;
+		UINT mTriangles;
+		UINT mVertices;
+		float mError;
+	};
+
+	// level k is mLODs[k - 1], level 0 is mMesh itself
+	std::vector<LevelOfDetail> mLODs;
+	BoundingSphere mLODBounds;
+
 	GameObject() :
 		mVertexBuffer(nullptr),
 		mIndexBuffer(nullptr),
@@ -488,7 +959,25 @@ public:
 		SafeRelease((*mDepthStencilState.GetAddressOf()));
 	}
 
-	void LoadModel(ID3D11Device* device, TextureManager& manager, const std::string& filename, bool skinned = false);
+	// see Model3DLoader::load
+	void LoadModel(ID3D11Device* device, TextureManager& manager, const std::string& filename, bool skinned = false,
+				   MeshOptimizer::CacheStats* before = nullptr, MeshOptimizer::CacheStats* after = nullptr);
+
+	static void CreateSplitVertexBuffers(ID3D11Device* device,
+										 const std::vector<GeometryGenerator::Vertex>& vertices,
+										 std::array<Microsoft::WRL::ComPtr<ID3D11Buffer>, 3>& buffers);
+
+	bool HasSplitVertexBuffers() const { return mSplitVertexBuffers[0] != nullptr && !mIsSkinned; }
+
+	// texcoords are fetched once through a zero stride unless the subset is alpha clipped,
+	// normals are bound for the SSAO normal depth pass only
+	void SetSplitVertexBuffers(ID3D11DeviceContext* context, bool IsAlphaClipping, bool normals) const;
+
+	// each level keeps about ratio of the triangles of the previous one and is simplified from mMesh,
+	// stops early once a level can't be reduced further; one report per level built
+	std::vector<LODReport> BuildLODs(UINT levels, float ratio = 0.5f);
+	// coarsest level whose error projects to at most MaxPixelError pixels on a ScreenHeight pixels tall viewport
+	UINT SelectLOD(const CameraObject& camera, float ScreenHeight, float MaxPixelError = 1.0f) const;
 };
 
 struct GameObjectInstance
@@ -498,15 +987,66 @@ struct GameObjectInstance
 
 	float time;
 	std::string ClipName;
+	SkinnedObject::ClipHandle clip;
 	std::vector<XMFLOAT4X4> transforms;
+	// keyframe cursor of every bone in clip
+	std::vector<UINT> cursors;
 
 	GameObjectInstance() :
 		obj(nullptr),
 		world(XMMatrixIdentity()),
-		time(0)
+		time(0),
+		clip(SkinnedObject::InvalidClip)
 	{}
 
+	// resolves the clip handle and sizes transforms and cursors, obj must be set; returns false for
+	// a name obj doesn't have, the bones then stay at the identity and update does nothing
+	bool SetClip(const std::string& name);
+
+	// no allocation once SetClip was called and scratch has grown to the skeleton
+	void update(float dt, SkinnedObject::Scratch& scratch);
+};
+
+// animates many instances of skinned objects at once, over chunks of instances on mThreadPool if set;
+// the bone transforms of all of them go to one palette, ready to upload, and don't depend on the threads
+class CrowdAnimation
+{
+public:
+	ThreadPool* mThreadPool;
+
+	CrowdAnimation() :
+		mThreadPool(nullptr)
+	{}
+
+	// data must outlive the crowd, returns the index of the instance
+	UINT AddInstance(const SkinnedObject& data, SkinnedObject::ClipHandle clip, float time = 0.0f);
+	void clear();
+
+	UINT GetInstanceCount() const { return static_cast<UINT>(mSkinnedData.size()); }
+	float GetTime(UINT instance) const { return mTimes[instance]; }
+	// the bone transforms of an instance, as SkinnedObject::GetTransforms
+	const XMFLOAT4X4* GetTransforms(UINT instance) const { return &mPalette[mPaletteOffsets[instance]]; }
+	UINT GetBoneCount(UINT instance) const { return mSkinnedData[instance]->GetBoneCount(); }
+	// the bone transforms of all the instances in order
+	const std::vector<XMFLOAT4X4>& GetPalette() const { return mPalette; }
+
+	// GameObjectInstance::update for every instance, no allocation per instance
 	void update(float dt);
+
+private:
+	static const UINT ChunkSize = 64;
+
+	std::vector<const SkinnedObject*> mSkinnedData;
+	std::vector<SkinnedObject::ClipHandle> mClips;
+	std::vector<float> mTimes;
+	// first bone of each instance in mPalette and mCursors
+	std::vector<UINT> mPaletteOffsets;
+
+	std::vector<XMFLOAT4X4> mPalette;
+	// keyframe cursor of every bone of every instance
+	std::vector<UINT> mCursors;
+	// one per chunk, a chunk runs on one thread
+	std::vector<SkinnedObject::Scratch> mScratches;
 };
 
 struct Model3DMaterial
@@ -528,9 +1068,12 @@ public:
 			  std::vector<Model3DMaterial>& materials,
 			  SkinnedObject* SkinnedData = nullptr);
 
+	// the triangles are reordered for the vertex cache, before and after get its stats if set
 	bool load(const std::string& filename,
 			  TextureManager& manager,
-			  GameObject& obj);
+			  GameObject& obj,
+			  MeshOptimizer::CacheStats* before = nullptr,
+			  MeshOptimizer::CacheStats* after = nullptr);
 
 private:
 	void LoadVertices(std::ifstream& ifs, UINT count, std::vector<GeometryGenerator::Vertex>& vertices, bool skinned = false);
@@ -540,7 +1083,7 @@ private:
 	
 	void LoadBoneOffsets(std::ifstream& ifs, UINT count, std::vector<XMFLOAT4X4>& offsets);
 	void LoadBoneHierarchy(std::ifstream& ifs, UINT count, std::vector<UINT>& hierarchy);
-	void LoadAnimationClips(std::ifstream& ifs, UINT BoneCount, UINT ClipCount, std::map<std::string, AnimationClip>& animations);
+	void LoadAnimationClips(std::ifstream& ifs, UINT BoneCount, UINT ClipCount, std::vector<AnimationClip>& animations, std::map<std::string, SkinnedObject::ClipHandle>& handles);
 	void LoadAnimation(std::ifstream& ifs, UINT count, AnimationObject& animation);
 };
 
@@ -702,7 +1245,8 @@ class ShadowMap
 	ID3D11Buffer* mPerObjectCB;
 
 	ID3D11VertexShader* mVertexShader[2];
-	ID3D11InputLayout* mInputLayout[2];
+	// static, skinned, static on split streams
+	ID3D11InputLayout* mInputLayout[3];
 	ID3D11PixelShader* mPixelShader[2];
 
 	ID3D11RasterizerState* mRasterizerState;
@@ -732,7 +1276,8 @@ public:
 	static_assert((sizeof(PerObjectCB) % 16) == 0, "constant buffer size must be 16-byte aligned");
 
 	ID3D11VertexShader* GetVS(bool IsSkinned = false);
-	ID3D11InputLayout* GetIL(bool IsSkinned = false);
+	// split stream layouts are for static objects, see GameObject::mSplitVertexBuffers
+	ID3D11InputLayout* GetIL(bool IsSkinned = false, bool IsSplit = false);
 	ID3D11PixelShader* GetPS(bool IsAlphaClipping = false);
 	ID3D11RasterizerState* GetRS();
 	ID3D11SamplerState*& GetSS(); // return reference to pointer
@@ -750,7 +1295,8 @@ class SSAO
 	ID3D11RenderTargetView* mNormalDepthRTV;
 	ID3D11ShaderResourceView* mNormalDepthSRV;
 	ID3D11VertexShader* mNormalDepthVS[2];
-	ID3D11InputLayout* mNormalDepthIL[2];
+	// static, skinned, static on split streams
+	ID3D11InputLayout* mNormalDepthIL[3];
 	ID3D11PixelShader* mNormalDepthPS[2];
 	ID3D11Buffer* mNormalDepthCB;
 	ID3D11SamplerState* mNormalDepthSS;
@@ -823,7 +1369,7 @@ public:
 
 	ID3D11Buffer*& GetNormalDepthCB();
 	ID3D11VertexShader* GetNormalDepthVS(bool IsSkinned = false);
-	ID3D11InputLayout* GetNormalDepthIL(bool IsSkinned = false);
+	ID3D11InputLayout* GetNormalDepthIL(bool IsSkinned = false, bool IsSplit = false);
 	ID3D11PixelShader* GetNormalDepthPS(bool IsAlphaClipping = false);
 
 	ID3D11ShaderResourceView*& GetNormalDepthSRV();
@@ -833,18 +1379,180 @@ public:
 	DebugQuad mDebugQuad;
 };
 
+// heightmap split in square tiles of floats, each tile is memory mapped on demand and
+// the least recently used ones are unmapped, so only a bounded window of the map is resident
+class TiledHeightMap
+{
+public:
+	// "THM1" files store float tiles, "THC1" files store compressed tiles of 16-bit steps of
+	// mHeightStep above mMinHeight, located by a table of UINT64 file offsets after the header
+	struct Header
+	{
+		char mMagic[4];
+		UINT mWidth;
+		UINT mDepth;
+		UINT mTileSize;
+		float mMinHeight;
+		float mHeightStep;
+	};
+
+	// views must start at a multiple of the allocation granularity, float tiles are padded to it
+	static const UINT FileAlignment = 65536;
+
+	// RAW heightmap texel formats, 16-bit texels are little endian
+	enum RawFormat
+	{
+		RawR8,
+		RawR16,
+		RawR32F
+	};
+
+	TiledHeightMap();
+	~TiledHeightMap();
+
+	// reads count texels, integer texels are scaled to [0, HeightScale] and float texels by HeightScale
+	static bool ReadRaw(std::istream& is, RawFormat format, float HeightScale, float* heights, size_t count);
+
+	// converts a RAW heightmap, reading TileSize rows at a time (twice when compressing, for the height range);
+	// texels past the right and bottom edges repeat the last column/row
+	static bool Convert(const std::wstring& RawFileName,
+						UINT width,
+						UINT depth,
+						float HeightScale,
+						UINT TileSize,
+						const std::wstring& TiledFileName,
+						RawFormat format = RawR8,
+						bool IsCompressed = false);
+
+	bool Open(const std::wstring& FileName);
+	void Close();
+
+	UINT GetWidth() const { return mHeader.mWidth; }
+	UINT GetDepth() const { return mHeader.mDepth; }
+	UINT GetTileSize() const { return mHeader.mTileSize; }
+	UINT GetTileRows() const { return mTileRows; }
+	UINT GetTileCols() const { return mTileCols; }
+	bool IsCompressed() const { return mIsCompressed; }
+
+	// maps the tiles within radius texels of (row, col), mMaxResidentTiles should cover them;
+	// compressed tiles missing are decoded on mThreadPool if set
+	void Update(float row, float col, float radius);
+
+	// maps (or decodes) the tile if needed and evicts the least recently used ones beyond mMaxResidentTiles,
+	// the pointer is valid until the next call that maps a tile; not thread safe, nor is GetHeight
+	const float* GetTile(UINT ti, UINT tj);
+	// row and col are clamped to the map
+	float GetHeight(int row, int col);
+
+	UINT mMaxResidentTiles;
+	ThreadPool* mThreadPool;
+
+private:
+	struct Tile
+	{
+		const void* mView; // float tiles
+		std::vector<float> mDecoded; // compressed tiles
+		const float* mHeights;
+		UINT64 mLastUse;
+	};
+
+	// rows of Rice codes of the zigzagged MED prediction residuals, k (4 bits) chosen per row;
+	// quotients of EscapeQuotient or more are followed by the raw 17-bit residual instead
+	static const UINT EscapeQuotient = 24;
+
+	static USHORT Predict(const USHORT* texels, UINT size, UINT r, UINT c);
+	static void EncodeTile(const USHORT* texels, UINT size, std::vector<BYTE>& bytes);
+	static bool DecodeTile(const BYTE* bytes, size_t count, UINT size, USHORT* texels);
+	// maps the compressed bytes of the tile and decodes them, thread safe
+	bool DecodeTile(UINT index, std::vector<float>& heights) const;
+	void UnmapTile(UINT index);
+
+	HANDLE mFile;
+	HANDLE mMapping;
+	Header mHeader;
+	UINT mTileRows;
+	UINT mTileCols;
+	UINT64 mTileStride;
+	bool mIsCompressed;
+	std::vector<UINT64> mTileOffsets;
+
+	std::vector<Tile> mTiles;
+	std::vector<UINT> mResidentTiles;
+	UINT64 mClock;
+};
+
 class TerrainObject
 {
 public:
+	// a layer's weight is 1 inside both ranges and fades to 0 over Falloff outside them,
+	// height is normalized by HeightScale and slope is 1 - normal.y (0 = flat, 1 = vertical)
+	struct BlendRule
+	{
+		float MinHeight;
+		float MaxHeight;
+		float MinSlope;
+		float MaxSlope;
+		float Falloff;
+	};
+
 	struct InitInfo
 	{
 		std::wstring HeightMapFileName;
+		// 16-bit and float RAW files need far less smoothing than 8-bit ones
+		TiledHeightMap::RawFormat HeightMapFormat;
+		// if set, heights are streamed from this file (see TiledHeightMap) and HeightMapFileName,
+		// HeightMapWidth/Depth and the smoothing settings are ignored
+		std::wstring TiledHeightMapFileName;
+		float StreamingRadius; // world units
+		UINT MaxResidentTiles;
 		std::vector<std::wstring> LayerMapFileName;
+		// if empty the blend map is baked from BlendRules, one rule per channel and layer 1 to 4 in
+		// LayerMapFileName order; each channel blends its layer over the ones before (see TerrainPS.hlsl);
+		// streaming mode bakes nothing and needs the file for more than the first layer
 		std::wstring BlendMapFileName;
+		BlendRule BlendRules[4];
 		float HeightScale;
 		UINT HeightMapWidth;
 		UINT HeightMapDepth;
 		float CellSpacing;
+		// box filter of (2 * SmoothRadius + 1)^2 texels applied SmoothPasses times, 0 passes = no smoothing
+		UINT SmoothRadius;
+		UINT SmoothPasses;
+		// if both file names are empty the heights are generated with fBm gradient noise scaled to
+		// [0, HeightScale] instead, the smoothing settings are ignored; frequency is in cycles per cell
+		UINT NoiseSeed;
+		UINT NoiseOctaves;
+		float NoiseFrequency;
+		float NoiseLacunarity;
+		float NoiseGain;
+		bool IsNoiseRidged;
+		// domain warp offset in cells, 0 = no warp
+		float NoiseWarp;
+
+		InitInfo() :
+			HeightMapFormat(TiledHeightMap::RawR8),
+			StreamingRadius(256.0f),
+			MaxResidentTiles(64),
+			HeightScale(1.0f),
+			HeightMapWidth(0),
+			HeightMapDepth(0),
+			CellSpacing(1.0f),
+			SmoothRadius(1),
+			SmoothPasses(1),
+			NoiseSeed(0),
+			NoiseOctaves(8),
+			NoiseFrequency(1.0f / 256.0f),
+			NoiseLacunarity(2.0f),
+			NoiseGain(0.5f),
+			IsNoiseRidged(false),
+			NoiseWarp(0.0f)
+		{
+			// grass, dark dirt in the lowlands, stone on steep slopes, light dirt halfway up, snow on the tops
+			BlendRules[0] = { 0.00f, 0.25f, 0.0f, 1.0f, 0.10f };
+			BlendRules[1] = { 0.00f, 1.00f, 0.3f, 1.0f, 0.10f };
+			BlendRules[2] = { 0.45f, 0.70f, 0.0f, 0.3f, 0.10f };
+			BlendRules[3] = { 0.75f, 1.00f, 0.0f, 0.4f, 0.05f };
+		}
 	};
 
 	ID3D11VertexShader* mVertexShader;
@@ -855,6 +1563,8 @@ public:
 
 	ID3D11Buffer* mPatchQuadVB;
 	ID3D11Buffer* mPatchQuadIB;
+	// dynamic, only the patches kept by the last UpdateVisiblePatches
+	ID3D11Buffer* mVisiblePatchQuadIB;
 
 	struct VertexData
 	{
@@ -863,26 +1573,83 @@ public:
 		XMFLOAT2 BoundsY;
 	};
 
+	enum BrushMode
+	{
+		BrushAdd,     // add strength at the center
+		BrushFlatten, // blend towards height
+		BrushSmooth   // blend towards the 3x3 average
+	};
+
+	struct Brush
+	{
+		BrushMode mode;
+		// center in terrain local space
+		float x;
+		float z;
+		float radius;
+		// height delta at the center for BrushAdd, blend factor at the center in [0, 1] otherwise
+		float strength;
+		// BrushFlatten target
+		float height;
+	};
+
 	InitInfo mInitInfo;
 
 	XMMATRIX mWorld;
 	Material mMaterial;
 
+	ID3D11Texture2D* mHeightMapTexture;
 	ID3D11ShaderResourceView* mHeightMapSRV;
 	ID3D11ShaderResourceView* mLayerMapArraySRV;
 	ID3D11ShaderResourceView* mBlendMapSRV;
+	// baked by BakeMaps, R8G8B8A8_SNORM; null in streaming mode, TerrainPS.hlsl then uses the heights
+	ID3D11Texture2D* mNormalMapTexture;
+	ID3D11ShaderResourceView* mNormalMapSRV;
+	// only if the blend map is baked, null when it comes from BlendMapFileName
+	ID3D11Texture2D* mBlendMapTexture;
 
 	ID3D11SamplerState* mHeightMapSS;
 
 	UINT mPatchQuadVertices;
 	UINT mPatchQuadFaces;
+	UINT mVisiblePatchQuadFaces;
+
+	// last UpdateVisiblePatches result, see CullPatches
+	std::vector<UINT> mVisiblePatches;
+	std::vector<float> mVisiblePatchDistances;
+
+	// if set, load time processing of the heightmap runs over blocks of rows on the pool,
+	// and batched ray casts over blocks of rays
+	ThreadPool* mThreadPool;
 
 private:
 	void LoadHeightMap(TextureManager& manager);
+	void GenerateHeightMap();
 	void SmoothHeightMap();
-	bool IsInBounds(int i, int j);
-	float average(int i, int j);
-	void ComputePatchBoundsY(UINT i, UINT j);
+	void BuildMinMaxPyramid();
+	void BuildPatchPyramid();
+	// in patches, like UpdateMinMaxPyramid
+	void UpdatePatchPyramid(UINT FirstRow, UINT FirstCol, UINT LastRow, UINT LastCol);
+	// a texel on a patch border belongs to the patches on both sides,
+	// texels past the last patch (map size not a multiple of the patch size) belong to none
+	static void GetPatchRange(UINT texel, UINT patches, UINT& first, UINT& last);
+	// patches covering the texels of dirty, false if none
+	bool GetDirtyPatches(const D3D11_BOX& dirty, UINT& FirstRow, UINT& FirstCol, UINT& LastRow, UINT& LastCol) const;
+	BoundingBox GetPatchNodeBox(UINT level, UINT i, UINT j) const;
+	void CullPatchNode(const BoundingFrustum& frustum, FXMVECTOR eye, UINT level, UINT i, UINT j, bool IsInside,
+					   std::vector<UINT>& patches, std::vector<float>& distances) const;
+	void ComputeStreamedPatchBoundsY();
+	void UploadStreamedHeightMap(ID3D11DeviceContext* context, ID3D11Texture2D* texture);
+	float GetTexel(int i, int j) const;
+	// dir must be unit length, dist is the max distance on input and the hit distance on output
+	bool IntersectCell(FXMVECTOR origin, FXMVECTOR dir, UINT row, UINT col, float& dist) const;
+	bool TraverseMinMaxPyramid(FXMVECTOR origin, FXMVECTOR dir, float& dist) const;
+	bool MarchCells(FXMVECTOR origin, FXMVECTOR dir, float& dist) const;
+	void ForEachRowBlock(UINT rows, const std::function<void(UINT, UINT)>& func);
+	// normals and blend weights of the texels [FirstCol, LastCol] of a row from the rows around it,
+	// the rows above and below are the row itself at the edges; blend is null if it isn't baked
+	void BakeRow(const float* above, const float* row, const float* below, UINT FirstCol, UINT LastCol,
+				 DirectX::PackedVector::XMBYTEN4* normals, DirectX::PackedVector::XMUBYTEN4* blend) const;
 
 	// each patch has CellsPerPatch cells and CellsPerPatch+1 vertices
 	// 64 = max tessellation factor
@@ -891,18 +1658,89 @@ private:
 	UINT mPatchQuadRows;
 	UINT mPatchQuadCols;
 
-	std::vector<XMFLOAT2> mPatchBoundsY;
 	std::vector<float> mHeightMap;
 
+	// min/max height pyramid, level 0 has one entry per cell (2x2 texels) and each level above
+	// merges 2x2 entries of the one below, so a patch's bounds are an entry of level log2(CellsPerPatch)
+	struct MinMaxLevel
+	{
+		UINT mRows;
+		UINT mCols;
+		std::vector<XMFLOAT2> mBounds;
+	};
+
+	std::vector<MinMaxLevel> mMinMaxPyramid;
+
+	// same layout over the patch grid, level 0 has one entry per patch, the quadtree CullPatches walks
+	std::vector<MinMaxLevel> mPatchPyramid;
+
+	// CPU copy of mPatchQuadVB, the BoundsY of deformed patches are uploaded from it
+	std::vector<VertexData> mPatchQuadVertexData;
+
+	// CPU copies of the baked maps, one entry per texel; mBlendMap is empty if it isn't baked,
+	// both are empty in streaming mode
+	std::vector<DirectX::PackedVector::XMBYTEN4> mNormalMap;
+	std::vector<DirectX::PackedVector::XMUBYTEN4> mBlendMap;
+
+	// streaming mode only, mHeightMap and the pyramid are empty then
+	std::unique_ptr<TiledHeightMap> mTiledHeightMap;
+	std::vector<XMFLOAT2> mPatchBoundsY;
+
 public:
 	TerrainObject();
 	~TerrainObject();
 
 	float GetWidth() const;
 	float GetDepth() const;
+	// positions outside the terrain are clamped to its edges; in streaming mode GetHeight, GetHeights and
+	// Raycast page tiles in and out of the shared cache (see TiledHeightMap::GetTile), so they are not
+	// thread safe there and must not run concurrently with each other or with UpdateStreaming
 	float GetHeight(float x, float z) const;
-
-	void init(ID3D11Device* device, ID3D11DeviceContext* context, TextureManager& manager, const InitInfo& info);
+	// batched GetHeight with identical results, optionally also returns the surface normals
+	void GetHeights(const float* xs, const float* zs, float* out, size_t n, XMFLOAT3* normals = nullptr) const;
+
+	// first hit of origin + t * dir with t in [0, MaxT] against the triangles GetHeight interpolates,
+	// in terrain local space; dir need not be unit length, so a segment is dir = end - origin and MaxT = 1
+	bool Raycast(FXMVECTOR origin, FXMVECTOR dir, float MaxT, float& t) const;
+	// one Raycast per ray over blocks of rays on mThreadPool, t = FLT_MAX for the rays that miss
+	void Raycast(const XMFLOAT3* origins, const XMFLOAT3* dirs, float MaxT, float* t, size_t n) const;
+
+	// level 0 = cells, an entry of level k covers 2^k x 2^k cells (clamped to the heightmap)
+	UINT GetMinMaxLevels() const { return static_cast<UINT>(mMinMaxPyramid.size()); }
+	UINT GetMinMaxRows(UINT level) const { return mMinMaxPyramid[level].mRows; }
+	UINT GetMinMaxCols(UINT level) const { return mMinMaxPyramid[level].mCols; }
+	XMFLOAT2 GetMinMax(UINT level, UINT i, UINT j) const { return mMinMaxPyramid[level].mBounds[i * mMinMaxPyramid[level].mCols + j]; }
+	XMFLOAT2 GetPatchBoundsY(UINT i, UINT j) const;
+
+	// call after the heights in rows [FirstRow, LastRow] and cols [FirstCol, LastCol] changed,
+	// only the entries covering them are recomputed
+	void UpdateMinMaxPyramid(UINT FirstRow, UINT FirstCol, UINT LastRow, UINT LastCol);
+
+	// edits the heights under the brush and the bounds covering them, dirty gets the texels changed;
+	// returns false if nothing changed, streaming mode can't be deformed
+	bool Deform(const Brush& brush, D3D11_BOX& dirty);
+	// uploads the dirty texels and the patch bounds covering them, and rebakes the maps around them
+	void UploadDeformation(ID3D11DeviceContext* context, const D3D11_BOX& dirty);
+
+	// recomputes the normal map and the baked blend map over rows [FirstRow, LastRow] and
+	// cols [FirstCol, LastCol], over blocks of rows on mThreadPool; the result doesn't depend on it
+	void BakeMaps(UINT FirstRow, UINT FirstCol, UINT LastRow, UINT LastCol);
+	const std::vector<DirectX::PackedVector::XMBYTEN4>& GetNormalMap() const { return mNormalMap; }
+	const std::vector<DirectX::PackedVector::XMUBYTEN4>& GetBlendMap() const { return mBlendMap; }
+
+	// quadtree frustum culling of the patches, needs no device; frustum and eye are in terrain local space,
+	// patches gets the visible patch indices (i * (mPatchQuadCols - 1) + j) roughly front to back and
+	// distances the distance from eye to each one's box, the hull shader's tessellation input
+	void CullPatches(const BoundingFrustum& frustum, FXMVECTOR eye, std::vector<UINT>& patches, std::vector<float>& distances) const;
+	// culls against the camera and refills mVisiblePatchQuadIB, call once per frame before drawing with it
+	void UpdateVisiblePatches(ID3D11DeviceContext* context, const CameraObject& camera);
+
+	bool IsStreaming() const { return mTiledHeightMap != nullptr; }
+	// pages in the tiles around the camera, call once per frame in streaming mode
+	void UpdateStreaming(const CameraObject& camera);
+
+	// false if the tiled heightmap can't be opened or the heightmap is smaller than 2 x 2 texels
+	bool init(ID3D11Device* device, ID3D11DeviceContext* context, TextureManager& manager, const InitInfo& info);
 };
 
 class ParticleSystem